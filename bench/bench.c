@@ -0,0 +1,696 @@
+/*
+ * utftp-bench - Load generator and benchmark for utftp
+ *
+ * Runs many simulated TFTP clients from one epoll loop, each doing RRQs
+ * and WRQs back to back with a block size and file size picked from the
+ * configured mixes, and prints one JSON object describing the run so it
+ * can be diffed against a baseline. Packets are built and parsed with
+ * the server's own src/packet.c.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include "../include/packet.h"
+
+#define MAX_MIX             16      /* Entries in -b and -f lists */
+#define MAX_RETRIES         5
+#define SCAN_MS             10      /* Retransmit deadlines are checked this often */
+
+typedef struct {
+    int             sock;
+    int             busy;
+    int             write;              /* WRQ, else RRQ */
+    size_t          blksize;
+    unsigned        windowsize;
+    uint64_t        size;               /* File size, known up front for both directions */
+    uint64_t        block;              /* RRQ: last block received in order; WRQ: last acknowledged */
+    uint64_t        bytes;
+    uint64_t        start;              /* ns */
+    uint64_t        deadline;
+    int             retries;
+    int             connected;          /* Replies come from the server's transfer port */
+    struct sockaddr_in peer;
+    uint8_t        *last;               /* Packet resent on timeout */
+    size_t          last_len;
+} client_t;
+
+static struct {
+    const char     *host;
+    uint16_t        port;
+    int             concurrency;
+    long            transfers;          /* Stop after this many... */
+    double          duration;           /* ...or this many seconds */
+    int             write_percent;
+    unsigned        windowsize;
+    int             timeout_ms;
+    size_t          blksizes[MAX_MIX];
+    int             blksize_count;
+    uint64_t        sizes[MAX_MIX];
+    int             size_count;
+    const char     *root;               /* Download files are created here, uploads removed */
+    int             pid;                /* Server, for its CPU time */
+    const char     *label;
+} opt = {
+    .host = "127.0.0.1",
+    .port = 6969,
+    .concurrency = 256,
+    .write_percent = 20,
+    .windowsize = 1,
+    .timeout_ms = 1000,
+};
+
+static struct {
+    long            started;
+    long            completed;
+    long            failed;
+    long            aborted;            /* Still running when -d ran out */
+    long            rrq;
+    long            wrq;
+    uint64_t        bytes;
+    uint64_t        retransmits;
+    uint64_t       *times;              /* Completion times, ns */
+    long            times_cap;
+} stats;
+
+static struct sockaddr_in server_addr;
+static int epfd = -1;
+static uint8_t *payload;                /* WRQ data, the largest block size */
+static volatile sig_atomic_t stop_requested;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void on_signal(int sig)
+{
+    (void)sig;
+    stop_requested = 1;
+}
+
+/* "4K,64K,1M": sizes with K/M/G in powers of 1024 */
+static int parse_list(const char *str, uint64_t *out, int max)
+{
+    int count = 0;
+    const char *p = str;
+
+    while (*p && count < max) {
+        char *end;
+        double v = strtod(p, &end);
+        switch (*end) {
+            case 'k': case 'K': v *= 1024; end++; break;
+            case 'm': case 'M': v *= 1024 * 1024; end++; break;
+            case 'g': case 'G': v *= 1024.0 * 1024 * 1024; end++; break;
+        }
+        if (end == p || v < 0 || (*end != ',' && *end != '\0'))
+            return -1;
+        out[count++] = (uint64_t)v;
+        p = (*end == ',') ? end + 1 : end;
+    }
+    return *p ? -1 : count;
+}
+
+static void download_name(char *buf, size_t len, uint64_t size)
+{
+    snprintf(buf, len, "bench-%llu.bin", (unsigned long long)size);
+}
+
+static void upload_name(char *buf, size_t len, int slot)
+{
+    snprintf(buf, len, "bench-up-%d.bin", slot);
+}
+
+/* Files for the RRQ mix, written once into --root */
+static int create_files(void)
+{
+    static uint8_t chunk[65536];
+    for (size_t i = 0; i < sizeof(chunk); i++)
+        chunk[i] = (uint8_t)(i * 131 + 7);
+
+    for (int i = 0; i < opt.size_count; i++) {
+        char name[64], path[4096];
+        download_name(name, sizeof(name), opt.sizes[i]);
+        snprintf(path, sizeof(path), "%s/%s", opt.root, name);
+
+        int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            fprintf(stderr, "Cannot create %s: %s\n", path, strerror(errno));
+            return -1;
+        }
+        for (uint64_t left = opt.sizes[i]; left > 0; ) {
+            size_t n = left < sizeof(chunk) ? left : sizeof(chunk);
+            if (write(fd, chunk, n) != (ssize_t)n) {
+                fprintf(stderr, "Cannot write %s: %s\n", path, strerror(errno));
+                close(fd);
+                return -1;
+            }
+            left -= n;
+        }
+        close(fd);
+    }
+    return 0;
+}
+
+static void remove_uploads(void)
+{
+    for (int i = 0; i < opt.concurrency; i++) {
+        char name[64], path[4096];
+        upload_name(name, sizeof(name), i);
+        snprintf(path, sizeof(path), "%s/%s", opt.root, name);
+        unlink(path);
+    }
+}
+
+/* utime + stime of the server, in seconds; -1 when unknown */
+static double server_cpu(void)
+{
+    if (opt.pid <= 0)
+        return -1;
+
+    char path[64], buf[1024];
+    snprintf(path, sizeof(path), "/proc/%d/stat", opt.pid);
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+    ssize_t n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0)
+        return -1;
+    buf[n] = '\0';
+
+    /* Fields after the parenthesised command name: utime and stime are 14 and 15 */
+    char *p = strrchr(buf, ')');
+    if (!p)
+        return -1;
+    unsigned long long utime, stime;
+    if (sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu",
+               &utime, &stime) != 2)
+        return -1;
+    return (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+static void client_send(client_t *c, uint8_t *buf, size_t len)
+{
+    const struct sockaddr_in *to = c->connected ? &c->peer : &server_addr;
+
+    if (buf != c->last)
+        memcpy(c->last, buf, len);
+    c->last_len = len;
+    sendto(c->sock, c->last, len, 0, (const struct sockaddr *)to, sizeof(*to));
+}
+
+/* Retransmit deadline from now */
+static void client_arm(client_t *c)
+{
+    c->deadline = now_ns() + (uint64_t)opt.timeout_ms * 1000000ull;
+}
+
+/* Only a transfer that moves on earns its retries back */
+static void client_progress(client_t *c)
+{
+    c->retries = 0;
+    client_arm(c);
+}
+
+static void client_ack(client_t *c, uint64_t block)
+{
+    uint8_t buf[4];
+    client_send(c, buf, packet_build_ack(buf, (uint16_t)block));
+}
+
+/* Payload of an upload block: 1-based, the last one is short and may be empty */
+static size_t block_len(const client_t *c, uint64_t block)
+{
+    uint64_t off = (block - 1) * c->blksize;
+    if (off >= c->size)
+        return 0;
+    return c->size - off < c->blksize ? c->size - off : c->blksize;
+}
+
+static void client_data(client_t *c, uint64_t block)
+{
+    size_t len = block_len(c, block);
+    packet_build_data(c->last, (uint16_t)block, payload, len);
+    client_send(c, c->last, 4 + len);
+}
+
+static int client_start(client_t *c, int slot)
+{
+    static unsigned seed = 1;
+    char name[64];
+    tftp_options_t req;
+
+    /* A fresh port per transfer, as real clients use, so strays from the last one are not taken for replies */
+    if (c->sock >= 0)
+        close(c->sock);
+    c->sock = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (c->sock < 0) {
+        fprintf(stderr, "Cannot create client socket: %s\n", strerror(errno));
+        return -1;
+    }
+    int rcvbuf = 1 << 20;
+    setsockopt(c->sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = c };
+    epoll_ctl(epfd, EPOLL_CTL_ADD, c->sock, &ev);
+
+    memset(&req, 0, sizeof(req));
+    c->write = (int)(rand_r(&seed) % 100) < opt.write_percent;
+    c->blksize = opt.blksizes[rand_r(&seed) % opt.blksize_count];
+    c->size = opt.sizes[rand_r(&seed) % opt.size_count];
+    c->windowsize = c->write ? 1 : opt.windowsize;
+    c->block = 0;
+    c->bytes = 0;
+    c->retries = 0;
+    c->connected = 0;
+    c->busy = 1;
+    c->start = now_ns();
+
+    req.blksize = c->blksize;
+    req.has_tsize = 1;
+    req.tsize = c->write ? c->size : 0;
+    if (c->windowsize > 1) {
+        req.windowsize = c->windowsize;
+        req.has_windowsize = 1;
+    }
+
+    if (c->write)
+        upload_name(name, sizeof(name), slot);
+    else
+        download_name(name, sizeof(name), c->size);
+
+    stats.started++;
+    client_send(c, c->last, packet_build_request(c->last, c->write ? TFTP_WRQ : TFTP_RRQ,
+                                                 name, "octet", &req));
+    client_arm(c);
+    return 0;
+}
+
+static void client_done(client_t *c, int ok)
+{
+    c->busy = 0;
+    if (!ok) {
+        stats.failed++;
+        return;
+    }
+
+    stats.completed++;
+    stats.bytes += c->bytes;
+    if (c->write)
+        stats.wrq++;
+    else
+        stats.rrq++;
+
+    if (stats.completed > stats.times_cap) {
+        stats.times_cap = stats.times_cap ? stats.times_cap * 2 : 4096;
+        stats.times = realloc(stats.times, stats.times_cap * sizeof(*stats.times));
+        if (!stats.times) {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+    }
+    stats.times[stats.completed - 1] = now_ns() - c->start;
+}
+
+/* The wire carries the low 16 bits of each block number */
+static int wire_is(uint16_t wire, uint64_t block)
+{
+    return wire == (uint16_t)block;
+}
+
+static void client_packet(client_t *c, uint8_t *buf, size_t len, const struct sockaddr_in *from)
+{
+    if (len < 4 || !c->busy)
+        return;
+
+    uint16_t opcode = (buf[0] << 8) | buf[1];
+    uint16_t wire = (buf[2] << 8) | buf[3];
+
+    int first = !c->connected;
+    if (first) {
+        /* A session left from an earlier transfer on this port may still be resending to it */
+        int answers = opcode == TFTP_OACK || opcode == TFTP_ERROR ||
+                      (opcode == TFTP_DATA && !c->write && wire == 1) ||
+                      (opcode == TFTP_ACK && c->write && wire == 0);
+        if (!answers)
+            return;
+        c->peer = *from;
+        c->connected = 1;
+    } else if (from->sin_port != c->peer.sin_port) {
+        return;
+    }
+
+    switch (opcode) {
+        case TFTP_OACK: {
+            /* A repeated OACK means our answer to it was lost: send it again, no credit */
+            if (!first) {
+                if (c->block == 0)
+                    client_send(c, c->last, c->last_len);
+                return;
+            }
+            client_progress(c);
+            tftp_options_t ack;
+            packet_parse_oack(buf, len, &ack);
+            c->blksize = ack.blksize;
+            c->windowsize = ack.has_windowsize ? ack.windowsize : 1;
+            if (c->write)
+                client_data(c, 1);
+            else
+                client_ack(c, 0);
+            break;
+        }
+
+        case TFTP_DATA: {
+            /* An RRQ answered without OACK runs on defaults */
+            if (c->write)
+                return;
+            if (c->block == 0 && !wire_is(wire, 1))
+                return;
+            if (!wire_is(wire, c->block + 1)) {
+                /* Out of order: ask again from what we hold (RFC 7440) */
+                client_ack(c, c->block);
+                return;
+            }
+            client_progress(c);
+            c->block++;
+            c->bytes += len - 4;
+            if (len - 4 < c->blksize) {
+                client_ack(c, c->block);
+                client_done(c, 1);
+            } else if (c->block % c->windowsize == 0) {
+                client_ack(c, c->block);
+            }
+            break;
+        }
+
+        case TFTP_ACK:
+            if (!c->write)
+                return;
+            /* ACK 0 stands in for the OACK when no options were accepted */
+            if (c->block == 0 && wire == 0) {
+                if (first)
+                    client_progress(c);
+                client_data(c, 1);
+                break;
+            }
+            if (!wire_is(wire, c->block + 1))
+                return;
+            client_progress(c);
+            c->block++;
+            c->bytes += block_len(c, c->block);
+            if (block_len(c, c->block) < c->blksize)
+                client_done(c, 1);
+            else
+                client_data(c, c->block + 1);
+            break;
+
+        case TFTP_ERROR:
+            fprintf(stderr, "Server error %u: %.*s\n", wire, (int)(len > 4 ? len - 5 : 0), buf + 4);
+            client_done(c, 0);
+            break;
+    }
+}
+
+static void client_timeouts(client_t *clients, uint64_t now)
+{
+    for (int i = 0; i < opt.concurrency; i++) {
+        client_t *c = &clients[i];
+        if (!c->busy || now < c->deadline)
+            continue;
+        if (++c->retries > MAX_RETRIES) {
+            client_done(c, 0);
+            continue;
+        }
+        stats.retransmits++;
+        client_send(c, c->last, c->last_len);
+        client_arm(c);
+    }
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile_ms(double p)
+{
+    if (stats.completed == 0)
+        return 0;
+    long i = (long)(p * (stats.completed - 1) + 0.5);
+    return stats.times[i] / 1e6;
+}
+
+static void print_json(double elapsed, double cpu)
+{
+    qsort(stats.times, stats.completed, sizeof(*stats.times), cmp_u64);
+
+    double mean = 0;
+    for (long i = 0; i < stats.completed; i++)
+        mean += stats.times[i] / 1e6;
+    if (stats.completed > 0)
+        mean /= stats.completed;
+
+    printf("{\n");
+    printf("  \"tool\": \"utftp-bench\",\n");
+    if (opt.label)
+        printf("  \"label\": \"%s\",\n", opt.label);
+    printf("  \"server\": \"%s:%u\",\n", opt.host, opt.port);
+    printf("  \"concurrency\": %d,\n", opt.concurrency);
+    printf("  \"write_percent\": %d,\n", opt.write_percent);
+    printf("  \"windowsize\": %u,\n", opt.windowsize);
+    printf("  \"blksizes\": [");
+    for (int i = 0; i < opt.blksize_count; i++)
+        printf("%s%zu", i ? ", " : "", opt.blksizes[i]);
+    printf("],\n  \"file_sizes\": [");
+    for (int i = 0; i < opt.size_count; i++)
+        printf("%s%llu", i ? ", " : "", (unsigned long long)opt.sizes[i]);
+    printf("],\n");
+    printf("  \"elapsed_sec\": %.3f,\n", elapsed);
+    printf("  \"transfers\": { \"completed\": %ld, \"failed\": %ld, \"aborted\": %ld, \"rrq\": %ld, \"wrq\": %ld },\n",
+           stats.completed, stats.failed, stats.aborted, stats.rrq, stats.wrq);
+    printf("  \"bytes\": %llu,\n", (unsigned long long)stats.bytes);
+    printf("  \"throughput_mib_per_sec\": %.2f,\n", elapsed > 0 ? stats.bytes / elapsed / 1048576.0 : 0);
+    printf("  \"requests_per_sec\": %.1f,\n", elapsed > 0 ? stats.completed / elapsed : 0);
+    printf("  \"completion_ms\": { \"mean\": %.3f, \"p50\": %.3f, \"p99\": %.3f, \"p999\": %.3f, \"max\": %.3f },\n",
+           mean, percentile_ms(0.5), percentile_ms(0.99), percentile_ms(0.999), percentile_ms(1.0));
+    printf("  \"retransmits\": %llu,\n", (unsigned long long)stats.retransmits);
+    if (cpu >= 0) {
+        printf("  \"server_cpu_sec\": %.3f,\n", cpu);
+        printf("  \"server_cpu_sec_per_gb\": %.3f\n",
+               stats.bytes > 0 ? cpu / (stats.bytes / 1e9) : 0);
+    } else {
+        printf("  \"server_cpu_sec\": null,\n");
+        printf("  \"server_cpu_sec_per_gb\": null\n");
+    }
+    printf("}\n");
+}
+
+static void usage(const char *prog)
+{
+    printf("utftp-bench - TFTP load generator\n\n");
+    printf("Usage: %s [options]\n\n", prog);
+    printf("Options:\n");
+    printf("  -s, --server HOST     Server address (default: 127.0.0.1)\n");
+    printf("  -p, --port PORT       Server port (default: 6969)\n");
+    printf("  -c, --clients N       Concurrent clients (default: 256)\n");
+    printf("  -n, --transfers N     Transfers to complete (default: 4 per client)\n");
+    printf("  -d, --duration SEC    Measure this long instead of -n, then abort what is running\n");
+    printf("  -w, --writes PCT      Share of transfers that are WRQs (default: 20)\n");
+    printf("  -b, --blksize LIST    Block sizes to pick from (default: 512,1428,8192)\n");
+    printf("  -f, --sizes LIST      File sizes to pick from, K/M/G (default: 16K,256K,2M)\n");
+    printf("  -W, --windowsize N    RFC 7440 window for downloads (default: 1)\n");
+    printf("  -t, --timeout MS      Client retransmit interval (default: 1000)\n");
+    printf("  -r, --root DIR        Server root: create the download files, remove uploads\n");
+    printf("  -P, --pid PID         Server process, to report its CPU per GB\n");
+    printf("  -l, --label TEXT      Tag the JSON result\n");
+    printf("  -h, --help            Show this help\n");
+}
+
+int main(int argc, char *argv[])
+{
+    static struct option long_opts[] = {
+        {"server",     required_argument, 0, 's'},
+        {"port",       required_argument, 0, 'p'},
+        {"clients",    required_argument, 0, 'c'},
+        {"transfers",  required_argument, 0, 'n'},
+        {"duration",   required_argument, 0, 'd'},
+        {"writes",     required_argument, 0, 'w'},
+        {"blksize",    required_argument, 0, 'b'},
+        {"sizes",      required_argument, 0, 'f'},
+        {"windowsize", required_argument, 0, 'W'},
+        {"timeout",    required_argument, 0, 't'},
+        {"root",       required_argument, 0, 'r'},
+        {"pid",        required_argument, 0, 'P'},
+        {"label",      required_argument, 0, 'l'},
+        {"help",       no_argument,       0, 'h'},
+        {0, 0, 0, 0}
+    };
+    const char *blksizes = "512,1428,8192";
+    const char *sizes = "16K,256K,2M";
+    int c;
+
+    while ((c = getopt_long(argc, argv, "s:p:c:n:d:w:b:f:W:t:r:P:l:h", long_opts, NULL)) != -1) {
+        switch (c) {
+            case 's': opt.host = optarg; break;
+            case 'p': opt.port = (uint16_t)atoi(optarg); break;
+            case 'c': opt.concurrency = atoi(optarg); break;
+            case 'n': opt.transfers = atol(optarg); break;
+            case 'd': opt.duration = atof(optarg); break;
+            case 'w': opt.write_percent = atoi(optarg); break;
+            case 'b': blksizes = optarg; break;
+            case 'f': sizes = optarg; break;
+            case 'W': opt.windowsize = (unsigned)atoi(optarg); break;
+            case 't': opt.timeout_ms = atoi(optarg); break;
+            case 'r': opt.root = optarg; break;
+            case 'P': opt.pid = atoi(optarg); break;
+            case 'l': opt.label = optarg; break;
+            case 'h': usage(argv[0]); return 0;
+            default:  usage(argv[0]); return 1;
+        }
+    }
+
+    uint64_t list[MAX_MIX];
+    opt.blksize_count = parse_list(blksizes, list, MAX_MIX);
+    for (int i = 0; i < opt.blksize_count; i++) {
+        if (list[i] < TFTP_MIN_BLKSIZE || list[i] > TFTP_MAX_BLKSIZE)
+            opt.blksize_count = -1;
+        else
+            opt.blksizes[i] = list[i];
+    }
+    opt.size_count = parse_list(sizes, opt.sizes, MAX_MIX);
+    if (opt.blksize_count <= 0 || opt.size_count <= 0 || opt.concurrency <= 0 ||
+        opt.write_percent < 0 || opt.write_percent > 100 ||
+        opt.windowsize < 1 || opt.windowsize > TFTP_MAX_WINDOWSIZE || opt.timeout_ms <= 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (opt.transfers <= 0 && opt.duration <= 0)
+        opt.transfers = 4L * opt.concurrency;
+
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(opt.port);
+    if (inet_pton(AF_INET, opt.host, &server_addr.sin_addr) != 1) {
+        fprintf(stderr, "Invalid server address: %s\n", opt.host);
+        return 1;
+    }
+
+    if (opt.root && create_files() < 0)
+        return 1;
+
+    /* One socket per client */
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < (rlim_t)opt.concurrency + 64) {
+        rl.rlim_cur = rl.rlim_max == RLIM_INFINITY || rl.rlim_max >= (rlim_t)opt.concurrency + 64 ?
+                      (rlim_t)opt.concurrency + 64 : rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    payload = calloc(1, TFTP_MAX_BLKSIZE);
+    uint8_t *rxbuf = malloc(TFTP_MAX_PACKET);
+    client_t *clients = calloc(opt.concurrency, sizeof(*clients));
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (!payload || !rxbuf || !clients || epfd < 0) {
+        fprintf(stderr, "Cannot set up clients: %s\n", strerror(errno));
+        return 1;
+    }
+
+    for (int i = 0; i < opt.concurrency; i++) {
+        clients[i].sock = -1;
+        clients[i].last = malloc(TFTP_MAX_PACKET);
+        if (!clients[i].last) {
+            fprintf(stderr, "Out of memory\n");
+            return 1;
+        }
+    }
+
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+
+    double cpu_before = server_cpu();
+    uint64_t begin = now_ns();
+    uint64_t end_at = opt.duration > 0 ? begin + (uint64_t)(opt.duration * 1e9) : 0;
+    uint64_t last_scan = begin;
+    struct epoll_event events[256];
+
+    uint64_t now;
+
+    for (;;) {
+        now = now_ns();
+
+        /* The measured window ends here: what is still running counts only its bytes so far */
+        if ((end_at && now >= end_at) || stop_requested) {
+            for (int i = 0; i < opt.concurrency; i++) {
+                if (clients[i].busy) {
+                    clients[i].busy = 0;
+                    stats.aborted++;
+                    stats.bytes += clients[i].bytes;
+                }
+            }
+            break;
+        }
+
+        /* Idle clients take the next transfer */
+        int active = 0;
+        for (int i = 0; i < opt.concurrency; i++) {
+            if (!clients[i].busy && (end_at || stats.started < opt.transfers) &&
+                client_start(&clients[i], i) < 0)
+                return 1;
+            active += clients[i].busy;
+        }
+        if (active == 0)
+            break;
+
+        int n = epoll_wait(epfd, events, 256, SCAN_MS);
+        for (int i = 0; i < n; i++) {
+            client_t *cl = events[i].data.ptr;
+            struct sockaddr_in from;
+            socklen_t fromlen;
+            ssize_t len;
+            do {
+                fromlen = sizeof(from);
+                len = recvfrom(cl->sock, rxbuf, TFTP_MAX_PACKET, 0, (struct sockaddr *)&from, &fromlen);
+                if (len > 0)
+                    client_packet(cl, rxbuf, (size_t)len, &from);
+            } while (len > 0);
+        }
+
+        now = now_ns();
+        if (now - last_scan >= SCAN_MS * 1000000ull) {
+            client_timeouts(clients, now);
+            last_scan = now;
+        }
+    }
+
+    double elapsed = (now - begin) / 1e9;
+    double cpu_after = server_cpu();
+    print_json(elapsed, cpu_before >= 0 && cpu_after >= 0 ? cpu_after - cpu_before : -1);
+
+    if (opt.root)
+        remove_uploads();
+    for (int i = 0; i < opt.concurrency; i++) {
+        if (clients[i].sock >= 0)
+            close(clients[i].sock);
+        free(clients[i].last);
+    }
+    close(epfd);
+    free(clients);
+    free(rxbuf);
+    free(payload);
+    free(stats.times);
+    return stats.failed > 0 ? 2 : 0;
+}
@@ -0,0 +1,62 @@
+/*
+ * utftp - Shared file block cache
+ */
+
+#ifndef UTFTP_CACHE_H
+#define UTFTP_CACHE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+struct tftp_server;
+struct tftp_session;
+typedef struct cache_block cache_block_t;
+
+/* Block result, same contract as fileio_cb_t */
+typedef int (*cache_cb_t)(struct tftp_session *sess, uint64_t block, ssize_t result);
+
+/* File identity: a rewritten file gets new keys and its old blocks age out */
+typedef struct {
+    uint64_t        dev;
+    uint64_t        ino;
+    int64_t         mtime;      /* ns */
+    uint64_t        size;
+    uint32_t        blksize;
+} cache_file_t;
+
+/* Identity of an open file as served with blksize */
+void cache_file_key(cache_file_t *key, const struct stat *st, size_t blksize);
+int  cache_file_equal(const cache_file_t *a, const cache_file_t *b);
+
+/* Session waiting on a block another read is filling; one per window slot */
+typedef struct cache_waiter {
+    struct tftp_session *sess;  /* NULL while not waiting */
+    uint64_t        block;
+    cache_cb_t      cb;
+    struct cache_waiter *next;
+} cache_waiter_t;
+
+/* Cache lifecycle: config.cache_mb split across workers, NULL when 0 */
+int  cache_init(struct tftp_server *srv);
+void cache_cleanup(struct tftp_server *srv);
+
+/* Key the session's open file; non-zero when its blocks can be cached */
+int  cache_attach(struct tftp_session *sess, const struct stat *st);
+
+/* Payload of a block held by a window slot */
+const uint8_t* cache_data(const cache_block_t *blk);
+
+/*
+ * Hold block in its window slot and run cb with its length: at once on a
+ * hit, or when the one read filling it completes. Returns cb's result when
+ * it ran inline, like fileio_read().
+ */
+int  cache_read(struct tftp_session *sess, uint64_t block, cache_cb_t cb);
+
+/* Drop the block held by one window slot, or by all of them */
+void cache_release(struct tftp_session *sess, unsigned slot);
+void cache_detach(struct tftp_session *sess);
+
+#endif /* UTFTP_CACHE_H */
@@ -0,0 +1,20 @@
+/*
+ * utftp - Event engine
+ */
+
+#ifndef UTFTP_EVENT_H
+#define UTFTP_EVENT_H
+
+#include "utftp.h"
+
+/* Event loop lifecycle */
+int  event_init(tftp_server_t *srv);
+void event_cleanup(tftp_server_t *srv);
+
+/* Register a socket once; ptr is handed back on readiness (NULL = main socket) */
+int  event_add(tftp_server_t *srv, int fd, void *ptr);
+
+/* Wait for readiness, returns number of entries filled in srv->events */
+int  event_wait(tftp_server_t *srv, int timeout_ms);
+
+#endif /* UTFTP_EVENT_H */
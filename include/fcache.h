@@ -0,0 +1,34 @@
+/*
+ * utftp - Open-file and metadata cache
+ */
+
+#ifndef UTFTP_FCACHE_H
+#define UTFTP_FCACHE_H
+
+#include <sys/stat.h>
+#include "utftp.h"
+
+/* Cache lifecycle: config.file_cache entries per worker, NULL when 0 */
+int  fcache_init(tftp_server_t *srv);
+void fcache_cleanup(tftp_server_t *srv);
+
+/*
+ * Open filename beneath the root for reading, as root_open() does, and
+ * fill st. A cached descriptor is shared: the session holds a reference
+ * until fcache_release(). Returns the fd or -errno.
+ */
+int  fcache_open(tftp_session_t *sess, const char *filename, struct stat *st);
+
+/* netascii_size() of the session's file, kept with its cache entry until the file changes */
+int64_t fcache_netascii_size(tftp_session_t *sess, uint64_t size);
+
+/* Drop the session's descriptor, closing it unless the cache keeps it */
+void fcache_release(tftp_session_t *sess);
+
+/* Forget filename ahead of its inotify events, when we are about to change it */
+void fcache_forget(tftp_server_t *srv, const char *filename);
+
+/* Apply pending inotify events */
+void fcache_events(tftp_server_t *srv);
+
+#endif /* UTFTP_FCACHE_H */
@@ -0,0 +1,77 @@
+/*
+ * utftp - File I/O engine
+ */
+
+#ifndef UTFTP_FILEIO_H
+#define UTFTP_FILEIO_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include "utftp.h"
+
+/*
+ * Completion for a file operation. tag is the caller's value from submission
+ * (the block number), result is bytes transferred or -errno.
+ * A non-zero return ends the session, like process_session_packet().
+ */
+typedef int (*fileio_cb_t)(tftp_session_t *sess, uint64_t tag, ssize_t result);
+
+/* Engine lifecycle (io_uring when enabled and available, else synchronous) */
+int  fileio_init(tftp_server_t *srv);
+void fileio_cleanup(tftp_server_t *srv);
+
+/* Non-zero when completions run later instead of inside the submit call */
+int  fileio_async(tftp_server_t *srv);
+
+/* Packet buffers, taken from the registered pool when one fits */
+uint8_t* fileio_buf_get(tftp_server_t *srv, size_t size, int *index);
+void fileio_buf_put(tftp_server_t *srv, uint8_t *buf, int index);
+
+/*
+ * Session file registration (fixed files) and teardown of in-flight work.
+ * fileio_detach() returns non-zero when it took over sess->last_packet
+ * because the kernel may still be using it.
+ */
+void fileio_attach(tftp_session_t *sess);
+int  fileio_detach(tftp_session_t *sess);
+
+/*
+ * Read-only mapping of sess->fd (size bytes) so DATA payloads go from the
+ * page cache straight into sendmsg. Only with synchronous I/O, where a
+ * page fault costs the loop no more than the pread it replaces.
+ */
+int  fileio_map(tftp_session_t *sess, size_t size);
+void fileio_unmap(tftp_session_t *sess);
+
+/* Whether the file still covers the whole mapping; checked before sending from it */
+int  fileio_map_intact(tftp_session_t *sess);
+
+/*
+ * Sequential-access hint for a download about to read at off: keeps the
+ * kernel reading a chunk ahead of it, sized from the ring and blksize
+ * and clipped to tsize, so cold blocks (NFS) are on their way early.
+ */
+void fileio_readahead(tftp_session_t *sess, uint64_t off);
+
+/* Positional block I/O on sess->fd; returns the completion's result when synchronous */
+int  fileio_read(tftp_session_t *sess, uint8_t *buf, size_t len, uint64_t off,
+                 uint64_t tag, fileio_cb_t cb);
+int  fileio_write(tftp_session_t *sess, const uint8_t *buf, size_t len, uint64_t off,
+                  uint64_t tag, fileio_cb_t cb);
+
+/* fdatasync of sess->fd, completing like a write with result 0 */
+int  fileio_sync(tftp_session_t *sess, uint64_t tag, fileio_cb_t cb);
+
+/*
+ * Read into a buffer the session does not own (the block cache). cb runs
+ * even if the session ends first, with sess NULL, and its result is ignored.
+ */
+int  fileio_read_shared(tftp_session_t *sess, uint8_t *buf, size_t len, uint64_t off,
+                        uint64_t tag, fileio_cb_t cb);
+
+/* Loop integration: push queued operations, run finished ones */
+void fileio_submit(tftp_server_t *srv);
+void fileio_complete(tftp_server_t *srv);
+
+#endif /* UTFTP_FILEIO_H */
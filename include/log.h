@@ -12,6 +12,11 @@
 #define LOG_ERROR    3
 #define LOG_CRITICAL 4
 
+/* Calls below this level are compiled out: make LOG_MIN_LEVEL=1 drops debug logging */
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL LOG_DEBUG
+#endif
+
 /* ANSI color codes */
 #define C_RESET   "\033[0m"
 #define C_BOLD    "\033[1m"
@@ -27,8 +32,23 @@
 extern int g_log_level;
 extern int g_use_color;
 
+/* Arguments are only evaluated when the level is enabled */
+#define log_msg(level, ...) \
+    do { \
+        if ((level) >= LOG_MIN_LEVEL && (level) >= g_log_level) \
+            log_write((level), __VA_ARGS__); \
+    } while (0)
+
 /* Functions */
-void log_msg(int level, const char *fmt, ...);
+void log_write(int level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
 void print_banner(void);
 
+/*
+ * Background writer: once started, messages are queued and written out by
+ * their own thread; before and after, they are written directly.
+ */
+int  log_start(void);
+void log_flush(void);
+void log_stop(void);
+
 #endif /* UTFTP_LOG_H */
@@ -0,0 +1,33 @@
+/*
+ * utftp - RFC 2090 multicast transfers
+ */
+
+#ifndef UTFTP_MCAST_H
+#define UTFTP_MCAST_H
+
+#include <stdint.h>
+#include <sys/stat.h>
+#include "utftp.h"
+#include "packet.h"
+
+/* Group table lifecycle */
+void mcast_init(tftp_server_t *srv);
+void mcast_cleanup(tftp_server_t *srv);
+
+/* Group behind an event pointer, or NULL */
+mcast_group_t* mcast_group_of(tftp_server_t *srv, void *ptr);
+
+/*
+ * Add an RRQ session to the group for its file, opening one if needed,
+ * and set the multicast option for its OACK. Returns 1 for the master,
+ * 0 for a member that waits, -1 to carry on unicast.
+ */
+int  mcast_join(tftp_session_t *sess, const struct stat *st, tftp_options_t *opts);
+
+/* Leave the group; a departing master hands over to the next member */
+void mcast_leave(tftp_session_t *sess);
+
+/* 64-bit block named by a member's 16-bit ACK */
+uint64_t mcast_ack_block(tftp_session_t *sess, uint16_t ack);
+
+#endif /* UTFTP_MCAST_H */
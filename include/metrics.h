@@ -0,0 +1,74 @@
+/*
+ * utftp - Metrics registry and Prometheus exporter
+ */
+
+#ifndef UTFTP_METRICS_H
+#define UTFTP_METRICS_H
+
+#include <stdint.h>
+
+struct tftp_server;
+
+#define METRIC_BUCKETS      16      /* Histogram buckets, +Inf excluded */
+
+/* Observations in integer units (bytes, ms), counted per bucket bound */
+typedef struct {
+    uint64_t        count;
+    uint64_t        sum;
+    uint64_t        buckets[METRIC_BUCKETS];
+} metric_hist_t;
+
+/*
+ * One worker's counters. Only that worker writes them, so an update is a
+ * plain load and store; the exporter reads them from its own thread.
+ */
+typedef struct {
+    uint64_t        sessions_active;
+    uint64_t        requests_rrq;
+    uint64_t        requests_wrq;
+    uint64_t        busy_rejections;
+    uint64_t        bytes_sent;
+    uint64_t        bytes_received;
+    uint64_t        retransmits;
+    uint64_t        timeouts;
+    uint64_t        send_dropped;       /* Mirrors the send queue's count */
+    metric_hist_t   blksize;            /* Bytes, per transfer */
+    metric_hist_t   duration_rrq;       /* ms, completed downloads */
+    metric_hist_t   duration_wrq;       /* ms, completed uploads */
+    metric_hist_t   ack_rtt;            /* ms, per sampled block */
+} tftp_metrics_t;
+
+/* Histogram bounds */
+extern const uint32_t metric_blksize_bounds[METRIC_BUCKETS];
+extern const uint32_t metric_duration_bounds[METRIC_BUCKETS];
+extern const uint32_t metric_rtt_bounds[METRIC_BUCKETS];
+
+static inline void metric_add(uint64_t *counter, uint64_t n)
+{
+    __atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+static inline void metric_set(uint64_t *gauge, uint64_t value)
+{
+    __atomic_store_n(gauge, value, __ATOMIC_RELAXED);
+}
+
+static inline void metric_observe(metric_hist_t *h, const uint32_t *bounds, uint64_t value)
+{
+    int i = 0;
+    while (i < METRIC_BUCKETS && value > bounds[i])
+        i++;
+    if (i < METRIC_BUCKETS)
+        metric_add(&h->buckets[i], 1);
+    metric_add(&h->sum, value);
+    metric_add(&h->count, 1);
+}
+
+/*
+ * Exporter: serves the sum over every worker in Prometheus text format to
+ * HTTP GETs on --metrics, a loopback port or a Unix socket path.
+ */
+int  metrics_start(const char *addr, struct tftp_server **servers, int count);
+void metrics_stop(void);
+
+#endif /* UTFTP_METRICS_H */
@@ -0,0 +1,39 @@
+/*
+ * utftp - Netascii translation (RFC 764 line endings)
+ */
+
+#ifndef UTFTP_NETASCII_H
+#define UTFTP_NETASCII_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Stream state carried from one block to the next */
+typedef struct {
+    int             pending;
+    uint8_t         byte;       /* Encode: second half of a split CR LF / CR NUL; decode: unused */
+} netascii_t;
+
+/*
+ * Encode local text (LF -> CR LF, CR -> CR NUL) into out until it is full
+ * or in runs out. Returns bytes produced and sets *consumed; a pair split
+ * at the end of out is finished at the start of the next call.
+ */
+size_t netascii_encode(netascii_t *st, const uint8_t *in, size_t in_len,
+                       size_t *consumed, uint8_t *out, size_t out_len);
+
+/*
+ * Decode netascii (CR LF -> LF, CR NUL -> CR) into out, which needs room
+ * for in_len + 1 bytes. A trailing CR waits for the next block, or for
+ * netascii_decode_end() at the end of the transfer.
+ */
+size_t netascii_decode(netascii_t *st, const uint8_t *in, size_t in_len, uint8_t *out);
+size_t netascii_decode_end(netascii_t *st, uint8_t *out);
+
+/* Largest file whose encoded size is worked out for tsize: the scan runs on the event loop */
+#define NETASCII_SCAN_MAX   (4u << 20)
+
+/* Encoded size of the first size bytes of fd, or -1 on a read error */
+int64_t netascii_size(int fd, uint64_t size);
+
+#endif /* UTFTP_NETASCII_H */
@@ -0,0 +1,86 @@
+/*
+ * utftp - Batched datagram I/O
+ */
+
+#ifndef UTFTP_NETIO_H
+#define UTFTP_NETIO_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include "utftp.h"
+
+/* Receive batch: one recvmmsg() fills up to RECV_BATCH datagrams */
+typedef struct recv_batch {
+    struct mmsghdr      msgs[RECV_BATCH];
+    struct iovec        iov[RECV_BATCH];
+    struct sockaddr_in  addrs[RECV_BATCH];
+    uint8_t             ctrl[RECV_BATCH][CMSG_SPACE(sizeof(int))];
+    uint8_t            *bufs;           /* RECV_BATCH x RECV_BUF_SIZE */
+} recv_batch_t;
+
+/* Outgoing datagram, queued until the end of the loop pass */
+typedef struct {
+    int                 sock;
+    struct sockaddr_in  addr;
+    struct iovec        iov[SEND_IOV_MAX];
+    int                 iovcnt;
+    size_t              len;
+    int                *slot_ref;       /* Owner's queue index, reset on flush */
+} send_entry_t;
+
+/* Send queue: flushed with sendmmsg, equal-size runs with UDP_SEGMENT */
+typedef struct send_queue {
+    send_entry_t        entries[SEND_BATCH];
+    int                 count;
+    int                 gso;            /* 0 once the kernel rejects UDP_SEGMENT */
+    size_t              gso_fail;       /* Smallest segment size the path refused */
+    uint64_t            dropped;        /* Datagrams given up on, left to the retransmit timer */
+    void              (*flushed)(void *ctx, uint64_t since);  /* After each flush, with its start in ns */
+    void               *flushed_ctx;
+    struct mmsghdr      msgs[SEND_BATCH];
+} send_queue_t;
+
+/* Batch lifecycle */
+recv_batch_t* netio_recv_batch_new(void);
+void netio_recv_batch_free(recv_batch_t *rb);
+
+/* Receive up to max (at most RECV_BATCH) datagrams; returns count, 0 when drained */
+int  netio_recv(int sock, recv_batch_t *rb, int max);
+
+/* Accessors for datagram i of the last netio_recv() */
+static inline uint8_t *netio_buf(recv_batch_t *rb, int i)
+{
+    return rb->bufs + (size_t)i * RECV_BUF_SIZE;
+}
+
+/* GRO segment size of datagram i (its full length when not coalesced) */
+size_t netio_segment_size(recv_batch_t *rb, int i);
+
+/* Enable UDP GRO on a socket */
+int  netio_enable_gro(int sock);
+
+/* Send queue lifecycle */
+send_queue_t* netio_send_queue_new(int gso);
+void netio_send_queue_free(send_queue_t *sq);
+
+/*
+ * Queue a datagram; the iov memory must stay valid until netio_flush().
+ * When slot_ref points at a queued entry, that entry is replaced instead
+ * (a newer packet from the same owner supersedes one not yet sent).
+ */
+int  netio_queue(send_queue_t *sq, int sock, const struct sockaddr_in *addr,
+                 const struct iovec *iov, int iovcnt, int *slot_ref);
+
+/*
+ * Send everything queued, then tell the flushed hook when one is set.
+ * What a socket has no room for (EAGAIN, ENOBUFS) stays queued, in order,
+ * for the next flush; datagrams refused outright are dropped and counted.
+ */
+void netio_flush(send_queue_t *sq);
+
+/* Drop the entry slot_ref points at, if any, before the memory it sends changes */
+void netio_cancel(send_queue_t *sq, int *slot_ref);
+
+#endif /* UTFTP_NETIO_H */
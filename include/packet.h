@@ -9,14 +9,40 @@
 #include <stddef.h>
 #include "utftp.h"
 
+/* RFC 2347 options carried by a request; the has_ flags record what was asked for */
+typedef struct {
+    size_t          blksize;
+    uint64_t        tsize;
+    int             has_tsize;
+    unsigned        windowsize;         /* RFC 7440, 1 when not requested */
+    int             has_windowsize;
+    unsigned        timeout;            /* RFC 2349, seconds */
+    int             has_timeout;
+    unsigned long   utimeout;           /* Microseconds, for sub-second timeouts */
+    int             has_utimeout;
+    int             rollover;           /* Block after 65535: 0, or 1 to skip 0 */
+    int             has_rollover;
+    char            multicast[64];      /* RFC 2090 "addr,port,mc" for the OACK */
+    int             has_multicast;
+} tftp_options_t;
+
 /* Parse RRQ/WRQ packet */
 int packet_parse_request(uint8_t *buf, size_t len, char *filename, size_t fn_len,
-                         char *mode, size_t mode_len, size_t *blksize, size_t *tsize);
+                         char *mode, size_t mode_len, tftp_options_t *opts);
+
+/* Options the server acknowledged, as a client sees them */
+int packet_parse_oack(uint8_t *buf, size_t len, tftp_options_t *opts);
 
 /* Build packets */
 int packet_build_data(uint8_t *buf, uint16_t block, uint8_t *data, size_t data_len);
 int packet_build_ack(uint8_t *buf, uint16_t block);
 int packet_build_error(uint8_t *buf, tftp_error_t code, const char *msg);
-int packet_build_oack(uint8_t *buf, size_t blksize, size_t tsize, int has_tsize);
+
+/* OACK for the options the client asked for, with the values in opts */
+int packet_build_oack(uint8_t *buf, const tftp_options_t *opts);
+
+/* RRQ or WRQ asking for the options flagged in opts (the load generator's side) */
+int packet_build_request(uint8_t *buf, uint16_t opcode, const char *filename,
+                         const char *mode, const tftp_options_t *opts);
 
 #endif /* UTFTP_PACKET_H */
@@ -0,0 +1,28 @@
+/*
+ * utftp - Fair scheduling of session work
+ */
+
+#ifndef UTFTP_RUNQ_H
+#define UTFTP_RUNQ_H
+
+#include "utftp.h"
+
+/* Queue a session whose socket has packets waiting; no-op when queued */
+void runq_ready(tftp_session_t *sess);
+
+/* Take the session off the run queue, if it is on it */
+void runq_remove(tftp_session_t *sess);
+
+/* Pop the next session to serve, NULL when none */
+tftp_session_t* runq_next(tftp_server_t *srv);
+
+/* Anything deferred to a later loop pass */
+int  runq_busy(const tftp_server_t *srv);
+
+/* Weight of a transfer from its client address and filename (--priority) */
+void runq_classify(tftp_session_t *sess, const char *filename);
+
+/* Parse "CIDR=W" or "PATTERN=W" into cls; -1 when malformed */
+int  runq_parse_class(const char *str, runq_class_t *cls);
+
+#endif /* UTFTP_RUNQ_H */
@@ -8,7 +8,7 @@
 #include "utftp.h"
 
 /* Server lifecycle */
-int  tftp_server_init(tftp_server_t *srv, tftp_config_t *config);
+int  tftp_server_init(tftp_server_t *srv, tftp_config_t *config, int worker_id);
 int  tftp_server_run(tftp_server_t *srv);
 void tftp_server_stop(tftp_server_t *srv);
 void tftp_server_cleanup(tftp_server_t *srv);
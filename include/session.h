@@ -7,17 +7,73 @@
 
 #include "utftp.h"
 
+/* Session table: client hash and optional shared socket pool */
+int  session_table_init(tftp_server_t *srv);
+void session_table_cleanup(tftp_server_t *srv);
+
 /* Session lifecycle */
 tftp_session_t* session_alloc(tftp_server_t *srv);
 void session_free(tftp_session_t *sess);
+
+/* Release surplus empty slabs; only between loop passes */
+void session_trim(tftp_server_t *srv);
+
+/* O(1) lookup by client address and port */
+void session_set_client(tftp_session_t *sess, const struct sockaddr_in *addr);
 tftp_session_t* session_find_by_addr(tftp_server_t *srv, struct sockaddr_in *addr);
 
-/* Session socket */
-int session_create_socket(tftp_server_t *srv);
+/*
+ * Block numbers are 64-bit internally; the wire carries them modulo
+ * 65536, or cycling 1-65535 under rollover=1. session_wire_ahead() is
+ * how many blocks wire lies ahead of block, modulo that cycle.
+ */
+#define WIRE_CYCLE(sess)    ((sess)->rollover ? 65535u : 65536u)
+uint16_t session_wire_block(const tftp_session_t *sess, uint64_t block);
+uint32_t session_wire_ahead(const tftp_session_t *sess, uint64_t block, uint16_t wire);
 
-/* Packet I/O */
+/* Unregistered, non-blocking UDP socket on an ephemeral port of the bind address */
+int session_open_socket(tftp_server_t *srv);
+
+/* Session socket: its own (registered with the event engine once) or a shared one */
+int session_create_socket(tftp_server_t *srv, tftp_session_t *sess);
+
+/* Returns the shared socket behind an event pointer, or -1 */
+int session_shared_sock(tftp_server_t *srv, void *ptr);
+
+/* Packet I/O (buf may be the session's own packet buffer) */
+uint8_t* session_packet_buf(tftp_session_t *sess, size_t len);
 int session_send_packet(tftp_session_t *sess, uint8_t *buf, size_t len);
 int session_retransmit(tftp_session_t *sess);
+
+/* RRQ window: packet buffer of a block, and queueing its DATA without a copy */
+size_t session_window_stride(tftp_session_t *sess);
+uint8_t* session_window_slot(tftp_session_t *sess, uint64_t block);
+int session_send_block(tftp_session_t *sess, uint64_t block);
 void session_send_error(tftp_session_t *sess, tftp_error_t code, const char *msg);
 
+/*
+ * Sends a full socket left queued past a flush: drop a window slot's
+ * before the slot is refilled, or all of them before the buffers go.
+ */
+void session_cancel_block(tftp_session_t *sess, uint64_t block);
+void session_cancel_sends(tftp_session_t *sess);
+
+/* Push the retransmit deadline out without resending */
+void session_touch(tftp_session_t *sess);
+
+/* Nothing left to resend: only the idle limit applies until the session speaks again */
+void session_wait(tftp_session_t *sess);
+
+/* Fixed retransmit interval negotiated by the client */
+void session_set_timeout(tftp_session_t *sess, uint32_t ms);
+
+/*
+ * RTT sampling for the adaptive interval. A sample times the packet
+ * tagged tag until a reply covering it arrives; tags below next_tag in
+ * session_rtt_discard() may have been resent and are never timed.
+ */
+void session_rtt_start(tftp_session_t *sess, uint64_t tag);
+void session_rtt_ack(tftp_session_t *sess, uint64_t tag);
+void session_rtt_discard(tftp_session_t *sess, uint64_t next_tag);
+
 #endif /* UTFTP_SESSION_H */
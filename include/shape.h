@@ -0,0 +1,32 @@
+/*
+ * utftp - Download bandwidth shaping
+ */
+
+#ifndef UTFTP_SHAPE_H
+#define UTFTP_SHAPE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "utftp.h"
+
+/* Shaper lifecycle: buckets shared by every worker, set up from config */
+void shape_init(const tftp_config_t *config);
+void shape_cleanup(void);
+
+/* "100M"-style rate in bytes per second, K/M/G in powers of 1024; 0 on error */
+uint64_t shape_parse_rate(const char *str);
+
+/* Put a session under the caps for its client address; detach at free */
+void shape_attach(tftp_session_t *sess);
+void shape_detach(tftp_session_t *sess);
+
+/*
+ * Charge len bytes to every bucket over the session and return 0, or
+ * return the milliseconds until one of them has room for it.
+ */
+uint32_t shape_admit(tftp_session_t *sess, size_t len);
+
+/* Charge a retransmission, which is never deferred */
+void shape_charge(tftp_session_t *sess, size_t len);
+
+#endif /* UTFTP_SHAPE_H */
@@ -0,0 +1,55 @@
+/*
+ * utftp - Hierarchical timer wheel
+ */
+
+#ifndef UTFTP_TIMER_H
+#define UTFTP_TIMER_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* 4 levels x 64 slots at 1 ms resolution covers ~4.6 hours */
+#define TIMER_LEVELS        4
+#define TIMER_SLOT_BITS     6
+#define TIMER_SLOTS         (1 << TIMER_SLOT_BITS)
+#define TIMER_SLOT_MASK     (TIMER_SLOTS - 1)
+
+typedef struct tftp_timer tftp_timer_t;
+typedef void (*timer_fn_t)(tftp_timer_t *timer);
+
+/* Intrusive timer, embedded in the object it belongs to */
+struct tftp_timer {
+    tftp_timer_t   *next;
+    tftp_timer_t  **pprev;      /* NULL while not armed */
+    uint64_t        expires;    /* Monotonic ms */
+    timer_fn_t      fn;
+};
+
+typedef struct {
+    uint64_t        now;        /* Last processed tick */
+    int             count;
+    tftp_timer_t   *slots[TIMER_LEVELS][TIMER_SLOTS];
+} timer_wheel_t;
+
+/* Recover the enclosing object from an embedded timer */
+#define timer_entry(ptr, type, member) \
+    ((type *)((char *)(ptr) - offsetof(type, member)))
+
+/* Monotonic clock in milliseconds */
+uint64_t timer_now_ms(void);
+
+/* Wheel */
+void timer_wheel_init(timer_wheel_t *wheel, uint64_t now);
+void timer_wheel_advance(timer_wheel_t *wheel, uint64_t now);
+int  timer_wheel_next_ms(timer_wheel_t *wheel, int max_ms);
+
+/* Timers: O(1) arm and cancel */
+void timer_arm(timer_wheel_t *wheel, tftp_timer_t *timer, uint64_t expires);
+void timer_cancel(timer_wheel_t *wheel, tftp_timer_t *timer);
+
+static inline int timer_armed(const tftp_timer_t *timer)
+{
+    return timer->pprev != NULL;
+}
+
+#endif /* UTFTP_TIMER_H */
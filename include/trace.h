@@ -0,0 +1,92 @@
+/*
+ * utftp - Tracepoints and per-stage latency
+ */
+
+#ifndef UTFTP_TRACE_H
+#define UTFTP_TRACE_H
+
+#include <stdint.h>
+#include "utftp.h"
+
+/*
+ * USDT probes, provider "utftp", for perf and bpftrace. With <sys/sdt.h>
+ * each is a single nop plus an ELF note; without it, or built with
+ * -DUTFTP_NO_SDT, they compile to nothing.
+ */
+#if !defined(UTFTP_NO_SDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define UTFTP_SDT 1
+#endif
+#endif
+
+#ifdef UTFTP_SDT
+#define TRACE_PROBE(...) STAP_PROBEV(utftp, __VA_ARGS__)
+#else
+#define TRACE_PROBE(...) ((void)0)
+#endif
+
+/* Where a transfer's time goes (--trace-latency) */
+typedef enum {
+    LAT_PARSE,          /* Request parsing and option negotiation */
+    LAT_OPEN,           /* Path resolution and open */
+    LAT_DISK,           /* File reads and writes, issue to completion */
+    LAT_SEND,           /* sendmmsg() passes carrying the session's packets */
+    LAT_WAIT,           /* From our packets leaving to the client's next one */
+    LAT_STAGES
+} lat_stage_t;
+
+struct trace_lat {
+    uint64_t        start;              /* ns, request received */
+    uint64_t        stage[LAT_STAGES];  /* ns */
+    uint32_t        count[LAT_STAGES];
+    uint64_t        io_start[TFTP_MAX_WINDOWSIZE];
+    uint64_t        wait_since;         /* 0: not waiting on the client */
+    trace_lat_t    *flush_next;         /* Sessions with packets in the next flush */
+    int             flush_queued;
+};
+
+/* Monotonic clock in nanoseconds */
+uint64_t trace_ns(void);
+
+/* Start recording a session's latency when enabled; since is the request's arrival */
+void trace_begin(tftp_session_t *sess, uint64_t since);
+
+/* Log the breakdown and stop recording */
+void trace_end(tftp_session_t *sess);
+
+/* Time since since, as one occurrence of stage */
+void trace_stage(tftp_session_t *sess, lat_stage_t stage, uint64_t since);
+
+/* The request has been handled: what open and disk did not take was parsing */
+void trace_request_done(tftp_session_t *sess);
+
+/* Packets queued for the next flush, and the flush hook that times it for them */
+void trace_queued(tftp_session_t *sess);
+void trace_flushed(void *ctx, uint64_t since);
+
+/* A packet from the client ended the wait */
+void trace_heard(tftp_session_t *sess);
+
+/* Start of a timestamp, 0 unless the session is being recorded */
+static inline uint64_t trace_mark(const tftp_session_t *sess)
+{
+    return sess->lat ? trace_ns() : 0;
+}
+
+/* File operations in flight, by ring slot or write buffer */
+static inline void trace_io_start(tftp_session_t *sess, unsigned slot)
+{
+    if (sess->lat)
+        sess->lat->io_start[slot] = trace_ns();
+}
+
+static inline void trace_io_done(tftp_session_t *sess, unsigned slot)
+{
+    if (sess->lat && sess->lat->io_start[slot]) {
+        trace_stage(sess, LAT_DISK, sess->lat->io_start[slot]);
+        sess->lat->io_start[slot] = 0;
+    }
+}
+
+#endif /* UTFTP_TRACE_H */
@@ -9,7 +9,11 @@
 #include <stdint.h>
 #include <stddef.h>
 #include <netinet/in.h>
-#include <sys/time.h>
+#include <sys/epoll.h>
+#include "timer.h"
+#include "cache.h"
+#include "netascii.h"
+#include "metrics.h"
 
 /* TFTP Constants */
 #define TFTP_PORT           69
@@ -19,9 +23,34 @@
 #define TFTP_MAX_PACKET     (4 + TFTP_MAX_BLKSIZE)
 #define TFTP_TIMEOUT_SEC    30
 #define TFTP_MAX_RETRIES    3
+#define TFTP_RTO_INIT_MS    1000    /* Retransmit interval before the first RTT sample */
+#define TFTP_RTO_MIN_MS     10
+#define TFTP_MAX_WINDOWSIZE 64      /* RFC 7440 blocks in flight per RRQ, and window slots */
+#define TFTP_READAHEAD      8       /* Blocks read ahead of the RRQ window... */
+#define TFTP_READAHEAD_BYTES (64 * 1024)    /* ...within this many bytes */
+#define TFTP_WRITE_BEHIND   (128 * 1024)    /* WRQ buffer, at least two blocks; two per upload */
 
 /* Limits */
-#define MAX_SESSIONS        64
+#define MAX_SESSIONS        1024    /* Default session limit (-m) */
+#define MAX_SESSIONS_LIMIT  65536
+#define SESSION_SLAB_SIZE   64
+#define MAX_SHARED_SOCKS    64      /* --shared-sockets upper bound */
+#define MAX_MCAST_GROUPS    16      /* RFC 2090 groups per worker */
+#define FILE_CACHE_ENTRIES  256     /* --file-cache default */
+#define MAX_SHAPE_SUBNETS   16      /* --rate-subnet rules */
+#define MAX_RUNQ_CLASSES    16      /* --priority rules */
+#define MAX_RUNQ_WEIGHT     16
+#define RUNQ_QUANTUM        8       /* Packets per session and loop pass, times its weight */
+#define RUNQ_ADMIT          RECV_BATCH  /* New requests per loop pass */
+#define RUNQ_SHARED         (4 * RECV_BATCH)    /* Packets per shared socket and loop pass */
+#define TFTP_MCAST_PORT     1758
+#define MAX_EVENTS          256
+#define MAX_WORKERS         256
+#define RECV_BATCH          32      /* Datagrams per recvmmsg() */
+#define RECV_BUF_SIZE       65536   /* Fits a GRO-coalesced datagram */
+#define SEND_BATCH          64      /* Datagrams per sendmmsg() */
+#define SEND_IOV_MAX        2       /* Header + payload */
+#define SEND_RETRY_MS       1       /* Next try at datagrams a full socket left queued */
 #define MAX_PATH_LEN        1024
 #define MAX_FILENAME_LEN    256
 
@@ -48,6 +77,28 @@ typedef enum {
     TFTP_ERR_BAD_OPTIONS    = 8
 } tftp_error_t;
 
+/* Upload durability (--sync) */
+typedef enum {
+    SYNC_NONE = 0,                      /* Left to the kernel's writeback */
+    SYNC_CLOSE,                         /* fdatasync before the final ACK */
+    SYNC_PERIODIC                       /* fdatasync every sync_interval seconds while writing */
+} sync_mode_t;
+
+/* Scheduling weight for transfers from a subnet or of matching files (--priority) */
+typedef struct {
+    uint32_t        net;                /* Host order, with an empty pattern */
+    uint32_t        mask;
+    char            pattern[64];        /* fnmatch() against the filename */
+    int             weight;
+} runq_class_t;
+
+/* Download cap shared by a subnet (--rate-subnet) */
+typedef struct {
+    uint32_t        net;                /* Host order */
+    uint32_t        mask;
+    uint64_t        rate;               /* Bytes per second */
+} shape_subnet_t;
+
 /* Session state */
 typedef enum {
     STATE_FREE = 0,
@@ -56,33 +107,147 @@ typedef enum {
     STATE_SENDING,
     STATE_RECEIVING,
     STATE_LAST_DATA,
+    STATE_WAITING,                      /* Multicast member until it becomes master */
     STATE_ERROR
 } session_state_t;
 
-/* Forward declaration */
+/* Forward declarations */
 typedef struct tftp_server tftp_server_t;
+typedef struct tftp_session tftp_session_t;
+typedef struct session_slab session_slab_t;
+typedef struct mcast_group mcast_group_t;
+struct recv_batch;
+struct send_queue;
+struct fileio;
+struct block_cache;
+struct fcache_entry;
+typedef struct file_cache file_cache_t;
+typedef struct shape_client shape_client_t;
+typedef struct trace_lat trace_lat_t;
 
 /* Transfer session */
-typedef struct {
+struct tftp_session {
     session_state_t state;
+    tftp_server_t  *srv;
     int             sock;
+    int             shared_sock;        /* sock belongs to the shared pool */
     struct sockaddr_in client_addr;
+    tftp_session_t *hash_next;          /* Client address hash chain */
+    int             hashed;
 
     int             fd;
+    struct fcache_entry *file_entry;    /* fd is shared through the file cache */
+    const uint8_t  *map;                /* RRQ file mapping, DATA payloads are sent from it */
+    size_t          map_len;
     char            filename[MAX_FILENAME_LEN];
 
-    uint16_t        block_num;
+    uint64_t        block_num;          /* WRQ: last block received */
     size_t          blksize;
-    size_t          tsize;
-    size_t          bytes_transferred;
+    uint64_t        tsize;
+    uint64_t        bytes_transferred;
+    int             rollover;           /* Wire block after 65535: 0, or 1 with rollover=1 */
 
-    struct timeval  last_activity;
-    struct timeval  start_time;
+    uint64_t        start_time;         /* Monotonic ms */
+    uint64_t        last_heard;         /* Last packet from the client */
+    tftp_timer_t    timer;              /* Retransmit / expiry */
+    tftp_timer_t    shape_timer;        /* RRQ held back by the shaper */
+    shape_client_t *shaper;             /* Caps over this client, NULL when none */
+    trace_lat_t    *lat;                /* Stage latencies, with --trace-latency */
+
+    /* Fair share of each loop pass: packets it may still handle, times weight per pass */
+    tftp_session_t *run_next;           /* Run queue, while packets may be waiting */
+    tftp_session_t *run_prev;
+    int             run_queued;
+    int             deficit;
+    int             weight;
     int             retries;
 
-    uint8_t         last_packet[TFTP_MAX_PACKET];
+    /* Retransmit interval: negotiated (RFC 2349) or Jacobson/Karels from measured RTT */
+    uint32_t        rto;                /* Current interval, ms */
+    uint32_t        rto_max;            /* Backoff ceiling; silence of MAX_RETRIES+1 of these expires */
+    int             rto_fixed;          /* Client set timeout/utimeout */
+    int             srtt;               /* Smoothed RTT, ms << 3, -1 before the first sample */
+    int             rttvar;             /* RTT mean deviation, ms << 2 */
+    int             rtt_pending;        /* A round trip is being timed */
+    uint64_t        rtt_tag;            /* Block (or lock-step packet) being timed */
+    uint64_t        rtt_sent;
+    uint64_t        rtt_floor;          /* Lowest tag never retransmitted (Karn) */
+
+    /* RRQ sliding window (RFC 7440); counters are 64-bit, the wire carries the low 16 bits */
+    unsigned        windowsize;
+    unsigned        ring;               /* Slots: the window plus blocks read ahead of it */
+    uint64_t        win_base;           /* Oldest unacknowledged block, 0 before the first */
+    uint64_t        win_next;           /* Next block to transmit */
+    uint64_t        win_read;           /* Next block to read from the file */
+    uint64_t        last_block;         /* Final (short) block */
+    uint64_t        win_ready;          /* Slots whose read has completed */
+    uint32_t        win_len[TFTP_MAX_WINDOWSIZE];
+    int             win_tx[TFTP_MAX_WINDOWSIZE];    /* Queued send of each slot, -1 if none */
+    int             win_pumping;
+    uint64_t        ra_end;             /* File offset the kernel was told to read ahead to */
+
+    /* Netascii mode: translation state, and for RRQ the file offset encoded so far */
+    int             netascii;
+    netascii_t      na;
+    uint64_t        na_off;
+    int             na_reading;         /* RRQ: the one read a netascii stream allows is in flight */
+
+    /* Shared block cache: the file's key and the block each window slot holds */
+    int             cached;
+    cache_file_t    cache_file;
+    cache_block_t  *win_block[TFTP_MAX_WINDOWSIZE];
+    cache_waiter_t  win_wait[TFTP_MAX_WINDOWSIZE];
+
+    /* RFC 2090: DATA goes to the group, only the master (the first member) ACKs */
+    mcast_group_t  *group;
+    tftp_session_t *group_next;
+
+    uint8_t        *last_packet;        /* Negotiated blksize, times the window for RRQ; headers only when mapped */
+    size_t          last_packet_cap;
     size_t          last_packet_len;
-} tftp_session_t;
+    int             tx_slot;            /* Queued send of last_packet, -1 if none */
+    int             buf_index;          /* Registered pool slot of last_packet, -1 if heap */
+
+    int             file_index;         /* io_uring fixed-file slot, -1 if none */
+    int             io_pending;         /* File operations in flight */
+
+    /*
+     * WRQ write-behind: two buffers after the ACK in last_packet. Blocks
+     * fill one while the other is written; each write but the last is a
+     * whole buffer at a buffer-aligned offset.
+     */
+    size_t          wb_cap;
+    size_t          wb_len[2];
+    int             wb_busy[2];         /* Write in flight */
+    int             wb_cur;             /* Buffer being filled */
+    uint64_t        wb_off;             /* File offset of the buffer being filled */
+    int             wb_held;            /* ACK withheld until a buffer frees */
+    int             wb_done;            /* Final block received */
+    int             wb_synced;
+    int             syncing;            /* fdatasync in flight */
+    uint64_t        synced_at;          /* Last periodic fdatasync, monotonic ms */
+
+    tftp_session_t *next;               /* Active list, or free list when STATE_FREE */
+    tftp_session_t *prev;
+    session_slab_t *slab;
+};
+
+/* Slab of session slots, released once every slot in it is free */
+struct session_slab {
+    session_slab_t *next;
+    session_slab_t *prev;
+    int             live;
+    tftp_session_t  sessions[SESSION_SLAB_SIZE];
+};
+
+/* Multicast group: members share its socket, DATA is sent once to its address */
+struct mcast_group {
+    int             sock;               /* -1 while unused */
+    struct sockaddr_in addr;
+    cache_file_t    file;               /* File and blksize every member receives */
+    tftp_session_t *members;            /* Join order */
+    uint64_t        high;               /* Highest block sent to the group */
+};
 
 /* Server configuration */
 typedef struct {
@@ -90,15 +255,71 @@ typedef struct {
     char            bind_addr[64];
     uint16_t        port;
     int             timeout_sec;
+    int             max_sessions;
+    int             workers;
+    int             gro;
+    int             no_gso;
+    int             io_uring;
+    int             shared_sockets;
+    int             cache_mb;
+    int             file_cache;         /* Open files kept per worker */
+    uint64_t        rate;               /* Download caps in bytes/s, 0 = none: all clients */
+    uint64_t        client_rate;        /* Each client address */
+    shape_subnet_t  subnets[MAX_SHAPE_SUBNETS];
+    int             subnet_count;
+    runq_class_t    classes[MAX_RUNQ_CLASSES];
+    int             class_count;
+    sync_mode_t     sync_mode;
+    int             sync_interval;      /* Seconds, SYNC_PERIODIC */
+    char            mcast_addr[64];     /* Empty: multicast option ignored */
+    char            metrics_addr[108];  /* Exporter: port, host:port or socket path */
+    int             trace_latency;      /* Log each transfer's latency breakdown */
+    uint16_t        mcast_port;
     int             debug;
     int             quiet;
 } tftp_config_t;
 
 /* Server state */
 struct tftp_server {
+    int             worker_id;
     int             main_sock;
+    int             root_fd;            /* config.root_dir, O_PATH */
+    int             epoll_fd;
     tftp_config_t   config;
-    tftp_session_t  sessions[MAX_SESSIONS];
+
+    tftp_session_t *active;             /* Live sessions */
+    tftp_session_t *free_list;          /* Free slots across all slabs */
+    session_slab_t *slabs;
+    int             active_count;
+    int             empty_slabs;
+
+    tftp_session_t **hash;              /* Sessions by client address and port */
+    uint32_t        hash_mask;
+
+    int             shared_socks[MAX_SHARED_SOCKS];
+    int             shared_count;
+    int             shared_next;
+
+    mcast_group_t   groups[MAX_MCAST_GROUPS];
+
+    /* Work left over from earlier loop passes */
+    tftp_session_t *run_head;           /* Sessions, served round-robin */
+    tftp_session_t *run_tail;
+    int             run_count;
+    int             main_pending;       /* New requests beyond the admission share */
+    uint64_t        shared_pending;     /* Bit per shared socket */
+    uint32_t        group_pending;      /* Bit per multicast group */
+
+    struct epoll_event events[MAX_EVENTS];
+    struct recv_batch *rx;
+    struct send_queue *tx;
+    struct fileio  *fileio;             /* NULL when file I/O is synchronous */
+    struct block_cache *cache;          /* NULL when disabled */
+    file_cache_t   *fcache;             /* NULL when disabled */
+    timer_wheel_t   timers;
+    uint64_t        now;                /* Monotonic ms, read once per loop pass */
+    tftp_metrics_t  metrics;
+    trace_lat_t    *lat_flush;          /* Recorded sessions with packets in the next flush */
     volatile int    running;
 };
 
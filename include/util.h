@@ -6,12 +6,21 @@
 #define UTFTP_UTIL_H
 
 #include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
 
-/* Path security */
-int validate_path(const char *root, const char *filename, char *fullpath, size_t pathlen);
+/* Path security: root_dir held open as an O_PATH fd, -1 on error */
+int root_open_dir(const char *root);
+
+/*
+ * Open filename beneath the root, creating missing parent directories
+ * with O_CREAT. Returns the fd or -errno; -EXDEV when the path leaves
+ * the root.
+ */
+int root_open(int root_fd, const char *root, const char *filename, int flags, mode_t mode);
 
 /* Formatting */
-const char* format_size(size_t bytes, char *buf, size_t buflen);
+const char* format_size(uint64_t bytes, char *buf, size_t buflen);
 const char* format_speed(double bytes_per_sec, char *buf, size_t buflen);
 
 #endif /* UTFTP_UTIL_H */
@@ -0,0 +1,24 @@
+/*
+ * utftp - Multi-core workers
+ */
+
+#ifndef UTFTP_WORKER_H
+#define UTFTP_WORKER_H
+
+#include <pthread.h>
+#include "utftp.h"
+
+/* Worker pool: one server (socket, sessions, event loop) per thread */
+typedef struct {
+    tftp_server_t  **servers;
+    pthread_t       *threads;
+    int              count;
+} tftp_workers_t;
+
+/* Pool lifecycle */
+int  workers_init(tftp_workers_t *w, tftp_config_t *config);
+int  workers_run(tftp_workers_t *w);
+void workers_stop(tftp_workers_t *w);
+void workers_cleanup(tftp_workers_t *w);
+
+#endif /* UTFTP_WORKER_H */
@@ -0,0 +1,359 @@
+/*
+ * utftp - Shared file block cache
+ *
+ * Blocks of files being downloaded are kept per worker, keyed by file
+ * identity, block size and block number, so every session reading a hot
+ * image shares one copy. A window slot holds a reference to its block
+ * until the slot is refilled, and DATA payloads are sent straight from
+ * it. The first session to miss a block starts its read; sessions that
+ * ask for it meanwhile wait on that read instead of issuing their own.
+ * Unreferenced blocks are evicted with CLOCK once the budget is reached.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "../include/cache.h"
+#include "../include/utftp.h"
+#include "../include/session.h"
+#include "../include/fileio.h"
+#include "../include/log.h"
+
+typedef enum {
+    BLOCK_PENDING = 0,
+    BLOCK_READY,
+    BLOCK_FAILED
+} block_state_t;
+
+typedef struct block_cache block_cache_t;
+
+struct cache_block {
+    cache_file_t    file;
+    uint64_t        index;
+    block_cache_t  *cache;
+    cache_block_t  *hash_next;
+    cache_block_t  *clock_next;         /* Ring of every allocated block */
+    cache_block_t  *clock_prev;
+    cache_waiter_t *waiters;
+    int             refs;
+    int             hashed;
+    int             referenced;         /* CLOCK second-chance bit */
+    block_state_t   state;
+    ssize_t         len;                /* Bytes read, or -errno */
+    uint8_t         data[];
+};
+
+struct block_cache {
+    size_t          budget;
+    size_t          used;
+    cache_block_t **hash;
+    uint32_t        hash_mask;
+    cache_block_t  *hand;               /* CLOCK hand, NULL when empty */
+    int             count;
+};
+
+static uint32_t block_hash(const cache_file_t *file, uint64_t index)
+{
+    uint64_t h = file->ino * 0x9E3779B97F4A7C15ull;
+    h ^= (file->dev + (uint64_t)file->mtime) * 0xC2B2AE3D27D4EB4Full;
+    h ^= (index + ((uint64_t)file->blksize << 40)) * 0x165667B19E3779F9ull;
+    h ^= h >> 29;
+    return (uint32_t)h;
+}
+
+void cache_file_key(cache_file_t *key, const struct stat *st, size_t blksize)
+{
+    key->dev = st->st_dev;
+    key->ino = st->st_ino;
+    key->mtime = (int64_t)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+    key->size = st->st_size;
+    key->blksize = (uint32_t)blksize;
+}
+
+int cache_file_equal(const cache_file_t *a, const cache_file_t *b)
+{
+    return a->ino == b->ino && a->dev == b->dev && a->mtime == b->mtime &&
+           a->size == b->size && a->blksize == b->blksize;
+}
+
+static size_t block_size(const cache_block_t *blk)
+{
+    return sizeof(*blk) + blk->file.blksize;
+}
+
+static cache_block_t* block_lookup(block_cache_t *bc, const cache_file_t *file, uint64_t index)
+{
+    cache_block_t *blk = bc->hash[block_hash(file, index) & bc->hash_mask];
+
+    for (; blk; blk = blk->hash_next) {
+        if (blk->index == index && cache_file_equal(&blk->file, file))
+            return blk;
+    }
+    return NULL;
+}
+
+static void block_unhash(block_cache_t *bc, cache_block_t *blk)
+{
+    cache_block_t **pp = &bc->hash[block_hash(&blk->file, blk->index) & bc->hash_mask];
+
+    while (*pp) {
+        if (*pp == blk) {
+            *pp = blk->hash_next;
+            break;
+        }
+        pp = &(*pp)->hash_next;
+    }
+    blk->hash_next = NULL;
+    blk->hashed = 0;
+}
+
+static void block_destroy(block_cache_t *bc, cache_block_t *blk)
+{
+    if (blk->hashed)
+        block_unhash(bc, blk);
+
+    if (blk->clock_next == blk) {
+        bc->hand = NULL;
+    } else {
+        blk->clock_prev->clock_next = blk->clock_next;
+        blk->clock_next->clock_prev = blk->clock_prev;
+        if (bc->hand == blk)
+            bc->hand = blk->clock_next;
+    }
+
+    bc->used -= block_size(blk);
+    bc->count--;
+    free(blk);
+}
+
+static void block_put(cache_block_t *blk)
+{
+    /* Hashed blocks stay until CLOCK evicts them; the rest go with their last user */
+    if (--blk->refs == 0 && !blk->hashed)
+        block_destroy(blk->cache, blk);
+}
+
+/* One CLOCK sweep: evict the first unreferenced block without a second chance */
+static int block_evict(block_cache_t *bc)
+{
+    for (int n = 2 * bc->count; n > 0 && bc->hand; n--) {
+        cache_block_t *blk = bc->hand;
+        bc->hand = blk->clock_next;
+
+        if (blk->refs > 0)
+            continue;
+        if (blk->referenced) {
+            blk->referenced = 0;
+            continue;
+        }
+        block_destroy(bc, blk);
+        return 1;
+    }
+    return 0;
+}
+
+static cache_block_t* block_new(block_cache_t *bc, const cache_file_t *file, uint64_t index)
+{
+    size_t size = sizeof(cache_block_t) + file->blksize;
+
+    while (bc->used + size > bc->budget && block_evict(bc))
+        ;
+
+    cache_block_t *blk = malloc(size);
+    if (!blk)
+        return NULL;
+
+    memset(blk, 0, sizeof(*blk));
+    blk->file = *file;
+    blk->index = index;
+    blk->cache = bc;
+    blk->state = BLOCK_PENDING;
+
+    if (bc->hand) {
+        blk->clock_next = bc->hand;
+        blk->clock_prev = bc->hand->clock_prev;
+        blk->clock_prev->clock_next = blk;
+        bc->hand->clock_prev = blk;
+    } else {
+        blk->clock_next = blk;
+        blk->clock_prev = blk;
+        bc->hand = blk;
+    }
+    bc->used += size;
+    bc->count++;
+
+    /* Over budget with every block in use: this one stays private to its reader */
+    if (bc->used <= bc->budget) {
+        cache_block_t **head = &bc->hash[block_hash(file, index) & bc->hash_mask];
+        blk->hash_next = *head;
+        *head = blk;
+        blk->hashed = 1;
+    }
+    return blk;
+}
+
+/* Fill completion: runs even when the session that started it is gone */
+static int block_filled(tftp_session_t *sess, uint64_t tag, ssize_t result)
+{
+    cache_block_t *blk = (cache_block_t *)(uintptr_t)tag;
+    (void)sess;
+
+    blk->len = result;
+    if (result >= 0) {
+        blk->state = BLOCK_READY;
+    } else {
+        blk->state = BLOCK_FAILED;
+        if (blk->hashed)
+            block_unhash(blk->cache, blk);
+    }
+
+    /* Held across the wakeups: a waiter that ends its session drops its own reference */
+    cache_waiter_t *w = blk->waiters;
+    blk->waiters = NULL;
+
+    while (w) {
+        cache_waiter_t *next = w->next;
+        tftp_session_t *waiter = w->sess;
+        w->sess = NULL;
+        w->next = NULL;
+        if (w->cb(waiter, w->block, result) != 0)
+            session_free(waiter);
+        w = next;
+    }
+
+    block_put(blk);
+    return 0;
+}
+
+int cache_init(tftp_server_t *srv)
+{
+    srv->cache = NULL;
+    if (srv->config.cache_mb <= 0)
+        return 0;
+
+    block_cache_t *bc = calloc(1, sizeof(*bc));
+    if (!bc) {
+        log_msg(LOG_CRITICAL, "Out of memory allocating block cache");
+        return -1;
+    }
+
+    int workers = srv->config.workers > 0 ? srv->config.workers : 1;
+    bc->budget = (size_t)srv->config.cache_mb * 1024 * 1024 / workers;
+
+    /* Enough buckets for a budget full of default-size blocks */
+    uint32_t buckets = 1024;
+    while (buckets < bc->budget / TFTP_DEF_BLKSIZE && buckets < (1u << 22))
+        buckets <<= 1;
+
+    bc->hash = calloc(buckets, sizeof(*bc->hash));
+    if (!bc->hash) {
+        log_msg(LOG_CRITICAL, "Out of memory allocating block cache");
+        free(bc);
+        return -1;
+    }
+    bc->hash_mask = buckets - 1;
+
+    srv->cache = bc;
+    return 0;
+}
+
+void cache_cleanup(tftp_server_t *srv)
+{
+    block_cache_t *bc = srv->cache;
+    if (!bc)
+        return;
+
+    while (bc->hand)
+        block_destroy(bc, bc->hand);
+
+    free(bc->hash);
+    free(bc);
+    srv->cache = NULL;
+}
+
+int cache_attach(tftp_session_t *sess, const struct stat *st)
+{
+    if (!sess->srv->cache || !S_ISREG(st->st_mode))
+        return 0;
+
+    cache_file_key(&sess->cache_file, st, sess->blksize);
+    sess->cached = 1;
+    return 1;
+}
+
+const uint8_t* cache_data(const cache_block_t *blk)
+{
+    return blk->data;
+}
+
+int cache_read(tftp_session_t *sess, uint64_t block, cache_cb_t cb)
+{
+    block_cache_t *bc = sess->srv->cache;
+    unsigned slot = block % sess->ring;
+
+    cache_release(sess, slot);
+
+    cache_block_t *blk = block_lookup(bc, &sess->cache_file, block);
+    int fill = 0;
+    if (!blk) {
+        blk = block_new(bc, &sess->cache_file, block);
+        if (!blk)
+            return cb(sess, block, -ENOMEM);
+        fill = 1;
+    }
+
+    blk->refs++;
+    blk->referenced = 1;
+    sess->win_block[slot] = blk;
+
+    if (fill) {
+        /* The read holds its own reference: the kernel may write into the block after every reader left */
+        blk->refs++;
+        fileio_read_shared(sess, blk->data, sess->blksize, (block - 1) * sess->blksize,
+                           (uint64_t)(uintptr_t)blk, block_filled);
+    }
+
+    if (blk->state == BLOCK_PENDING) {
+        cache_waiter_t *w = &sess->win_wait[slot];
+        w->sess = sess;
+        w->block = block;
+        w->cb = cb;
+        w->next = blk->waiters;
+        blk->waiters = w;
+        return 0;
+    }
+
+    return cb(sess, block, blk->len);
+}
+
+void cache_release(tftp_session_t *sess, unsigned slot)
+{
+    cache_block_t *blk = sess->win_block[slot];
+    if (!blk)
+        return;
+
+    cache_waiter_t *w = &sess->win_wait[slot];
+    if (w->sess) {
+        cache_waiter_t **pp = &blk->waiters;
+        while (*pp && *pp != w)
+            pp = &(*pp)->next;
+        if (*pp)
+            *pp = w->next;
+        w->sess = NULL;
+        w->next = NULL;
+    }
+
+    sess->win_block[slot] = NULL;
+    block_put(blk);
+}
+
+void cache_detach(tftp_session_t *sess)
+{
+    if (!sess->cached)
+        return;
+
+    for (unsigned slot = 0; slot < TFTP_MAX_WINDOWSIZE; slot++)
+        cache_release(sess, slot);
+    sess->cached = 0;
+}
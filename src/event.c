@@ -0,0 +1,48 @@
+/*
+ * utftp - Event engine (edge-triggered epoll)
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include "../include/event.h"
+#include "../include/log.h"
+
+int event_init(tftp_server_t *srv)
+{
+    srv->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (srv->epoll_fd < 0) {
+        log_msg(LOG_CRITICAL, "Failed to create epoll instance: %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+void event_cleanup(tftp_server_t *srv)
+{
+    if (srv->epoll_fd >= 0) {
+        close(srv->epoll_fd);
+        srv->epoll_fd = -1;
+    }
+}
+
+int event_add(tftp_server_t *srv, int fd, void *ptr)
+{
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = ptr;
+
+    if (epoll_ctl(srv->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        log_msg(LOG_ERROR, "epoll_ctl add failed: %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+int event_wait(tftp_server_t *srv, int timeout_ms)
+{
+    return epoll_wait(srv->epoll_fd, srv->events, MAX_EVENTS, timeout_ms);
+}
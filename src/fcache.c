@@ -0,0 +1,457 @@
+/*
+ * utftp - Open-file and metadata cache
+ *
+ * Files opened for download stay open per worker, keyed by the path the
+ * client asked for, so repeat and concurrent RRQs reuse the descriptor
+ * and its stat result without touching the filesystem. Missing files are
+ * remembered for a moment as well. Every cached file is watched through
+ * inotify, as is each directory on its path below the root: a change to
+ * the file, or a rename or removal of any name leading to it, drops the
+ * entry, and sessions still reading keep the old descriptor until they
+ * finish, just as they would with one of their own.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include "../include/fcache.h"
+#include "../include/event.h"
+#include "../include/netascii.h"
+#include "../include/util.h"
+#include "../include/trace.h"
+#include "../include/log.h"
+
+#define FCACHE_NEG_TTL_MS   2000    /* How long a missing file stays missing */
+#define FCACHE_MAX_DEPTH    16      /* Directories watched per entry; deeper files are not cached */
+#define FCACHE_FILE_EVENTS  (IN_MODIFY | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF)
+#define FCACHE_DIR_EVENTS   (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | \
+                             IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+
+typedef struct fcache_entry fcache_entry_t;
+
+struct fcache_entry {
+    fcache_entry_t *hash_next;
+    fcache_entry_t *lru_next;           /* Hashed entries, most recently used first */
+    fcache_entry_t *lru_prev;
+    int             fd;                 /* -1: the file does not exist */
+    struct stat     st;
+    int64_t         netascii_size;      /* -1 until a netascii RRQ asks for tsize */
+    uint64_t        expires;            /* ms, negative entries */
+    int             refs;               /* Sessions reading through fd */
+    int             hashed;
+    int             file_wd;            /* inotify watch on the file, -1 when none */
+    int             dir_wd[FCACHE_MAX_DEPTH];   /* Directory holding each component, root first */
+    int             depth;
+    char            path[];
+};
+
+struct file_cache {
+    int             inotify_fd;
+    int             max;
+    int             count;
+    fcache_entry_t **hash;
+    uint32_t        hash_mask;
+    fcache_entry_t *lru_head;
+    fcache_entry_t *lru_tail;
+};
+
+static uint32_t path_hash(const char *path)
+{
+    uint32_t h = 2166136261u;
+    while (*path)
+        h = (h ^ (uint8_t)*path++) * 16777619u;
+    return h;
+}
+
+/* The root is implied: "/boot/x" and "boot/x" are the same file */
+static const char* cache_path(const char *filename)
+{
+    while (*filename == '/')
+        filename++;
+    return filename;
+}
+
+static fcache_entry_t* entry_lookup(file_cache_t *fc, const char *path)
+{
+    fcache_entry_t *e = fc->hash[path_hash(path) & fc->hash_mask];
+
+    for (; e; e = e->hash_next) {
+        if (strcmp(e->path, path) == 0)
+            return e;
+    }
+    return NULL;
+}
+
+static void lru_unlink(file_cache_t *fc, fcache_entry_t *e)
+{
+    if (e->lru_prev)
+        e->lru_prev->lru_next = e->lru_next;
+    else
+        fc->lru_head = e->lru_next;
+    if (e->lru_next)
+        e->lru_next->lru_prev = e->lru_prev;
+    else
+        fc->lru_tail = e->lru_prev;
+    e->lru_next = NULL;
+    e->lru_prev = NULL;
+}
+
+static void lru_push(file_cache_t *fc, fcache_entry_t *e)
+{
+    e->lru_prev = NULL;
+    e->lru_next = fc->lru_head;
+    if (fc->lru_head)
+        fc->lru_head->lru_prev = e;
+    else
+        fc->lru_tail = e;
+    fc->lru_head = e;
+}
+
+static int entry_watches(const fcache_entry_t *e, int wd)
+{
+    if (e->file_wd == wd)
+        return 1;
+    for (int i = 0; i < e->depth; i++) {
+        if (e->dir_wd[i] == wd)
+            return 1;
+    }
+    return 0;
+}
+
+/* Whether name is component level of path, counting from 0 */
+static int component_is(const char *path, int level, const char *name)
+{
+    while (level-- > 0) {
+        path = strchr(path, '/');
+        if (!path)
+            return 0;
+        path++;
+    }
+    size_t len = strcspn(path, "/");
+    return strlen(name) == len && strncmp(path, name, len) == 0;
+}
+
+/* Remove a watch once no cached entry relies on it */
+static void watch_drop(file_cache_t *fc, int wd)
+{
+    if (wd < 0)
+        return;
+    for (fcache_entry_t *e = fc->lru_head; e; e = e->lru_next) {
+        if (entry_watches(e, wd))
+            return;
+    }
+    inotify_rm_watch(fc->inotify_fd, wd);
+}
+
+static void watches_drop(file_cache_t *fc, const int *dir_wd, int depth, int file_wd)
+{
+    for (int i = 0; i < depth; i++)
+        watch_drop(fc, dir_wd[i]);
+    watch_drop(fc, file_wd);
+}
+
+static void entry_free(fcache_entry_t *e)
+{
+    if (e->fd >= 0)
+        close(e->fd);
+    free(e);
+}
+
+/* Out of the cache; a descriptor still in use closes with its last session */
+static void entry_unhash(file_cache_t *fc, fcache_entry_t *e)
+{
+    fcache_entry_t **pp = &fc->hash[path_hash(e->path) & fc->hash_mask];
+    while (*pp) {
+        if (*pp == e) {
+            *pp = e->hash_next;
+            break;
+        }
+        pp = &(*pp)->hash_next;
+    }
+    e->hash_next = NULL;
+    e->hashed = 0;
+    lru_unlink(fc, e);
+    fc->count--;
+
+    int dir_wd[FCACHE_MAX_DEPTH];
+    int depth = e->depth, file_wd = e->file_wd;
+    memcpy(dir_wd, e->dir_wd, depth * sizeof(dir_wd[0]));
+    e->depth = 0;
+    e->file_wd = -1;
+    watches_drop(fc, dir_wd, depth, file_wd);
+
+    if (e->refs == 0)
+        entry_free(e);
+}
+
+/* Evict the least recently used entry no session is reading */
+static int entry_evict(file_cache_t *fc)
+{
+    for (fcache_entry_t *e = fc->lru_tail; e; e = e->lru_prev) {
+        if (e->refs == 0) {
+            entry_unhash(fc, e);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Cache path as opened on fd, or as missing when fd is -1. NULL when it
+ * cannot be: every entry in use, or no watch to invalidate an open file.
+ */
+static fcache_entry_t* entry_new(tftp_server_t *srv, const char *path, int fd, const struct stat *st)
+{
+    file_cache_t *fc = srv->fcache;
+
+    if (fc->count >= fc->max && !entry_evict(fc))
+        return NULL;
+
+    size_t len = strlen(path);
+    fcache_entry_t *e = malloc(sizeof(*e) + len + 1);
+    if (!e)
+        return NULL;
+
+    memset(e, 0, sizeof(*e));
+    memcpy(e->path, path, len + 1);
+    e->fd = fd;
+    e->netascii_size = -1;
+    if (st)
+        e->st = *st;
+
+    /*
+     * Every directory from the root down, to see the name or one leading
+     * to it replaced; the file itself, through its descriptor. A missing
+     * file makes do with the directories that exist: the first absent one
+     * is seen appearing in its parent.
+     */
+    char watch[PATH_MAX];
+    e->file_wd = -1;
+    for (const char *comp = e->path; ; ) {
+        int wd = -1;
+        if (e->depth < FCACHE_MAX_DEPTH) {
+            snprintf(watch, sizeof(watch), "%s/%.*s", srv->config.root_dir,
+                     (int)(comp - e->path), e->path);
+            wd = inotify_add_watch(fc->inotify_fd, watch, FCACHE_DIR_EVENTS);
+        }
+        if (wd < 0) {
+            if (fd >= 0)
+                goto unwatched;
+            break;
+        }
+        e->dir_wd[e->depth++] = wd;
+
+        const char *slash = strchr(comp, '/');
+        if (!slash)
+            break;
+        comp = slash + 1;
+    }
+    if (fd >= 0) {
+        snprintf(watch, sizeof(watch), "/proc/self/fd/%d", fd);
+        e->file_wd = inotify_add_watch(fc->inotify_fd, watch, FCACHE_FILE_EVENTS);
+        if (e->file_wd < 0)
+            goto unwatched;
+    }
+
+    fcache_entry_t **head = &fc->hash[path_hash(path) & fc->hash_mask];
+    e->hash_next = *head;
+    *head = e;
+    e->hashed = 1;
+    lru_push(fc, e);
+    fc->count++;
+    return e;
+
+unwatched:
+    watches_drop(fc, e->dir_wd, e->depth, e->file_wd);
+    free(e);
+    return NULL;
+}
+
+int fcache_init(tftp_server_t *srv)
+{
+    srv->fcache = NULL;
+    if (srv->config.file_cache <= 0)
+        return 0;
+
+    file_cache_t *fc = calloc(1, sizeof(*fc));
+    if (!fc) {
+        log_msg(LOG_CRITICAL, "Out of memory allocating file cache");
+        return -1;
+    }
+
+    /* Without inotify nothing could tell us a cached file changed */
+    fc->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fc->inotify_fd < 0) {
+        log_msg(LOG_WARN, "inotify unavailable, file cache disabled: %s", strerror(errno));
+        free(fc);
+        return 0;
+    }
+
+    uint32_t buckets = 64;
+    while (buckets < 2 * (uint32_t)srv->config.file_cache && buckets < (1u << 20))
+        buckets <<= 1;
+
+    fc->hash = calloc(buckets, sizeof(*fc->hash));
+    if (!fc->hash || event_add(srv, fc->inotify_fd, fc) < 0) {
+        log_msg(LOG_CRITICAL, "Cannot set up file cache");
+        close(fc->inotify_fd);
+        free(fc->hash);
+        free(fc);
+        return -1;
+    }
+    fc->hash_mask = buckets - 1;
+    fc->max = srv->config.file_cache;
+
+    srv->fcache = fc;
+    return 0;
+}
+
+void fcache_cleanup(tftp_server_t *srv)
+{
+    file_cache_t *fc = srv->fcache;
+    if (!fc)
+        return;
+
+    while (fc->lru_head)
+        entry_unhash(fc, fc->lru_head);
+
+    close(fc->inotify_fd);
+    free(fc->hash);
+    free(fc);
+    srv->fcache = NULL;
+}
+
+int fcache_open(tftp_session_t *sess, const char *filename, struct stat *st)
+{
+    tftp_server_t *srv = sess->srv;
+    file_cache_t *fc = srv->fcache;
+    const char *path = cache_path(filename);
+
+    fcache_entry_t *e = fc ? entry_lookup(fc, path) : NULL;
+    if (e && e->fd < 0) {
+        if (srv->now < e->expires)
+            return -ENOENT;
+        entry_unhash(fc, e);
+        e = NULL;
+    }
+    if (e) {
+        lru_unlink(fc, e);
+        lru_push(fc, e);
+        e->refs++;
+        sess->file_entry = e;
+        *st = e->st;
+        TRACE_PROBE(file_open, sess, filename, e->fd, 1);
+        return e->fd;
+    }
+
+    int fd = root_open(srv->root_fd, srv->config.root_dir, filename, O_RDONLY, 0);
+    TRACE_PROBE(file_open, sess, filename, fd, 0);
+    if (fd == -ENOENT && fc) {
+        e = entry_new(srv, path, -1, NULL);
+        if (e)
+            e->expires = srv->now + FCACHE_NEG_TTL_MS;
+        return fd;
+    }
+    if (fd < 0)
+        return fd;
+
+    if (fstat(fd, st) < 0) {
+        int err = errno;
+        close(fd);
+        return -err;
+    }
+
+    /* Anything but a regular file stays private to its session */
+    if (fc && S_ISREG(st->st_mode) && (e = entry_new(srv, path, fd, st)) != NULL) {
+        e->refs++;
+        sess->file_entry = e;
+    }
+    return fd;
+}
+
+int64_t fcache_netascii_size(tftp_session_t *sess, uint64_t size)
+{
+    fcache_entry_t *e = sess->file_entry;
+    if (e && e->netascii_size >= 0)
+        return e->netascii_size;
+
+    int64_t encoded = netascii_size(sess->fd, size);
+    if (e)
+        e->netascii_size = encoded;
+    return encoded;
+}
+
+void fcache_release(tftp_session_t *sess)
+{
+    fcache_entry_t *e = sess->file_entry;
+    if (!e)
+        return;
+
+    sess->file_entry = NULL;
+    sess->fd = -1;
+    if (--e->refs == 0 && !e->hashed)
+        entry_free(e);
+}
+
+void fcache_forget(tftp_server_t *srv, const char *filename)
+{
+    file_cache_t *fc = srv->fcache;
+    if (!fc)
+        return;
+
+    fcache_entry_t *e = entry_lookup(fc, cache_path(filename));
+    if (e)
+        entry_unhash(fc, e);
+}
+
+/* Whether an event on wd, about name in a directory, concerns e */
+static int entry_affected(const fcache_entry_t *e, int wd, const char *name)
+{
+    if (!name)
+        return entry_watches(e, wd);
+    for (int i = 0; i < e->depth; i++) {
+        if (e->dir_wd[i] == wd && component_is(e->path, i, name))
+            return 1;
+    }
+    return 0;
+}
+
+/* Drop every entry an event on wd concerns; name narrows a directory event */
+static void invalidate(file_cache_t *fc, int wd, const char *name)
+{
+    fcache_entry_t *e = fc->lru_head;
+    while (e) {
+        fcache_entry_t *next = e->lru_next;
+        if (entry_affected(e, wd, name))
+            entry_unhash(fc, e);
+        e = next;
+    }
+}
+
+void fcache_events(tftp_server_t *srv)
+{
+    file_cache_t *fc = srv->fcache;
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t n;
+
+    while ((n = read(fc->inotify_fd, buf, sizeof(buf))) > 0) {
+        for (char *p = buf; p < buf + n; ) {
+            struct inotify_event *ev = (struct inotify_event *)p;
+            p += sizeof(*ev) + ev->len;
+
+            /* Lost events: nothing cached can be trusted */
+            if (ev->mask & IN_Q_OVERFLOW) {
+                while (fc->lru_head)
+                    entry_unhash(fc, fc->lru_head);
+                continue;
+            }
+            invalidate(fc, ev->wd, ev->len > 0 ? ev->name : NULL);
+        }
+    }
+}
@@ -0,0 +1,656 @@
+/*
+ * utftp - File I/O engine
+ *
+ * With --io-uring, block reads and writes are submitted to an io_uring
+ * instead of blocking the event loop, so one slow disk only delays the
+ * sessions that touch it. Submissions are pushed once per loop pass and
+ * completions are signalled through an eventfd in the epoll set. Session
+ * files are registered as fixed files and small packet buffers come from
+ * a registered buffer pool. Without io_uring every operation runs inline
+ * with pread/pwrite and completes before the submit call returns, and
+ * downloads skip even the pread by sending from a mapping of the file.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "../include/fileio.h"
+#include "../include/session.h"
+#include "../include/event.h"
+#include "../include/log.h"
+
+#define FILEIO_READAHEAD_MIN    (256 * 1024)    /* Smallest fadvise() read-ahead chunk */
+
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING 1
+#endif
+#endif
+
+#ifdef HAVE_IO_URING
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <linux/io_uring.h>
+
+#define URING_ENTRIES       256
+#define URING_MAX_OPS       (URING_ENTRIES * 2)     /* Matches the CQ ring size */
+#define URING_BUF_SIZE      2048                    /* Covers MTU-sized blocks */
+#define URING_BUF_SLOTS     1024
+#define URING_FILE_SLOTS    4096
+
+/* Buffer whose session went away while the kernel still uses it */
+typedef struct {
+    uint8_t        *buf;
+    int             index;
+    int             refs;
+} fileio_orphan_t;
+
+typedef struct {
+    tftp_session_t *sess;
+    fileio_cb_t     cb;
+    uint64_t        tag;
+    fileio_orphan_t *orphan;
+    int             shared;             /* Completes without its session */
+    int             next_free;
+} fileio_op_t;
+
+struct fileio {
+    int             ring_fd;
+    int             event_fd;
+
+    /* Submission ring */
+    unsigned       *sq_head;
+    unsigned       *sq_tail;
+    unsigned       *sq_array;
+    unsigned        sq_mask;
+    unsigned        sq_entries;
+    unsigned        pending;
+    struct io_uring_sqe *sqes;
+
+    /* Completion ring */
+    unsigned       *cq_head;
+    unsigned       *cq_tail;
+    unsigned        cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void           *sq_ptr;
+    void           *cq_ptr;
+    size_t          sq_len;
+    size_t          cq_len;
+    size_t          sqes_len;
+
+    fileio_op_t     ops[URING_MAX_OPS];
+    int             free_op;
+
+    /* Registered buffer pool, one iovec split into slots */
+    uint8_t        *pool;
+    int             pool_slots;
+    int            *pool_free;
+    int             pool_top;
+
+    /* Fixed file table */
+    int            *file_free;
+    int             file_top;
+};
+
+static int uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void uring_free(struct fileio *io)
+{
+    if (io->sqes)
+        munmap(io->sqes, io->sqes_len);
+    if (io->cq_ptr && io->cq_ptr != io->sq_ptr)
+        munmap(io->cq_ptr, io->cq_len);
+    if (io->sq_ptr)
+        munmap(io->sq_ptr, io->sq_len);
+    if (io->ring_fd >= 0)
+        close(io->ring_fd);
+    if (io->event_fd >= 0)
+        close(io->event_fd);
+
+    for (int i = 0; i < URING_MAX_OPS; i++) {
+        fileio_orphan_t *orphan = io->ops[i].orphan;
+        if (orphan && --orphan->refs == 0) {
+            /* Pool slots go away with the pool itself */
+            if (orphan->index < 0)
+                free(orphan->buf);
+            free(orphan);
+        }
+    }
+
+    free(io->pool);
+    free(io->pool_free);
+    free(io->file_free);
+    free(io);
+}
+
+static struct fileio* uring_create(tftp_server_t *srv)
+{
+    struct fileio *io = calloc(1, sizeof(*io));
+    if (!io)
+        return NULL;
+    io->ring_fd = -1;
+    io->event_fd = -1;
+
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    io->ring_fd = uring_setup(URING_ENTRIES, &p);
+    if (io->ring_fd < 0) {
+        log_msg(LOG_WARN, "io_uring unavailable (%s), using synchronous file I/O", strerror(errno));
+        uring_free(io);
+        return NULL;
+    }
+
+    io->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    io->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (io->cq_len > io->sq_len)
+            io->sq_len = io->cq_len;
+        io->cq_len = io->sq_len;
+    }
+
+    io->sq_ptr = mmap(NULL, io->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      io->ring_fd, IORING_OFF_SQ_RING);
+    if (io->sq_ptr == MAP_FAILED) {
+        io->sq_ptr = NULL;
+        goto fail;
+    }
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        io->cq_ptr = io->sq_ptr;
+    } else {
+        io->cq_ptr = mmap(NULL, io->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                          io->ring_fd, IORING_OFF_CQ_RING);
+        if (io->cq_ptr == MAP_FAILED) {
+            io->cq_ptr = NULL;
+            goto fail;
+        }
+    }
+
+    io->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    io->sqes = mmap(NULL, io->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    io->ring_fd, IORING_OFF_SQES);
+    if (io->sqes == MAP_FAILED) {
+        io->sqes = NULL;
+        goto fail;
+    }
+
+    uint8_t *sq = io->sq_ptr;
+    io->sq_head = (unsigned *)(sq + p.sq_off.head);
+    io->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    io->sq_array = (unsigned *)(sq + p.sq_off.array);
+    io->sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+    io->sq_entries = p.sq_entries;
+
+    uint8_t *cq = io->cq_ptr;
+    io->cq_head = (unsigned *)(cq + p.cq_off.head);
+    io->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    io->cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+    io->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    /* Completions wake the event loop through an eventfd */
+    io->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (io->event_fd < 0 ||
+        uring_register(io->ring_fd, IORING_REGISTER_EVENTFD, &io->event_fd, 1) < 0)
+        goto fail;
+
+    for (int i = 0; i < URING_MAX_OPS; i++)
+        io->ops[i].next_free = i + 1;
+    io->ops[URING_MAX_OPS - 1].next_free = -1;
+    io->free_op = 0;
+
+    /* Registered buffers are an optimisation; carry on without them */
+    io->pool_slots = srv->config.max_sessions < URING_BUF_SLOTS ?
+                     srv->config.max_sessions : URING_BUF_SLOTS;
+    io->pool = aligned_alloc(4096, (size_t)io->pool_slots * URING_BUF_SIZE);
+    io->pool_free = malloc(io->pool_slots * sizeof(int));
+    if (io->pool && io->pool_free) {
+        struct iovec iov = { io->pool, (size_t)io->pool_slots * URING_BUF_SIZE };
+        if (uring_register(io->ring_fd, IORING_REGISTER_BUFFERS, &iov, 1) == 0) {
+            for (int i = 0; i < io->pool_slots; i++)
+                io->pool_free[io->pool_top++] = io->pool_slots - 1 - i;
+        }
+    }
+    if (io->pool_top == 0) {
+        free(io->pool);
+        io->pool = NULL;
+    }
+
+    /* Likewise a sparse fixed-file table */
+    int file_slots = srv->config.max_sessions < URING_FILE_SLOTS ?
+                     srv->config.max_sessions : URING_FILE_SLOTS;
+    int *fds = malloc(file_slots * sizeof(int));
+    io->file_free = malloc(file_slots * sizeof(int));
+    if (fds && io->file_free) {
+        for (int i = 0; i < file_slots; i++)
+            fds[i] = -1;
+        if (uring_register(io->ring_fd, IORING_REGISTER_FILES, fds, file_slots) == 0) {
+            for (int i = 0; i < file_slots; i++)
+                io->file_free[io->file_top++] = file_slots - 1 - i;
+        }
+    }
+    free(fds);
+
+    return io;
+
+fail:
+    log_msg(LOG_WARN, "io_uring setup failed (%s), using synchronous file I/O", strerror(errno));
+    uring_free(io);
+    return NULL;
+}
+
+static fileio_op_t* op_alloc(struct fileio *io)
+{
+    if (io->free_op < 0)
+        return NULL;
+    fileio_op_t *op = &io->ops[io->free_op];
+    io->free_op = op->next_free;
+    return op;
+}
+
+static void op_release(struct fileio *io, fileio_op_t *op)
+{
+    op->sess = NULL;
+    op->cb = NULL;
+    op->orphan = NULL;
+    op->shared = 0;
+    op->next_free = io->free_op;
+    io->free_op = (int)(op - io->ops);
+}
+
+static struct io_uring_sqe* sqe_get(tftp_server_t *srv)
+{
+    struct fileio *io = srv->fileio;
+    unsigned tail = *io->sq_tail;
+
+    if (tail - __atomic_load_n(io->sq_head, __ATOMIC_ACQUIRE) >= io->sq_entries) {
+        fileio_submit(srv);
+        if (tail - __atomic_load_n(io->sq_head, __ATOMIC_ACQUIRE) >= io->sq_entries)
+            return NULL;
+    }
+
+    struct io_uring_sqe *sqe = &io->sqes[tail & io->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+static void sqe_commit(struct fileio *io)
+{
+    unsigned tail = *io->sq_tail;
+    io->sq_array[tail & io->sq_mask] = tail & io->sq_mask;
+    __atomic_store_n(io->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    io->pending++;
+}
+
+static int uring_queue(tftp_session_t *sess, int opcode, const uint8_t *buf, size_t len,
+                       uint64_t off, uint64_t tag, fileio_cb_t cb, int shared)
+{
+    tftp_server_t *srv = sess->srv;
+    struct fileio *io = srv->fileio;
+
+    fileio_op_t *op = op_alloc(io);
+    if (!op)
+        return -1;
+
+    struct io_uring_sqe *sqe = sqe_get(srv);
+    if (!sqe) {
+        op_release(io, op);
+        return -1;
+    }
+
+    sqe->opcode = opcode;
+    sqe->addr = (uint64_t)(uintptr_t)buf;
+    sqe->len = (uint32_t)len;
+    sqe->off = off;
+    sqe->user_data = (uint64_t)(op - io->ops);
+    if (opcode == IORING_OP_FSYNC)
+        sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+
+    /* Fixed buffer when the whole range lies in the registered pool */
+    if (io->pool &&
+        buf >= io->pool && buf + len <= io->pool + (size_t)io->pool_slots * URING_BUF_SIZE) {
+        sqe->opcode = (opcode == IORING_OP_READ) ? IORING_OP_READ_FIXED : IORING_OP_WRITE_FIXED;
+        sqe->buf_index = 0;
+    }
+
+    if (sess->file_index >= 0) {
+        sqe->fd = sess->file_index;
+        sqe->flags |= IOSQE_FIXED_FILE;
+    } else {
+        sqe->fd = sess->fd;
+    }
+
+    op->sess = sess;
+    op->cb = cb;
+    op->tag = tag;
+    op->shared = shared;
+    if (!shared)
+        sess->io_pending++;
+    sqe_commit(io);
+    return 0;
+}
+#endif /* HAVE_IO_URING */
+
+int fileio_init(tftp_server_t *srv)
+{
+    srv->fileio = NULL;
+
+    if (!srv->config.io_uring)
+        return 0;
+
+#ifdef HAVE_IO_URING
+    srv->fileio = uring_create(srv);
+    if (srv->fileio && event_add(srv, srv->fileio->event_fd, srv->fileio) < 0) {
+        uring_free(srv->fileio);
+        srv->fileio = NULL;
+        return -1;
+    }
+#else
+    log_msg(LOG_WARN, "Built without io_uring support, using synchronous file I/O");
+#endif
+    return 0;
+}
+
+void fileio_cleanup(tftp_server_t *srv)
+{
+#ifdef HAVE_IO_URING
+    if (srv->fileio)
+        uring_free(srv->fileio);
+#endif
+    srv->fileio = NULL;
+}
+
+int fileio_async(tftp_server_t *srv)
+{
+    return srv->fileio != NULL;
+}
+
+uint8_t* fileio_buf_get(tftp_server_t *srv, size_t size, int *index)
+{
+#ifdef HAVE_IO_URING
+    struct fileio *io = srv->fileio;
+    if (io && io->pool_top > 0 && size <= URING_BUF_SIZE) {
+        *index = io->pool_free[--io->pool_top];
+        return io->pool + (size_t)*index * URING_BUF_SIZE;
+    }
+#else
+    (void)srv;
+#endif
+    *index = -1;
+    return malloc(size);
+}
+
+void fileio_buf_put(tftp_server_t *srv, uint8_t *buf, int index)
+{
+#ifdef HAVE_IO_URING
+    if (index >= 0) {
+        struct fileio *io = srv->fileio;
+        io->pool_free[io->pool_top++] = index;
+        return;
+    }
+#else
+    (void)srv;
+    (void)index;
+#endif
+    free(buf);
+}
+
+void fileio_attach(tftp_session_t *sess)
+{
+#ifdef HAVE_IO_URING
+    struct fileio *io = sess->srv->fileio;
+    if (!io || io->file_top == 0 || sess->fd < 0)
+        return;
+
+    int slot = io->file_free[io->file_top - 1];
+    struct io_uring_files_update up;
+    memset(&up, 0, sizeof(up));
+    up.offset = slot;
+    up.fds = (uint64_t)(uintptr_t)&sess->fd;
+
+    if (uring_register(io->ring_fd, IORING_REGISTER_FILES_UPDATE, &up, 1) == 1) {
+        io->file_top--;
+        sess->file_index = slot;
+    }
+#else
+    (void)sess;
+#endif
+}
+
+int fileio_detach(tftp_session_t *sess)
+{
+    int adopted = 0;
+#ifdef HAVE_IO_URING
+    struct fileio *io = sess->srv->fileio;
+    if (!io)
+        return 0;
+
+    /* In-flight operations keep the packet buffer alive until they finish */
+    fileio_orphan_t *orphan = NULL;
+    if (sess->io_pending > 0) {
+        orphan = calloc(1, sizeof(*orphan));
+        if (orphan) {
+            orphan->buf = sess->last_packet;
+            orphan->index = sess->buf_index;
+            adopted = 1;
+        }
+    }
+    for (int i = 0; i < URING_MAX_OPS; i++) {
+        fileio_op_t *op = &io->ops[i];
+        if (op->sess != sess)
+            continue;
+        op->sess = NULL;
+        if (orphan && !op->shared) {
+            op->orphan = orphan;
+            orphan->refs++;
+        }
+    }
+    sess->io_pending = 0;
+
+    /* Queued reads still name the session's file: hand them to the kernel before it is closed */
+    fileio_submit(sess->srv);
+
+    if (sess->file_index >= 0) {
+        int none = -1;
+        struct io_uring_files_update up;
+        memset(&up, 0, sizeof(up));
+        up.offset = sess->file_index;
+        up.fds = (uint64_t)(uintptr_t)&none;
+        uring_register(io->ring_fd, IORING_REGISTER_FILES_UPDATE, &up, 1);
+        io->file_free[io->file_top++] = sess->file_index;
+        sess->file_index = -1;
+    }
+#else
+    (void)sess;
+#endif
+    return adopted;
+}
+
+int fileio_map(tftp_session_t *sess, size_t size)
+{
+    if (fileio_async(sess->srv) || size == 0)
+        return -1;
+
+    void *map = mmap(NULL, size, PROT_READ, MAP_SHARED, sess->fd, 0);
+    if (map == MAP_FAILED) {
+        log_msg(LOG_DEBUG, "mmap of %s failed, reading instead: %s",
+                sess->filename, strerror(errno));
+        return -1;
+    }
+    madvise(map, size, MADV_SEQUENTIAL);
+
+    sess->map = map;
+    sess->map_len = size;
+    return 0;
+}
+
+void fileio_readahead(tftp_session_t *sess, uint64_t off)
+{
+    /* One hint per half chunk read: the kernel stays half to a whole chunk ahead */
+    uint64_t chunk = (uint64_t)sess->ring * sess->blksize * 4;
+    if (chunk < FILEIO_READAHEAD_MIN)
+        chunk = FILEIO_READAHEAD_MIN;
+
+    if (sess->ra_end >= sess->tsize || sess->ra_end > off + chunk / 2)
+        return;
+
+    if (sess->ra_end == 0)
+        posix_fadvise(sess->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    uint64_t start = sess->ra_end > off ? sess->ra_end : off;
+    uint64_t end = off + chunk < sess->tsize ? off + chunk : sess->tsize;
+    posix_fadvise(sess->fd, start, end - start, POSIX_FADV_WILLNEED);
+    sess->ra_end = end;
+}
+
+int fileio_map_intact(tftp_session_t *sess)
+{
+    struct stat st;
+    if (fstat(sess->fd, &st) < 0 || (uint64_t)st.st_size < sess->map_len) {
+        log_msg(LOG_WARN, "%s shrank during the transfer", sess->filename);
+        return 0;
+    }
+    return 1;
+}
+
+void fileio_unmap(tftp_session_t *sess)
+{
+    if (!sess->map)
+        return;
+    munmap((void *)sess->map, sess->map_len);
+    sess->map = NULL;
+    sess->map_len = 0;
+}
+
+int fileio_read(tftp_session_t *sess, uint8_t *buf, size_t len, uint64_t off,
+                uint64_t tag, fileio_cb_t cb)
+{
+#ifdef HAVE_IO_URING
+    if (sess->srv->fileio && uring_queue(sess, IORING_OP_READ, buf, len, off, tag, cb, 0) == 0)
+        return 0;
+#endif
+    ssize_t n = pread(sess->fd, buf, len, (off_t)off);
+    return cb(sess, tag, n < 0 ? -errno : n);
+}
+
+int fileio_write(tftp_session_t *sess, const uint8_t *buf, size_t len, uint64_t off,
+                 uint64_t tag, fileio_cb_t cb)
+{
+#ifdef HAVE_IO_URING
+    if (sess->srv->fileio && uring_queue(sess, IORING_OP_WRITE, buf, len, off, tag, cb, 0) == 0)
+        return 0;
+#endif
+    ssize_t n = pwrite(sess->fd, buf, len, (off_t)off);
+    return cb(sess, tag, n < 0 ? -errno : n);
+}
+
+int fileio_sync(tftp_session_t *sess, uint64_t tag, fileio_cb_t cb)
+{
+#ifdef HAVE_IO_URING
+    if (sess->srv->fileio && uring_queue(sess, IORING_OP_FSYNC, NULL, 0, 0, tag, cb, 0) == 0)
+        return 0;
+#endif
+    return cb(sess, tag, fdatasync(sess->fd) < 0 ? -errno : 0);
+}
+
+int fileio_read_shared(tftp_session_t *sess, uint8_t *buf, size_t len, uint64_t off,
+                       uint64_t tag, fileio_cb_t cb)
+{
+#ifdef HAVE_IO_URING
+    if (sess->srv->fileio && uring_queue(sess, IORING_OP_READ, buf, len, off, tag, cb, 1) == 0)
+        return 0;
+#endif
+    ssize_t n = pread(sess->fd, buf, len, (off_t)off);
+    cb(sess, tag, n < 0 ? -errno : n);
+    return 0;
+}
+
+void fileio_submit(tftp_server_t *srv)
+{
+#ifdef HAVE_IO_URING
+    struct fileio *io = srv->fileio;
+    if (!io || io->pending == 0)
+        return;
+
+    int ret = uring_enter(io->ring_fd, io->pending, 0, 0);
+    if (ret > 0) {
+        io->pending -= (unsigned)ret;
+    } else if (ret < 0 && errno != EAGAIN && errno != EBUSY && errno != EINTR) {
+        log_msg(LOG_ERROR, "io_uring_enter failed: %s", strerror(errno));
+    }
+#else
+    (void)srv;
+#endif
+}
+
+void fileio_complete(tftp_server_t *srv)
+{
+#ifdef HAVE_IO_URING
+    struct fileio *io = srv->fileio;
+    if (!io)
+        return;
+
+    uint64_t count;
+    while (read(io->event_fd, &count, sizeof(count)) > 0)
+        ;
+
+    unsigned head = *io->cq_head;
+    while (head != __atomic_load_n(io->cq_tail, __ATOMIC_ACQUIRE)) {
+        struct io_uring_cqe *cqe = &io->cqes[head & io->cq_mask];
+        fileio_op_t *op = &io->ops[cqe->user_data];
+        ssize_t res = cqe->res;
+
+        __atomic_store_n(io->cq_head, ++head, __ATOMIC_RELEASE);
+
+        tftp_session_t *sess = op->sess;
+        fileio_cb_t cb = op->cb;
+        uint64_t tag = op->tag;
+        fileio_orphan_t *orphan = op->orphan;
+        int shared = op->shared;
+        op_release(io, op);
+
+        if (shared) {
+            cb(sess, tag, res);
+            head = *io->cq_head;
+            continue;
+        }
+
+        if (orphan) {
+            if (--orphan->refs == 0) {
+                fileio_buf_put(srv, orphan->buf, orphan->index);
+                free(orphan);
+            }
+            continue;
+        }
+
+        if (sess) {
+            sess->io_pending--;
+            if (cb(sess, tag, res) != 0)
+                session_free(sess);
+        }
+
+        head = *io->cq_head;
+    }
+#else
+    (void)srv;
+#endif
+}
@@ -1,21 +1,80 @@
 /*
  * utftp - Logging implementation
+ *
+ * Workers never format or write a message themselves once the writer is
+ * running. A message becomes a slot of a bounded lock-free ring: its level,
+ * a coarse timestamp, the format pointer and the raw arguments that format
+ * consumes, strings copied in since they may not outlive the call. Each slot
+ * carries a sequence number that tells producers and the writer whose turn
+ * it is. The writer thread renders slots into lines and writes each batch
+ * with one flush. When the ring is full the message is dropped and counted,
+ * never waited for. Formats must be literals, as every caller's is.
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
 #include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 #include "../include/log.h"
 
+#define LOG_RING_SLOTS  2048        /* Power of two */
+#define LOG_ARGS_MAX    480         /* Arguments past this are cut, and the line with them */
+#define LOG_TEXT_MAX    512         /* Longer messages are truncated */
+#define LOG_IDLE_MS     100         /* Writer wakes at least this often */
+
+typedef struct {
+    uint64_t        seq;
+    int64_t         sec;
+    const char      *fmt;
+    uint16_t        level;
+    uint16_t        nargs;          /* Values in args, '*' widths included */
+    unsigned char   args[LOG_ARGS_MAX];
+} log_slot_t;
+
+/* How a conversion's argument is kept: integers widened, strings copied */
+enum { ARG_NONE, ARG_INT, ARG_UINT, ARG_DOUBLE, ARG_PTR, ARG_STR };
+
+typedef struct {
+    const char      *end;           /* Just past the conversion */
+    int             stars;          /* Width and precision given as '*' */
+    char            len;            /* Length modifier, 'H' for hh and 'q' for ll */
+    char            conv;
+    int             kind;
+} log_spec_t;
+
+static struct {
+    log_slot_t      slots[LOG_RING_SLOTS];
+    uint64_t        tail __attribute__((aligned(64)));  /* Next slot to claim */
+    uint64_t        head __attribute__((aligned(64)));  /* Next slot to write out, writer only */
+    uint32_t        sleeping;                           /* Futex: writer is waiting */
+    uint64_t        dropped;
+    int             running;
+    int             stop;
+    pthread_t       thread;
+} g_ring;
+
 /* Global state */
 int g_log_level = LOG_INFO;
 int g_use_color = 1;
 
-void log_msg(int level, const char *fmt, ...)
+static void format_time(int64_t sec, char *buf, size_t size)
 {
-    if (level < g_log_level)
-        return;
+    time_t now = (time_t)sec;
+    struct tm tm;
+    localtime_r(&now, &tm);
+    strftime(buf, size, "%H:%M:%S", &tm);
+}
 
+static void emit(int level, const char *timebuf, const char *text, int len)
+{
     const char *prefix;
     const char *color;
     FILE *out = stdout;
@@ -29,28 +88,442 @@ void log_msg(int level, const char *fmt, ...)
         default:           prefix = "   "; color = "";
     }
 
-    time_t now = time(NULL);
-    struct tm *tm = localtime(&now);
-    char timebuf[32];
-    strftime(timebuf, sizeof(timebuf), "%H:%M:%S", tm);
-
     if (g_use_color) {
-        fprintf(out, "%s%s%s %s[%s]%s ", C_DIM, timebuf, C_RESET, color, prefix, C_RESET);
+        fprintf(out, "%s%s%s %s[%s]%s %.*s\n", C_DIM, timebuf, C_RESET, color, prefix, C_RESET,
+                len, text);
     } else {
-        fprintf(out, "%s [%s] ", timebuf, prefix);
+        fprintf(out, "%s [%s] %.*s\n", timebuf, prefix, len, text);
+    }
+}
+
+/* Parse the conversion whose '%' is at p */
+static void spec_parse(const char *p, log_spec_t *sp)
+{
+    sp->stars = 0;
+    sp->len = 0;
+
+    p++;
+    while (*p && strchr("-+ #0'", *p))
+        p++;
+    if (*p == '*') {
+        sp->stars++;
+        p++;
+    } else {
+        while (*p >= '0' && *p <= '9')
+            p++;
+    }
+    if (*p == '.') {
+        p++;
+        if (*p == '*') {
+            sp->stars++;
+            p++;
+        } else {
+            while (*p >= '0' && *p <= '9')
+                p++;
+        }
+    }
+    if (*p == 'h' || *p == 'l') {
+        sp->len = *p++;
+        if (*p == sp->len) {
+            sp->len = sp->len == 'h' ? 'H' : 'q';
+            p++;
+        }
+    } else if (*p && strchr("Lqzjt", *p)) {
+        sp->len = *p++;
+    }
+    sp->conv = *p;
+    if (*p)
+        p++;
+    sp->end = p;
+
+    switch (sp->conv) {
+        case 'd': case 'i': case 'c':
+            sp->kind = ARG_INT; break;
+        case 'u': case 'o': case 'x': case 'X':
+            sp->kind = ARG_UINT; break;
+        case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+            sp->kind = ARG_DOUBLE; break;
+        case 'p': case 'n':
+            sp->kind = ARG_PTR; break;
+        case 's':
+            sp->kind = sp->len == 'l' ? ARG_PTR : ARG_STR; break;
+        default:
+            sp->kind = ARG_NONE;
+    }
+}
+
+static int arg_put(unsigned char *buf, size_t *pos, const void *v, size_t len)
+{
+    if (LOG_ARGS_MAX - *pos < len)
+        return 0;
+    memcpy(buf + *pos, v, len);
+    *pos += len;
+    return 1;
+}
+
+/* Copy what fmt consumes from ap into buf; returns the number of values kept */
+static unsigned args_encode(unsigned char *buf, const char *fmt, va_list ap)
+{
+    size_t pos = 0;
+    unsigned count = 0;
+
+    for (const char *p = fmt; (p = strchr(p, '%')); ) {
+        log_spec_t sp;
+        spec_parse(p, &sp);
+        p = sp.end;
+        if (sp.kind == ARG_NONE)
+            continue;
+
+        for (int i = 0; i < sp.stars; i++) {
+            int64_t v = va_arg(ap, int);
+            if (!arg_put(buf, &pos, &v, sizeof(v)))
+                return count;
+            count++;
+        }
+
+        int ok = 1;
+        if (sp.kind == ARG_INT) {
+            int64_t v;
+            switch (sp.len) {
+                case 'l': v = va_arg(ap, long); break;
+                case 'q': v = va_arg(ap, long long); break;
+                case 'z': v = va_arg(ap, ssize_t); break;
+                case 'j': v = va_arg(ap, intmax_t); break;
+                case 't': v = va_arg(ap, ptrdiff_t); break;
+                case 'H': v = (signed char)va_arg(ap, int); break;
+                case 'h': v = (short)va_arg(ap, int); break;
+                default:  v = va_arg(ap, int);
+            }
+            ok = arg_put(buf, &pos, &v, sizeof(v));
+        } else if (sp.kind == ARG_UINT) {
+            uint64_t v;
+            switch (sp.len) {
+                case 'l': v = va_arg(ap, unsigned long); break;
+                case 'q': v = va_arg(ap, unsigned long long); break;
+                case 'z': v = va_arg(ap, size_t); break;
+                case 'j': v = va_arg(ap, uintmax_t); break;
+                case 't': v = va_arg(ap, ptrdiff_t); break;
+                case 'H': v = (unsigned char)va_arg(ap, unsigned); break;
+                case 'h': v = (unsigned short)va_arg(ap, unsigned); break;
+                default:  v = va_arg(ap, unsigned);
+            }
+            ok = arg_put(buf, &pos, &v, sizeof(v));
+        } else if (sp.kind == ARG_DOUBLE) {
+            double v = sp.len == 'L' ? (double)va_arg(ap, long double) : va_arg(ap, double);
+            ok = arg_put(buf, &pos, &v, sizeof(v));
+        } else if (sp.kind == ARG_PTR) {
+            void *v = va_arg(ap, void *);
+            ok = arg_put(buf, &pos, &v, sizeof(v));
+        } else if (sp.kind == ARG_STR) {
+            const char *v = va_arg(ap, const char *);
+            if (!v)
+                v = "(null)";
+            size_t len = strnlen(v, LOG_ARGS_MAX);
+            if (pos >= LOG_ARGS_MAX)
+                return count;
+            if (len > LOG_ARGS_MAX - pos - 1)
+                len = LOG_ARGS_MAX - pos - 1;
+            memcpy(buf + pos, v, len);
+            buf[pos + len] = '\0';
+            pos += len + 1;
+        }
+        if (!ok)
+            return count;
+        count++;
     }
+    return count;
+}
+
+static void text_put(char *out, size_t size, size_t *pos, const char *s, size_t len)
+{
+    if (len > size - 1 - *pos)
+        len = size - 1 - *pos;
+    memcpy(out + *pos, s, len);
+    *pos += len;
+}
+
+/* Render a slot's format and arguments; returns the length of the text */
+static int args_format(char *out, size_t size, const char *fmt, const unsigned char *args, unsigned count)
+{
+    size_t pos = 0, at = 0;
+    const char *p = fmt;
+
+    while (*p && pos < size - 1) {
+        const char *pct = strchr(p, '%');
+        text_put(out, size, &pos, p, pct ? (size_t)(pct - p) : strlen(p));
+        if (!pct)
+            break;
+
+        log_spec_t sp;
+        spec_parse(pct, &sp);
+        p = sp.end;
+        if (sp.kind == ARG_NONE) {
+            text_put(out, size, &pos, sp.conv == '%' ? "%" : pct, sp.conv == '%' ? 1 : (size_t)(sp.end - pct));
+            continue;
+        }
+        /* The arguments were cut short here */
+        if (count < (unsigned)sp.stars + 1)
+            break;
+        count -= sp.stars + 1;
+
+        /* Rebuild the conversion with '*' filled in and the value at its widened type */
+        char spec[64];
+        size_t n = 0;
+        for (const char *q = pct; q < sp.end - 1 && n < sizeof(spec) - 16; q++) {
+            if (*q == '*') {
+                int64_t v;
+                memcpy(&v, args + at, sizeof(v));
+                at += sizeof(v);
+                if (n > 0 && spec[n - 1] == '.' && v < 0)
+                    n--;            /* A negative precision is as if none was given */
+                else
+                    n += snprintf(spec + n, sizeof(spec) - n, "%d", (int)v);
+            } else if (!strchr("hlLqzjt", *q)) {
+                spec[n++] = *q;
+            }
+        }
+        if ((sp.kind == ARG_INT || sp.kind == ARG_UINT) && sp.conv != 'c') {
+            spec[n++] = 'l';
+            spec[n++] = 'l';
+        }
+        spec[n++] = sp.conv;
+        spec[n] = '\0';
+
+        int len = 0;
+        if (sp.kind == ARG_STR) {
+            const char *v = (const char *)(args + at);
+            at += strlen(v) + 1;
+            len = snprintf(out + pos, size - pos, spec, v);
+        } else if (sp.kind == ARG_DOUBLE) {
+            double v;
+            memcpy(&v, args + at, sizeof(v));
+            at += sizeof(v);
+            len = snprintf(out + pos, size - pos, spec, v);
+        } else if (sp.kind == ARG_PTR) {
+            void *v;
+            memcpy(&v, args + at, sizeof(v));
+            at += sizeof(v);
+            if (sp.conv == 'p')
+                len = snprintf(out + pos, size - pos, spec, v);
+        } else {
+            int64_t v;
+            memcpy(&v, args + at, sizeof(v));
+            at += sizeof(v);
+            if (sp.conv == 'c')
+                len = snprintf(out + pos, size - pos, spec, (int)v);
+            else
+                len = snprintf(out + pos, size - pos, spec, (long long)v);
+        }
+        if (len > 0)
+            pos += (size_t)len < size - pos ? (size_t)len : size - 1 - pos;
+    }
+    out[pos] = '\0';
+    return (int)pos;
+}
+
+static int64_t coarse_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+    return ts.tv_sec;
+}
+
+static void wake_writer(void)
+{
+    if (__atomic_load_n(&g_ring.sleeping, __ATOMIC_SEQ_CST) &&
+        __atomic_exchange_n(&g_ring.sleeping, 0, __ATOMIC_SEQ_CST))
+        syscall(SYS_futex, &g_ring.sleeping, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+/* Claim a slot, or NULL when the writer is a full ring behind */
+static log_slot_t* ring_claim(void)
+{
+    uint64_t pos = __atomic_load_n(&g_ring.tail, __ATOMIC_RELAXED);
+
+    for (;;) {
+        log_slot_t *slot = &g_ring.slots[pos & (LOG_RING_SLOTS - 1)];
+        uint64_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        int64_t diff = (int64_t)(seq - pos);
 
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&g_ring.tail, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                return slot;
+        } else if (diff < 0) {
+            return NULL;
+        } else {
+            pos = __atomic_load_n(&g_ring.tail, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+void log_write(int level, const char *fmt, ...)
+{
     va_list args;
+
+    if (!__atomic_load_n(&g_ring.running, __ATOMIC_ACQUIRE)) {
+        char text[LOG_TEXT_MAX];
+        va_start(args, fmt);
+        int len = vsnprintf(text, sizeof(text), fmt, args);
+        va_end(args);
+        if (len >= (int)sizeof(text))
+            len = sizeof(text) - 1;
+
+        char timebuf[16];
+        format_time(coarse_seconds(), timebuf, sizeof(timebuf));
+
+        /* Keep the line together when several workers log at once */
+        FILE *out = level >= LOG_ERROR ? stderr : stdout;
+        flockfile(out);
+        emit(level, timebuf, text, len < 0 ? 0 : len);
+        fflush(out);
+        funlockfile(out);
+        return;
+    }
+
+    log_slot_t *slot = ring_claim();
+    if (!slot) {
+        __atomic_fetch_add(&g_ring.dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
     va_start(args, fmt);
-    vfprintf(out, fmt, args);
+    slot->nargs = args_encode(slot->args, fmt, args);
     va_end(args);
 
-    fprintf(out, "\n");
-    fflush(out);
+    slot->fmt = fmt;
+    slot->level = level;
+    slot->sec = coarse_seconds();
+
+    /* Publish: the writer owns the slot from here */
+    uint64_t pos = slot->seq;
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+    wake_writer();
+}
+
+/* Write out everything published so far; returns the number of messages */
+static int ring_drain(void)
+{
+    static int64_t last_sec = -1;
+    static char timebuf[16];
+    int count = 0;
+
+    for (;;) {
+        uint64_t pos = g_ring.head;
+        log_slot_t *slot = &g_ring.slots[pos & (LOG_RING_SLOTS - 1)];
+        if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != pos + 1)
+            break;
+
+        /* Messages mostly arrive within the same second as the one before */
+        if (slot->sec != last_sec) {
+            format_time(slot->sec, timebuf, sizeof(timebuf));
+            last_sec = slot->sec;
+        }
+        char text[LOG_TEXT_MAX];
+        int len = args_format(text, sizeof(text), slot->fmt, slot->args, slot->nargs);
+        emit(slot->level, timebuf, text, len);
+        __atomic_store_n(&slot->seq, pos + LOG_RING_SLOTS, __ATOMIC_RELEASE);
+        __atomic_store_n(&g_ring.head, pos + 1, __ATOMIC_RELEASE);
+        count++;
+    }
+
+    static uint64_t reported;
+    uint64_t dropped = __atomic_load_n(&g_ring.dropped, __ATOMIC_RELAXED);
+    if (dropped != reported) {
+        int64_t now = coarse_seconds();
+        if (now != last_sec) {
+            format_time(now, timebuf, sizeof(timebuf));
+            last_sec = now;
+        }
+        char text[64];
+        int len = snprintf(text, sizeof(text), "%llu log messages dropped",
+                           (unsigned long long)(dropped - reported));
+        emit(LOG_WARN, timebuf, text, len);
+        reported = dropped;
+        count++;
+    }
+
+    if (count > 0) {
+        fflush(stdout);
+        fflush(stderr);
+    }
+    return count;
+}
+
+static void* writer_main(void *arg)
+{
+    (void)arg;
+
+    for (;;) {
+        if (ring_drain() > 0)
+            continue;
+        if (__atomic_load_n(&g_ring.stop, __ATOMIC_ACQUIRE))
+            break;
+
+        /* Announce the wait, then look once more so no wakeup is missed */
+        __atomic_store_n(&g_ring.sleeping, 1, __ATOMIC_SEQ_CST);
+        uint64_t pos = g_ring.head;
+        if (__atomic_load_n(&g_ring.slots[pos & (LOG_RING_SLOTS - 1)].seq, __ATOMIC_SEQ_CST) == pos + 1) {
+            __atomic_store_n(&g_ring.sleeping, 0, __ATOMIC_RELAXED);
+            continue;
+        }
+        struct timespec idle = { 0, LOG_IDLE_MS * 1000000L };
+        syscall(SYS_futex, &g_ring.sleeping, FUTEX_WAIT_PRIVATE, 1, &idle, NULL, 0);
+    }
+
+    ring_drain();
+    return NULL;
+}
+
+int log_start(void)
+{
+    if (g_ring.running)
+        return 0;
+
+    for (uint64_t i = 0; i < LOG_RING_SLOTS; i++)
+        g_ring.slots[i].seq = i;
+    g_ring.tail = 0;
+    g_ring.head = 0;
+    g_ring.stop = 0;
+
+    /* Fall back to writing in place when there is no thread for it */
+    int err = pthread_create(&g_ring.thread, NULL, writer_main, NULL);
+    if (err != 0) {
+        log_write(LOG_WARN, "Logging in place, cannot start log writer: %s", strerror(err));
+        return -1;
+    }
+    __atomic_store_n(&g_ring.running, 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void log_flush(void)
+{
+    if (!__atomic_load_n(&g_ring.running, __ATOMIC_ACQUIRE))
+        return;
+
+    uint64_t target = __atomic_load_n(&g_ring.tail, __ATOMIC_ACQUIRE);
+    while ((int64_t)(__atomic_load_n(&g_ring.head, __ATOMIC_ACQUIRE) - target) < 0) {
+        wake_writer();
+        usleep(1000);
+    }
+}
+
+void log_stop(void)
+{
+    if (!g_ring.running)
+        return;
+
+    __atomic_store_n(&g_ring.running, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&g_ring.stop, 1, __ATOMIC_RELEASE);
+    wake_writer();
+    pthread_join(g_ring.thread, NULL);
 }
 
 void print_banner(void)
 {
+    /* Whatever was logged first stays ahead of the banner */
+    log_flush();
+
     if (g_use_color) {
         printf("\n");
         printf("  %s█▀▀▀▀▀▀▀▀▀▀▀▀▀▀▀▀▀▀▀▀▀▀▀▀▀▀▀█%s\n", C_CYAN, C_RESET);
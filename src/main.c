@@ -11,20 +11,63 @@
 #include <unistd.h>
 #include <getopt.h>
 #include <limits.h>
+#include <sys/resource.h>
+#include <arpa/inet.h>
 #include "../include/utftp.h"
-#include "../include/server.h"
+#include "../include/worker.h"
+#include "../include/shape.h"
+#include "../include/runq.h"
+#include "../include/metrics.h"
 #include "../include/log.h"
 
-/* Global server pointer for signal handler */
-static tftp_server_t *g_server = NULL;
+/* Long-only options */
+#define OPT_GRO    256
+#define OPT_NO_GSO 257
+#define OPT_URING  258
+#define OPT_SHARED 259
+#define OPT_CACHE  260
+#define OPT_MCAST  261
+#define OPT_SYNC   262
+#define OPT_FCACHE 263
+#define OPT_RATE   264
+#define OPT_RATE_CLIENT 265
+#define OPT_RATE_SUBNET 266
+#define OPT_PRIORITY 267
+#define OPT_METRICS 268
+#define OPT_TRACE_LAT 269
+
+/* Global worker pool pointer for signal handler */
+static tftp_workers_t *g_workers = NULL;
 
 static void signal_handler(int sig)
 {
     (void)sig;
-    if (g_server) {
+    if (g_workers) {
         printf("\n");
         log_msg(LOG_INFO, "Shutting down gracefully...");
-        tftp_server_stop(g_server);
+        workers_stop(g_workers);
+    }
+}
+
+static void raise_fd_limit(const tftp_config_t *config)
+{
+    /* Each session holds a file descriptor and, unless shared, a socket; the file cache keeps more open */
+    long workers = config->workers > 0 ? config->workers : sysconf(_SC_NPROCESSORS_ONLN);
+    if (workers < 1)
+        workers = 1;
+    int per_session = config->shared_sockets > 0 ? 1 : 2;
+    rlim_t needed = ((rlim_t)config->max_sessions * per_session + config->file_cache) * workers + 64;
+
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) < 0 || rl.rlim_cur >= needed)
+        return;
+
+    rl.rlim_cur = (rl.rlim_max == RLIM_INFINITY || rl.rlim_max >= needed) ? needed : rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+
+    if (rl.rlim_cur < needed) {
+        log_msg(LOG_WARN, "File descriptor limit %lu is below the %lu needed for %d sessions",
+                (unsigned long)rl.rlim_cur, (unsigned long)needed, config->max_sessions);
     }
 }
 
@@ -33,13 +76,30 @@ static void print_usage(const char *prog)
     printf("Ultra TFTP Server\n\n");
     printf("Usage: %s [options]\n\n", prog);
     printf("Options:\n");
-    printf("  -i, --ip ADDR       Bind to specific IP address (default: 0.0.0.0)\n");
-    printf("  -p, --port PORT     Listen port (default: 69)\n");
-    printf("  -r, --root DIR      Root directory (default: current)\n");
-    printf("  -t, --timeout SEC   Timeout in seconds (default: 30)\n");
-    printf("  -d, --debug         Enable debug logging\n");
-    printf("  -q, --quiet         Quiet mode (critical errors only)\n");
-    printf("  -h, --help          Show this help\n");
+    printf("  -i, --ip ADDR         Bind to specific IP address (default: 0.0.0.0)\n");
+    printf("  -p, --port PORT       Listen port (default: 69)\n");
+    printf("  -r, --root DIR        Root directory (default: current)\n");
+    printf("  -t, --timeout SEC     Longest retransmit interval in seconds (default: 30)\n");
+    printf("  -m, --max-sessions N  Concurrent transfers per worker (default: %d)\n", MAX_SESSIONS);
+    printf("  -w, --workers N       Worker threads, 0 = one per CPU (default: 1)\n");
+    printf("      --gro             Coalesce inbound DATA with UDP GRO\n");
+    printf("      --no-gso          Disable UDP GSO for equal-size bursts\n");
+    printf("      --io-uring        Run file reads/writes through io_uring\n");
+    printf("      --shared-sockets N  Serve all transfers from N shared sockets\n");
+    printf("      --cache-size MB   Shared block cache for downloads, 0 = off (default: 0)\n");
+    printf("      --file-cache N    Open files kept per worker, 0 = off (default: %d)\n", FILE_CACHE_ENTRIES);
+    printf("      --multicast ADDR[:PORT]  RFC 2090 group base address (default port: %d)\n", TFTP_MCAST_PORT);
+    printf("      --sync MODE       Upload durability: none, close, or N seconds between syncs (default: none)\n");
+    printf("      --rate RATE       Cap downloads from all clients, bytes/s with K/M/G (default: none)\n");
+    printf("      --rate-client RATE  Cap downloads to each client address\n");
+    printf("      --rate-subnet CIDR=RATE  Cap downloads to a subnet, up to %d times\n", MAX_SHAPE_SUBNETS);
+    printf("      --priority RULE   CIDR=W or GLOB=W, weight 1-%d of matching transfers, up to %d times\n",
+           MAX_RUNQ_WEIGHT, MAX_RUNQ_CLASSES);
+    printf("      --metrics ADDR    Prometheus metrics on PORT, HOST:PORT or a Unix socket path (default: off)\n");
+    printf("      --trace-latency   Log where each transfer's time went: parse, open, disk, send, wait\n");
+    printf("  -d, --debug           Enable debug logging\n");
+    printf("  -q, --quiet           Quiet mode (critical errors only)\n");
+    printf("  -h, --help            Show this help\n");
 }
 
 int main(int argc, char *argv[])
@@ -50,6 +110,9 @@ int main(int argc, char *argv[])
     /* Defaults */
     config.port = TFTP_PORT;
     config.timeout_sec = TFTP_TIMEOUT_SEC;
+    config.max_sessions = MAX_SESSIONS;
+    config.workers = 1;
+    config.file_cache = FILE_CACHE_ENTRIES;
     getcwd(config.root_dir, sizeof(config.root_dir));
 
     static struct option long_opts[] = {
@@ -57,6 +120,22 @@ int main(int argc, char *argv[])
         {"port",    required_argument, 0, 'p'},
         {"root",    required_argument, 0, 'r'},
         {"timeout", required_argument, 0, 't'},
+        {"max-sessions", required_argument, 0, 'm'},
+        {"workers", required_argument, 0, 'w'},
+        {"gro",     no_argument,       0, OPT_GRO},
+        {"no-gso",  no_argument,       0, OPT_NO_GSO},
+        {"io-uring", no_argument,      0, OPT_URING},
+        {"shared-sockets", required_argument, 0, OPT_SHARED},
+        {"cache-size", required_argument, 0, OPT_CACHE},
+        {"file-cache", required_argument, 0, OPT_FCACHE},
+        {"multicast", required_argument, 0, OPT_MCAST},
+        {"sync",    required_argument, 0, OPT_SYNC},
+        {"rate",    required_argument, 0, OPT_RATE},
+        {"rate-client", required_argument, 0, OPT_RATE_CLIENT},
+        {"rate-subnet", required_argument, 0, OPT_RATE_SUBNET},
+        {"priority", required_argument, 0, OPT_PRIORITY},
+        {"metrics", required_argument, 0, OPT_METRICS},
+        {"trace-latency", no_argument, 0, OPT_TRACE_LAT},
         {"debug",   no_argument,       0, 'd'},
         {"quiet",   no_argument,       0, 'q'},
         {"help",    no_argument,       0, 'h'},
@@ -64,7 +143,7 @@ int main(int argc, char *argv[])
     };
 
     int opt;
-    while ((opt = getopt_long(argc, argv, "i:p:r:t:dqh", long_opts, NULL)) != -1) {
+    while ((opt = getopt_long(argc, argv, "i:p:r:t:m:w:dqh", long_opts, NULL)) != -1) {
         switch (opt) {
             case 'i':
                 strncpy(config.bind_addr, optarg, sizeof(config.bind_addr) - 1);
@@ -81,6 +160,131 @@ int main(int argc, char *argv[])
             case 't':
                 config.timeout_sec = atoi(optarg);
                 break;
+            case 'm':
+                config.max_sessions = atoi(optarg);
+                if (config.max_sessions < 1 || config.max_sessions > MAX_SESSIONS_LIMIT) {
+                    fprintf(stderr, "Max sessions must be between 1 and %d\n", MAX_SESSIONS_LIMIT);
+                    return 1;
+                }
+                break;
+            case 'w':
+                config.workers = atoi(optarg);
+                break;
+            case OPT_GRO:
+                config.gro = 1;
+                break;
+            case OPT_NO_GSO:
+                config.no_gso = 1;
+                break;
+            case OPT_URING:
+                config.io_uring = 1;
+                break;
+            case OPT_SHARED:
+                config.shared_sockets = atoi(optarg);
+                if (config.shared_sockets < 0 || config.shared_sockets > MAX_SHARED_SOCKS) {
+                    fprintf(stderr, "Shared sockets must be between 0 and %d\n", MAX_SHARED_SOCKS);
+                    return 1;
+                }
+                break;
+            case OPT_CACHE:
+                config.cache_mb = atoi(optarg);
+                if (config.cache_mb < 0) {
+                    fprintf(stderr, "Cache size must not be negative\n");
+                    return 1;
+                }
+                break;
+            case OPT_FCACHE:
+                config.file_cache = atoi(optarg);
+                if (config.file_cache < 0) {
+                    fprintf(stderr, "File cache size must not be negative\n");
+                    return 1;
+                }
+                break;
+            case OPT_MCAST: {
+                char *colon = strchr(optarg, ':');
+                if (colon)
+                    *colon = '\0';
+                struct in_addr group;
+                if (inet_pton(AF_INET, optarg, &group) != 1 || !IN_MULTICAST(ntohl(group.s_addr))) {
+                    fprintf(stderr, "Invalid multicast address: %s\n", optarg);
+                    return 1;
+                }
+                strncpy(config.mcast_addr, optarg, sizeof(config.mcast_addr) - 1);
+                int port = colon ? atoi(colon + 1) : TFTP_MCAST_PORT;
+                if (port <= 0 || port > 65535) {
+                    fprintf(stderr, "Invalid multicast port: %s\n", colon + 1);
+                    return 1;
+                }
+                config.mcast_port = (uint16_t)port;
+                break;
+            }
+            case OPT_SYNC:
+                if (strcmp(optarg, "none") == 0) {
+                    config.sync_mode = SYNC_NONE;
+                } else if (strcmp(optarg, "close") == 0) {
+                    config.sync_mode = SYNC_CLOSE;
+                } else if (atoi(optarg) > 0) {
+                    config.sync_mode = SYNC_PERIODIC;
+                    config.sync_interval = atoi(optarg);
+                } else {
+                    fprintf(stderr, "Sync mode must be none, close, or a number of seconds\n");
+                    return 1;
+                }
+                break;
+            case OPT_RATE:
+            case OPT_RATE_CLIENT: {
+                uint64_t rate = shape_parse_rate(optarg);
+                if (rate == 0) {
+                    fprintf(stderr, "Invalid rate: %s\n", optarg);
+                    return 1;
+                }
+                if (opt == OPT_RATE)
+                    config.rate = rate;
+                else
+                    config.client_rate = rate;
+                break;
+            }
+            case OPT_RATE_SUBNET: {
+                char *eq = strchr(optarg, '=');
+                char *slash = strchr(optarg, '/');
+                if (!eq || config.subnet_count >= MAX_SHAPE_SUBNETS) {
+                    fprintf(stderr, "Invalid subnet rate: %s\n", optarg);
+                    return 1;
+                }
+                *eq = '\0';
+                if (slash && slash < eq)
+                    *slash = '\0';
+                int bits = (slash && slash < eq) ? atoi(slash + 1) : 32;
+                struct in_addr net;
+                shape_subnet_t *s = &config.subnets[config.subnet_count];
+                s->rate = shape_parse_rate(eq + 1);
+                if (inet_pton(AF_INET, optarg, &net) != 1 || bits < 0 || bits > 32 || s->rate == 0) {
+                    fprintf(stderr, "Invalid subnet rate: %s\n", optarg);
+                    return 1;
+                }
+                s->mask = bits ? 0xFFFFFFFFu << (32 - bits) : 0;
+                s->net = ntohl(net.s_addr) & s->mask;
+                config.subnet_count++;
+                break;
+            }
+            case OPT_PRIORITY:
+                if (config.class_count >= MAX_RUNQ_CLASSES ||
+                    runq_parse_class(optarg, &config.classes[config.class_count]) < 0) {
+                    fprintf(stderr, "Invalid priority rule: %s\n", optarg);
+                    return 1;
+                }
+                config.class_count++;
+                break;
+            case OPT_METRICS:
+                if (strlen(optarg) >= sizeof(config.metrics_addr)) {
+                    fprintf(stderr, "Invalid metrics address: %s\n", optarg);
+                    return 1;
+                }
+                strcpy(config.metrics_addr, optarg);
+                break;
+            case OPT_TRACE_LAT:
+                config.trace_latency = 1;
+                break;
             case 'd':
                 config.debug = 1;
                 g_log_level = LOG_DEBUG;
@@ -99,21 +303,37 @@ int main(int argc, char *argv[])
     /* Detect if terminal supports colors */
     g_use_color = isatty(STDOUT_FILENO);
 
+    raise_fd_limit(&config);
+
     /* Setup signal handlers */
     signal(SIGINT, signal_handler);
     signal(SIGTERM, signal_handler);
     signal(SIGPIPE, SIG_IGN);
 
-    /* Initialize and run server */
-    tftp_server_t server;
-    g_server = &server;
+    /* Initialize and run server workers */
+    tftp_workers_t workers;
 
-    if (tftp_server_init(&server, &config) < 0) {
+    log_start();
+    shape_init(&config);
+    if (workers_init(&workers, &config) < 0) {
+        shape_cleanup();
+        log_stop();
+        return 1;
+    }
+    if (metrics_start(config.metrics_addr, workers.servers, workers.count) < 0) {
+        workers_cleanup(&workers);
+        shape_cleanup();
+        log_stop();
         return 1;
     }
+    g_workers = &workers;
 
-    tftp_server_run(&server);
-    tftp_server_cleanup(&server);
+    workers_run(&workers);
+    g_workers = NULL;
+    metrics_stop();
+    workers_cleanup(&workers);
+    shape_cleanup();
+    log_stop();
 
     return 0;
 }
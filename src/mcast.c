@@ -0,0 +1,211 @@
+/*
+ * utftp - RFC 2090 multicast transfers
+ *
+ * Downloads of the same file and blksize that ask for the multicast
+ * option share a group: one socket, one multicast address, and the DATA
+ * for each block sent once to it. Members are kept in join order and the
+ * first one is the master, an ordinary RRQ session whose window sends to
+ * the group and whose ACKs pace it. When the master finishes or goes
+ * silent, the next member is promoted with a fresh OACK and resumes after
+ * the last block it holds in order, which is how late joiners get the
+ * blocks they missed.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include "../include/mcast.h"
+#include "../include/session.h"
+#include "../include/event.h"
+#include "../include/log.h"
+
+static int group_open(tftp_server_t *srv, mcast_group_t *group, const cache_file_t *file)
+{
+    int sock = session_open_socket(srv);
+    if (sock < 0)
+        return -1;
+
+    /* Stay on the local segment, and deliver to members on this host too */
+    unsigned char ttl = 1, loop = 1;
+    setsockopt(sock, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+    setsockopt(sock, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop));
+
+    if (srv->config.bind_addr[0]) {
+        struct in_addr ifaddr;
+        inet_pton(AF_INET, srv->config.bind_addr, &ifaddr);
+        setsockopt(sock, IPPROTO_IP, IP_MULTICAST_IF, &ifaddr, sizeof(ifaddr));
+    }
+
+    int bufsize = 4 * 1024 * 1024;
+    setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &bufsize, sizeof(bufsize));
+
+    if (event_add(srv, sock, group) < 0) {
+        close(sock);
+        return -1;
+    }
+
+    /* Each group of each worker gets its own port on the configured address */
+    int index = (int)(group - srv->groups);
+    memset(&group->addr, 0, sizeof(group->addr));
+    group->addr.sin_family = AF_INET;
+    group->addr.sin_port = htons(srv->config.mcast_port +
+                                 srv->worker_id * MAX_MCAST_GROUPS + index);
+    inet_pton(AF_INET, srv->config.mcast_addr, &group->addr.sin_addr);
+
+    group->sock = sock;
+    group->file = *file;
+    group->members = NULL;
+    group->high = 0;
+    return 0;
+}
+
+static void group_option(mcast_group_t *group, int master, tftp_options_t *opts)
+{
+    snprintf(opts->multicast, sizeof(opts->multicast), "%s,%u,%d",
+             inet_ntoa(group->addr.sin_addr), ntohs(group->addr.sin_port), master);
+    opts->has_multicast = 1;
+}
+
+/* Hand the group to its next member: it answers the OACK with the last block it holds */
+static void group_promote(tftp_session_t *sess)
+{
+    tftp_options_t opts;
+    memset(&opts, 0, sizeof(opts));
+    opts.blksize = TFTP_DEF_BLKSIZE;
+    group_option(sess->group, 1, &opts);
+
+    uint8_t pkt[512];
+    int pkt_len = packet_build_oack(pkt, &opts);
+
+    log_msg(LOG_DEBUG, "Multicast master for %s is now %s:%d",
+            sess->filename,
+            inet_ntoa(sess->client_addr.sin_addr),
+            ntohs(sess->client_addr.sin_port));
+
+    /* Silence while waiting is expected; idle time counts from now */
+    sess->last_heard = sess->srv->now;
+    sess->state = STATE_SENDING;
+    sess->win_base = 0;
+    session_rtt_start(sess, 0);
+    session_send_packet(sess, pkt, pkt_len);
+}
+
+void mcast_init(tftp_server_t *srv)
+{
+    for (int i = 0; i < MAX_MCAST_GROUPS; i++)
+        srv->groups[i].sock = -1;
+}
+
+void mcast_cleanup(tftp_server_t *srv)
+{
+    for (int i = 0; i < MAX_MCAST_GROUPS; i++) {
+        if (srv->groups[i].sock >= 0) {
+            close(srv->groups[i].sock);
+            srv->groups[i].sock = -1;
+        }
+    }
+}
+
+mcast_group_t* mcast_group_of(tftp_server_t *srv, void *ptr)
+{
+    mcast_group_t *group = ptr;
+    if (group >= srv->groups && group < srv->groups + MAX_MCAST_GROUPS)
+        return group;
+    return NULL;
+}
+
+int mcast_join(tftp_session_t *sess, const struct stat *st, tftp_options_t *opts)
+{
+    tftp_server_t *srv = sess->srv;
+
+    if (!srv->config.mcast_addr[0] || !S_ISREG(st->st_mode))
+        return -1;
+
+    cache_file_t file;
+    cache_file_key(&file, st, sess->blksize);
+
+    mcast_group_t *group = NULL, *spare = NULL;
+    for (int i = 0; i < MAX_MCAST_GROUPS; i++) {
+        mcast_group_t *g = &srv->groups[i];
+        if (g->sock < 0) {
+            if (!spare)
+                spare = g;
+        } else if (cache_file_equal(&g->file, &file)) {
+            group = g;
+            break;
+        }
+    }
+
+    if (!group) {
+        if (!spare || group_open(srv, spare, &file) < 0) {
+            log_msg(LOG_DEBUG, "No multicast group for %s, sending unicast", sess->filename);
+            return -1;
+        }
+        group = spare;
+    }
+
+    /* The group's port is this member's TID from the OACK on */
+    if (sess->sock >= 0 && !sess->shared_sock)
+        close(sess->sock);
+    sess->sock = group->sock;
+    sess->shared_sock = 1;
+
+    tftp_session_t **pp = &group->members;
+    while (*pp)
+        pp = &(*pp)->group_next;
+    *pp = sess;
+    sess->group_next = NULL;
+    sess->group = group;
+
+    int master = (group->members == sess);
+    group_option(group, master, opts);
+
+    log_msg(LOG_DEBUG, "%s:%d joined multicast group %s:%d as %s",
+            inet_ntoa(sess->client_addr.sin_addr),
+            ntohs(sess->client_addr.sin_port),
+            srv->config.mcast_addr, ntohs(group->addr.sin_port),
+            master ? "master" : "member");
+    return master;
+}
+
+void mcast_leave(tftp_session_t *sess)
+{
+    mcast_group_t *group = sess->group;
+    if (!group)
+        return;
+
+    int was_master = (group->members == sess);
+
+    tftp_session_t **pp = &group->members;
+    while (*pp && *pp != sess)
+        pp = &(*pp)->group_next;
+    if (*pp)
+        *pp = sess->group_next;
+    sess->group_next = NULL;
+    sess->group = NULL;
+
+    if (!group->members) {
+        close(group->sock);
+        group->sock = -1;
+        return;
+    }
+
+    if (was_master && sess->srv->running)
+        group_promote(group->members);
+}
+
+uint64_t mcast_ack_block(tftp_session_t *sess, uint16_t ack)
+{
+    uint64_t high = sess->group ? sess->group->high : 0;
+
+    /* 0 is a member holding nothing; otherwise the newest block sent with that wire number */
+    if (ack == 0)
+        return 0;
+
+    uint32_t cycle = WIRE_CYCLE(sess);
+    uint64_t back = (cycle - session_wire_ahead(sess, high, ack)) % cycle;
+    return back > high ? ack : high - back;
+}
@@ -0,0 +1,322 @@
+/*
+ * utftp - Metrics registry and Prometheus exporter
+ *
+ * Each worker keeps a tftp_metrics_t in its server and updates it without
+ * atomics or locks. The registry below describes every field once: name,
+ * type, labels and where it lives, and the exporter thread walks it for
+ * each scrape, summing the field over all workers. Scrapes are rare and
+ * small, so one blocking thread serving one connection at a time is enough.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+#include "../include/metrics.h"
+#include "../include/utftp.h"
+#include "../include/log.h"
+
+#define METRICS_POLL_MS     200     /* How soon the exporter notices a stop */
+#define METRICS_IO_MS       1000    /* Slow scrapers are cut off */
+
+const uint32_t metric_blksize_bounds[METRIC_BUCKETS] = {
+    256, 512, 1024, 1400, 1408, 1428, 1456, 1468,
+    2048, 4096, 8192, 8960, 16384, 32768, 49152, 65464,
+};
+const uint32_t metric_duration_bounds[METRIC_BUCKETS] = {
+    10, 50, 100, 250, 500, 1000, 2500, 5000,
+    10000, 30000, 60000, 120000, 300000, 600000, 1800000, 3600000,
+};
+const uint32_t metric_rtt_bounds[METRIC_BUCKETS] = {
+    0, 1, 2, 3, 5, 10, 20, 50,
+    100, 200, 500, 1000, 2000, 5000, 10000, 30000,
+};
+
+typedef enum {
+    METRIC_COUNTER,
+    METRIC_GAUGE,
+    METRIC_HISTOGRAM,
+} metric_type_t;
+
+typedef struct {
+    const char     *name;
+    const char     *help;
+    metric_type_t   type;
+    const char     *labels;             /* Without braces, NULL for none */
+    size_t          offset;             /* Into tftp_metrics_t */
+    const uint32_t *bounds;             /* Histograms */
+    double          scale;              /* Exported value per stored unit */
+} metric_desc_t;
+
+#define FIELD(f) offsetof(tftp_metrics_t, f)
+
+/* Series of one name are adjacent; HELP and TYPE go out with the first */
+static const metric_desc_t registry[] = {
+    { "utftp_sessions_active", "Transfers in progress",
+      METRIC_GAUGE, NULL, FIELD(sessions_active), NULL, 1 },
+    { "utftp_requests_total", "Read and write requests accepted",
+      METRIC_COUNTER, "op=\"rrq\"", FIELD(requests_rrq), NULL, 1 },
+    { "utftp_requests_total", NULL,
+      METRIC_COUNTER, "op=\"wrq\"", FIELD(requests_wrq), NULL, 1 },
+    { "utftp_busy_rejections_total", "Requests refused with Server busy",
+      METRIC_COUNTER, NULL, FIELD(busy_rejections), NULL, 1 },
+    { "utftp_sent_bytes_total", "File data bytes sent, retransmissions included",
+      METRIC_COUNTER, NULL, FIELD(bytes_sent), NULL, 1 },
+    { "utftp_received_bytes_total", "File data bytes received",
+      METRIC_COUNTER, NULL, FIELD(bytes_received), NULL, 1 },
+    { "utftp_retransmits_total", "Packets sent again after a timeout",
+      METRIC_COUNTER, NULL, FIELD(retransmits), NULL, 1 },
+    { "utftp_timeouts_total", "Transfers dropped after the client went silent",
+      METRIC_COUNTER, NULL, FIELD(timeouts), NULL, 1 },
+    { "utftp_send_dropped_total", "Datagrams the kernel refused, left to the retransmit timer",
+      METRIC_COUNTER, NULL, FIELD(send_dropped), NULL, 1 },
+    { "utftp_blksize_bytes", "Negotiated block size per transfer",
+      METRIC_HISTOGRAM, NULL, FIELD(blksize), metric_blksize_bounds, 1 },
+    { "utftp_transfer_duration_seconds", "Time to complete a transfer",
+      METRIC_HISTOGRAM, "op=\"rrq\"", FIELD(duration_rrq), metric_duration_bounds, 0.001 },
+    { "utftp_transfer_duration_seconds", NULL,
+      METRIC_HISTOGRAM, "op=\"wrq\"", FIELD(duration_wrq), metric_duration_bounds, 0.001 },
+    { "utftp_ack_rtt_seconds", "Time from sending a block to its ACK",
+      METRIC_HISTOGRAM, NULL, FIELD(ack_rtt), metric_rtt_bounds, 0.001 },
+};
+
+static struct {
+    int             listen_fd;
+    char            path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+    tftp_server_t **servers;
+    int             count;
+    volatile int    stop;
+    pthread_t       thread;
+} g_metrics = { .listen_fd = -1 };
+
+static const char* type_name(metric_type_t type)
+{
+    switch (type) {
+        case METRIC_COUNTER:   return "counter";
+        case METRIC_GAUGE:     return "gauge";
+        default:               return "histogram";
+    }
+}
+
+/* A field summed over every worker */
+static uint64_t metric_sum(size_t offset)
+{
+    uint64_t total = 0;
+    for (int i = 0; i < g_metrics.count; i++) {
+        const uint64_t *v = (const uint64_t *)((const char *)&g_metrics.servers[i]->metrics + offset);
+        total += __atomic_load_n(v, __ATOMIC_RELAXED);
+    }
+    return total;
+}
+
+static void render_histogram(FILE *out, const metric_desc_t *m)
+{
+    const char *sep = m->labels ? "," : "";
+    const char *labels = m->labels ? m->labels : "";
+    uint64_t cumulative = 0;
+
+    for (int b = 0; b < METRIC_BUCKETS; b++) {
+        cumulative += metric_sum(m->offset + offsetof(metric_hist_t, buckets[b]));
+        fprintf(out, "%s_bucket{%s%sle=\"%g\"} %llu\n", m->name, labels, sep,
+                m->bounds[b] * m->scale, (unsigned long long)cumulative);
+    }
+
+    uint64_t count = metric_sum(m->offset + offsetof(metric_hist_t, count));
+    uint64_t sum = metric_sum(m->offset + offsetof(metric_hist_t, sum));
+    fprintf(out, "%s_bucket{%s%sle=\"+Inf\"} %llu\n", m->name, labels, sep,
+            (unsigned long long)count);
+    if (m->labels) {
+        fprintf(out, "%s_sum{%s} %.3f\n", m->name, labels, sum * m->scale);
+        fprintf(out, "%s_count{%s} %llu\n", m->name, labels, (unsigned long long)count);
+    } else {
+        fprintf(out, "%s_sum %.3f\n", m->name, sum * m->scale);
+        fprintf(out, "%s_count %llu\n", m->name, (unsigned long long)count);
+    }
+}
+
+static void render(FILE *out)
+{
+    for (size_t i = 0; i < sizeof(registry) / sizeof(registry[0]); i++) {
+        const metric_desc_t *m = &registry[i];
+
+        if (m->help) {
+            fprintf(out, "# HELP %s %s\n", m->name, m->help);
+            fprintf(out, "# TYPE %s %s\n", m->name, type_name(m->type));
+        }
+
+        if (m->type == METRIC_HISTOGRAM) {
+            render_histogram(out, m);
+        } else if (m->labels) {
+            fprintf(out, "%s{%s} %llu\n", m->name, m->labels,
+                    (unsigned long long)metric_sum(m->offset));
+        } else {
+            fprintf(out, "%s %llu\n", m->name, (unsigned long long)metric_sum(m->offset));
+        }
+    }
+}
+
+static int write_all(int fd, const char *buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static void serve(int fd)
+{
+    struct timeval tv = { METRICS_IO_MS / 1000, (METRICS_IO_MS % 1000) * 1000 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    /* Whatever was asked for, the answer is the metrics page */
+    char req[1024];
+    if (recv(fd, req, sizeof(req), 0) <= 0)
+        return;
+
+    char *body = NULL;
+    size_t body_len = 0;
+    FILE *out = open_memstream(&body, &body_len);
+    if (!out)
+        return;
+    render(out);
+    fclose(out);
+
+    char head[160];
+    int head_len = snprintf(head, sizeof(head),
+                            "HTTP/1.0 200 OK\r\n"
+                            "Content-Type: text/plain; version=0.0.4\r\n"
+                            "Content-Length: %zu\r\n"
+                            "Connection: close\r\n\r\n", body_len);
+    if (write_all(fd, head, head_len) == 0)
+        write_all(fd, body, body_len);
+    free(body);
+}
+
+static void* exporter_main(void *arg)
+{
+    (void)arg;
+    struct pollfd pfd = { .fd = g_metrics.listen_fd, .events = POLLIN };
+
+    while (!g_metrics.stop) {
+        if (poll(&pfd, 1, METRICS_POLL_MS) <= 0)
+            continue;
+        int fd = accept4(g_metrics.listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0)
+            continue;
+        serve(fd);
+        close(fd);
+    }
+    return NULL;
+}
+
+/* "PORT" and "HOST:PORT" listen on TCP, loopback by default; "/path" on a Unix socket */
+static int open_listener(const char *addr)
+{
+    int fd;
+
+    if (addr[0] == '/') {
+        struct sockaddr_un sun = { .sun_family = AF_UNIX };
+        if (strlen(addr) >= sizeof(sun.sun_path)) {
+            log_msg(LOG_CRITICAL, "Metrics socket path too long: %s", addr);
+            return -1;
+        }
+        strcpy(sun.sun_path, addr);
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0)
+            return -1;
+        unlink(addr);
+        if (bind(fd, (struct sockaddr *)&sun, sizeof(sun)) < 0) {
+            close(fd);
+            return -1;
+        }
+        strcpy(g_metrics.path, addr);
+    } else {
+        char host[64] = "127.0.0.1";
+        const char *port = addr;
+        const char *colon = strrchr(addr, ':');
+        if (colon) {
+            snprintf(host, sizeof(host), "%.*s", (int)(colon - addr), addr);
+            port = colon + 1;
+        }
+
+        struct sockaddr_in sin = { .sin_family = AF_INET };
+        int p = atoi(port);
+        if (p <= 0 || p > 65535 || inet_pton(AF_INET, host, &sin.sin_addr) != 1) {
+            log_msg(LOG_CRITICAL, "Invalid metrics address: %s", addr);
+            return -1;
+        }
+        sin.sin_port = htons(p);
+
+        fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0)
+            return -1;
+        int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (bind(fd, (struct sockaddr *)&sin, sizeof(sin)) < 0) {
+            close(fd);
+            return -1;
+        }
+    }
+
+    if (listen(fd, 16) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int metrics_start(const char *addr, tftp_server_t **servers, int count)
+{
+    if (!addr || !addr[0])
+        return 0;
+
+    g_metrics.servers = servers;
+    g_metrics.count = count;
+    g_metrics.stop = 0;
+    g_metrics.path[0] = '\0';
+
+    g_metrics.listen_fd = open_listener(addr);
+    if (g_metrics.listen_fd < 0) {
+        log_msg(LOG_CRITICAL, "Cannot listen for metrics on %s: %s", addr, strerror(errno));
+        return -1;
+    }
+
+    int err = pthread_create(&g_metrics.thread, NULL, exporter_main, NULL);
+    if (err != 0) {
+        log_msg(LOG_CRITICAL, "Cannot start metrics exporter: %s", strerror(err));
+        close(g_metrics.listen_fd);
+        g_metrics.listen_fd = -1;
+        return -1;
+    }
+
+    log_msg(LOG_INFO, "Metrics on %s", addr);
+    return 0;
+}
+
+void metrics_stop(void)
+{
+    if (g_metrics.listen_fd < 0)
+        return;
+
+    g_metrics.stop = 1;
+    pthread_join(g_metrics.thread, NULL);
+    close(g_metrics.listen_fd);
+    g_metrics.listen_fd = -1;
+    if (g_metrics.path[0])
+        unlink(g_metrics.path);
+}
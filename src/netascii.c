@@ -0,0 +1,182 @@
+/*
+ * utftp - Netascii translation
+ *
+ * Text runs without CR or LF are copied as they are; the scan for the
+ * next CR/LF uses AVX2 or SSE2 when the build targets them, and a byte
+ * loop otherwise. Encoding expands, so a block of output consumes a
+ * varying amount of the file and blocks have to be produced in order;
+ * decoding shrinks and only ever looks for CR, which memchr() finds.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "../include/netascii.h"
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+/* Offset of the first CR or LF in p[0..n), or n */
+static size_t scan_eol(const uint8_t *p, size_t n)
+{
+    size_t i = 0;
+#if defined(__AVX2__)
+    const __m256i cr = _mm256_set1_epi8('\r'), lf = _mm256_set1_epi8('\n');
+    for (; i + 32 <= n; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+        unsigned m = (unsigned)_mm256_movemask_epi8(
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, cr), _mm256_cmpeq_epi8(v, lf)));
+        if (m)
+            return i + __builtin_ctz(m);
+    }
+#elif defined(__SSE2__)
+    const __m128i cr = _mm_set1_epi8('\r'), lf = _mm_set1_epi8('\n');
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+        unsigned m = (unsigned)_mm_movemask_epi8(
+            _mm_or_si128(_mm_cmpeq_epi8(v, cr), _mm_cmpeq_epi8(v, lf)));
+        if (m)
+            return i + __builtin_ctz(m);
+    }
+#endif
+    for (; i < n; i++) {
+        if (p[i] == '\r' || p[i] == '\n')
+            return i;
+    }
+    return n;
+}
+
+/* Number of CR and LF bytes in p[0..n) */
+static size_t count_eol(const uint8_t *p, size_t n)
+{
+    size_t i = 0, count = 0;
+#if defined(__AVX2__)
+    const __m256i cr = _mm256_set1_epi8('\r'), lf = _mm256_set1_epi8('\n');
+    for (; i + 32 <= n; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+        unsigned m = (unsigned)_mm256_movemask_epi8(
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, cr), _mm256_cmpeq_epi8(v, lf)));
+        count += __builtin_popcount(m);
+    }
+#elif defined(__SSE2__)
+    const __m128i cr = _mm_set1_epi8('\r'), lf = _mm_set1_epi8('\n');
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+        unsigned m = (unsigned)_mm_movemask_epi8(
+            _mm_or_si128(_mm_cmpeq_epi8(v, cr), _mm_cmpeq_epi8(v, lf)));
+        count += __builtin_popcount(m);
+    }
+#endif
+    for (; i < n; i++)
+        count += (p[i] == '\r' || p[i] == '\n');
+    return count;
+}
+
+size_t netascii_encode(netascii_t *st, const uint8_t *in, size_t in_len,
+                       size_t *consumed, uint8_t *out, size_t out_len)
+{
+    size_t i = 0, o = 0;
+
+    if (st->pending && out_len > 0) {
+        out[o++] = st->byte;
+        st->pending = 0;
+    }
+
+    while (o < out_len && i < in_len) {
+        size_t room = out_len - o;
+        size_t run = scan_eol(in + i, in_len - i < room ? in_len - i : room);
+        memcpy(out + o, in + i, run);
+        i += run;
+        o += run;
+        if (o == out_len || i == in_len)
+            break;
+
+        uint8_t second = (in[i++] == '\n') ? '\n' : '\0';
+        out[o++] = '\r';
+        if (o < out_len) {
+            out[o++] = second;
+        } else {
+            st->pending = 1;
+            st->byte = second;
+        }
+    }
+
+    *consumed = i;
+    return o;
+}
+
+size_t netascii_decode(netascii_t *st, const uint8_t *in, size_t in_len, uint8_t *out)
+{
+    size_t i = 0, o = 0;
+
+    /* CR that ended the previous block */
+    if (st->pending && in_len > 0) {
+        st->pending = 0;
+        if (in[0] == '\n') {
+            out[o++] = '\n';
+            i++;
+        } else if (in[0] == '\0') {
+            out[o++] = '\r';
+            i++;
+        } else {
+            out[o++] = '\r';
+        }
+    }
+
+    while (i < in_len) {
+        const uint8_t *cr = memchr(in + i, '\r', in_len - i);
+        size_t run = cr ? (size_t)(cr - (in + i)) : in_len - i;
+        memcpy(out + o, in + i, run);
+        i += run;
+        o += run;
+        if (!cr)
+            break;
+
+        if (++i == in_len) {
+            st->pending = 1;
+            break;
+        }
+        if (in[i] == '\n') {
+            out[o++] = '\n';
+            i++;
+        } else if (in[i] == '\0') {
+            out[o++] = '\r';
+            i++;
+        } else {
+            out[o++] = '\r';    /* Bare CR: kept, the next byte is ordinary */
+        }
+    }
+    return o;
+}
+
+size_t netascii_decode_end(netascii_t *st, uint8_t *out)
+{
+    if (!st->pending)
+        return 0;
+    st->pending = 0;
+    out[0] = '\r';
+    return 1;
+}
+
+int64_t netascii_size(int fd, uint64_t size)
+{
+    enum { CHUNK = 64 * 1024 };
+    uint8_t *buf = malloc(CHUNK);
+    if (!buf)
+        return -1;
+
+    uint64_t off = 0, extra = 0;
+    while (off < size) {
+        ssize_t n = pread(fd, buf, CHUNK, (off_t)off);
+        if (n <= 0)
+            break;
+        if ((uint64_t)n > size - off)
+            n = (ssize_t)(size - off);
+        extra += count_eol(buf, (size_t)n);
+        off += (uint64_t)n;
+    }
+    free(buf);
+
+    return off < size ? -1 : (int64_t)(size + extra);
+}
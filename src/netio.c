@@ -0,0 +1,350 @@
+/*
+ * utftp - Batched datagram I/O
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <netinet/udp.h>
+#include "../include/netio.h"
+#include "../include/log.h"
+#include "../include/trace.h"
+
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+
+/* Kernel limits for one UDP_SEGMENT send */
+#define GSO_MAX_SEGS    64
+#define GSO_MAX_BYTES   (65507)
+
+recv_batch_t* netio_recv_batch_new(void)
+{
+    recv_batch_t *rb = calloc(1, sizeof(*rb));
+    if (rb)
+        rb->bufs = malloc((size_t)RECV_BATCH * RECV_BUF_SIZE);
+
+    if (!rb || !rb->bufs) {
+        log_msg(LOG_CRITICAL, "Out of memory allocating receive batch");
+        free(rb);
+        return NULL;
+    }
+    return rb;
+}
+
+void netio_recv_batch_free(recv_batch_t *rb)
+{
+    if (!rb)
+        return;
+    free(rb->bufs);
+    free(rb);
+}
+
+int netio_recv(int sock, recv_batch_t *rb, int max)
+{
+    if (max > RECV_BATCH)
+        max = RECV_BATCH;
+
+    for (int i = 0; i < max; i++) {
+        rb->iov[i].iov_base = netio_buf(rb, i);
+        rb->iov[i].iov_len = RECV_BUF_SIZE;
+
+        struct msghdr *mh = &rb->msgs[i].msg_hdr;
+        mh->msg_name = &rb->addrs[i];
+        mh->msg_namelen = sizeof(rb->addrs[i]);
+        mh->msg_iov = &rb->iov[i];
+        mh->msg_iovlen = 1;
+        mh->msg_control = rb->ctrl[i];
+        mh->msg_controllen = sizeof(rb->ctrl[i]);
+        mh->msg_flags = 0;
+    }
+
+    int n = recvmmsg(sock, rb->msgs, max, MSG_DONTWAIT, NULL);
+    if (n < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            log_msg(LOG_DEBUG, "recvmmsg failed: %s", strerror(errno));
+        return 0;
+    }
+    return n;
+}
+
+size_t netio_segment_size(recv_batch_t *rb, int i)
+{
+    struct msghdr *mh = &rb->msgs[i].msg_hdr;
+
+    for (struct cmsghdr *cm = CMSG_FIRSTHDR(mh); cm; cm = CMSG_NXTHDR(mh, cm)) {
+        if (cm->cmsg_level == SOL_UDP && cm->cmsg_type == UDP_GRO) {
+            int seg;
+            memcpy(&seg, CMSG_DATA(cm), sizeof(seg));
+            if (seg > 0)
+                return (size_t)seg;
+        }
+    }
+    return rb->msgs[i].msg_len;
+}
+
+int netio_enable_gro(int sock)
+{
+    int one = 1;
+    if (setsockopt(sock, SOL_UDP, UDP_GRO, &one, sizeof(one)) < 0) {
+        log_msg(LOG_DEBUG, "UDP_GRO unavailable: %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+send_queue_t* netio_send_queue_new(int gso)
+{
+    send_queue_t *sq = calloc(1, sizeof(*sq));
+    if (!sq) {
+        log_msg(LOG_CRITICAL, "Out of memory allocating send queue");
+        return NULL;
+    }
+    sq->gso = gso;
+    sq->gso_fail = SIZE_MAX;
+    return sq;
+}
+
+void netio_send_queue_free(send_queue_t *sq)
+{
+    free(sq);
+}
+
+/* Entry k has been sent or dropped: its owner no longer has it queued */
+static void entry_done(send_queue_t *sq, int k)
+{
+    int *ref = sq->entries[k].slot_ref;
+    if (ref && *ref == k)
+        *ref = -1;
+}
+
+int netio_queue(send_queue_t *sq, int sock, const struct sockaddr_in *addr,
+                const struct iovec *iov, int iovcnt, int *slot_ref)
+{
+    int slot;
+
+    if (slot_ref && *slot_ref >= 0) {
+        slot = *slot_ref;
+    } else {
+        if (sq->count == SEND_BATCH)
+            netio_flush(sq);
+        if (sq->count == SEND_BATCH) {
+            /* Nothing went out: the oldest datagrams are given up rather than this one */
+            for (int k = 0; k < sq->count; k++)
+                entry_done(sq, k);
+            sq->dropped += sq->count;
+            sq->count = 0;
+        }
+        slot = sq->count++;
+    }
+
+    send_entry_t *e = &sq->entries[slot];
+    e->sock = sock;
+    e->addr = *addr;
+    e->iovcnt = iovcnt;
+    e->len = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        e->iov[i] = iov[i];
+        e->len += iov[i].iov_len;
+    }
+    e->slot_ref = slot_ref;
+    if (slot_ref)
+        *slot_ref = slot;
+
+    return 0;
+}
+
+static int same_dest(const send_entry_t *a, const send_entry_t *b)
+{
+    return a->sock == b->sock &&
+           a->addr.sin_addr.s_addr == b->addr.sin_addr.s_addr &&
+           a->addr.sin_port == b->addr.sin_port;
+}
+
+/* Entries from first that can go out as one GSO super-packet */
+static int gso_span(send_queue_t *sq, int first, int end)
+{
+    send_entry_t *e = &sq->entries[first];
+    size_t seg = e->len;
+    size_t total = seg;
+    int n = 1;
+
+    if (!sq->gso || seg >= sq->gso_fail)
+        return 1;
+
+    /* Every segment but the last must be exactly seg bytes */
+    while (first + n < end && n < GSO_MAX_SEGS) {
+        send_entry_t *next = &sq->entries[first + n];
+        if (!same_dest(e, next) || next->len > seg || total + next->len > GSO_MAX_BYTES)
+            break;
+        total += next->len;
+        n++;
+        if (next->len < seg)
+            break;
+    }
+    return n;
+}
+
+/* The socket buffer or the device queue is full for now */
+static int send_blocked(int err)
+{
+    return err == EAGAIN || err == EWOULDBLOCK || err == ENOBUFS;
+}
+
+/* 0 when sent, 1 when the socket is full, -1 to send the span plainly */
+static int send_gso(send_queue_t *sq, int first, int n)
+{
+    send_entry_t *e = &sq->entries[first];
+    struct iovec iov[GSO_MAX_SEGS * SEND_IOV_MAX];
+    int iovcnt = 0;
+
+    for (int i = 0; i < n; i++) {
+        send_entry_t *seg = &sq->entries[first + i];
+        for (int j = 0; j < seg->iovcnt; j++)
+            iov[iovcnt++] = seg->iov[j];
+    }
+
+    union {
+        char buf[CMSG_SPACE(sizeof(uint16_t))];
+        struct cmsghdr align;
+    } ctrl;
+    memset(&ctrl, 0, sizeof(ctrl));
+
+    struct msghdr mh;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_name = &e->addr;
+    mh.msg_namelen = sizeof(e->addr);
+    mh.msg_iov = iov;
+    mh.msg_iovlen = iovcnt;
+    mh.msg_control = ctrl.buf;
+    mh.msg_controllen = sizeof(ctrl.buf);
+
+    struct cmsghdr *cm = CMSG_FIRSTHDR(&mh);
+    cm->cmsg_level = SOL_UDP;
+    cm->cmsg_type = UDP_SEGMENT;
+    cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+    uint16_t seg_size = (uint16_t)e->len;
+    memcpy(CMSG_DATA(cm), &seg_size, sizeof(seg_size));
+
+    if (sendmsg(e->sock, &mh, 0) >= 0)
+        return 0;
+
+    if (send_blocked(errno))
+        return 1;
+    if (errno == EINVAL || errno == EMSGSIZE) {
+        /* Segment too large for the path MTU: stop trying this size */
+        if (e->len < sq->gso_fail)
+            sq->gso_fail = e->len;
+    } else if (errno == ENOPROTOOPT || errno == EOPNOTSUPP || errno == EIO) {
+        log_msg(LOG_DEBUG, "UDP_SEGMENT unavailable: %s", strerror(errno));
+        sq->gso = 0;
+    }
+    return -1;
+}
+
+/* Returns how many entries were sent or dropped before the socket filled up */
+static int send_batch(send_queue_t *sq, int first, int n)
+{
+    for (int i = 0; i < n; i++) {
+        send_entry_t *e = &sq->entries[first + i];
+        struct msghdr *mh = &sq->msgs[i].msg_hdr;
+        memset(mh, 0, sizeof(*mh));
+        mh->msg_name = &e->addr;
+        mh->msg_namelen = sizeof(e->addr);
+        mh->msg_iov = e->iov;
+        mh->msg_iovlen = e->iovcnt;
+    }
+
+    int done = 0;
+    while (done < n) {
+        int r = sendmmsg(sq->entries[first].sock, sq->msgs + done, n - done, 0);
+        if (r > 0) {
+            done += r;
+            continue;
+        }
+        if (errno == EINTR)
+            continue;
+        if (send_blocked(errno))
+            break;
+
+        /* Refused outright: lost like any datagram, the retransmit timer recovers it */
+        log_msg(LOG_DEBUG, "sendmmsg failed: %s", strerror(errno));
+        sq->dropped++;
+        done++;
+    }
+    return done;
+}
+
+void netio_flush(send_queue_t *sq)
+{
+    uint64_t since = sq->flushed ? trace_ns() : 0;
+    int kept = 0;
+    int i = 0;
+
+    while (i < sq->count) {
+        /* Run of entries on the same socket */
+        int end = i + 1;
+        while (end < sq->count && sq->entries[end].sock == sq->entries[i].sock)
+            end++;
+
+        while (i < end) {
+            int n = gso_span(sq, i, end);
+            int r = n >= 2 ? send_gso(sq, i, n) : -1;
+            if (r == 0) {
+                i += n;
+                continue;
+            }
+            if (r > 0)
+                break;
+
+            /* Plain datagrams up to the next GSO-able span */
+            int m = i + 1;
+            while (m < end && gso_span(sq, m, end) < 2)
+                m++;
+            if (n >= 2)
+                m = i + n;      /* GSO attempt failed, send that span plainly */
+            i += send_batch(sq, i, m - i);
+            if (i < m)
+                break;
+        }
+
+        /* The socket is full: the rest of its run waits for the next flush */
+        for (; i < end; i++) {
+            if (kept != i) {
+                entry_done(sq, kept);
+                sq->entries[kept] = sq->entries[i];
+            }
+            if (sq->entries[kept].slot_ref)
+                *sq->entries[kept].slot_ref = kept;
+            kept++;
+        }
+    }
+
+    for (int k = kept; k < sq->count; k++)
+        entry_done(sq, k);
+    sq->count = kept;
+
+    if (sq->flushed)
+        sq->flushed(sq->flushed_ctx, since);
+}
+
+void netio_cancel(send_queue_t *sq, int *slot_ref)
+{
+    int slot = *slot_ref;
+    if (slot < 0)
+        return;
+
+    *slot_ref = -1;
+    sq->count--;
+    for (int k = slot; k < sq->count; k++) {
+        sq->entries[k] = sq->entries[k + 1];
+        if (sq->entries[k].slot_ref)
+            *sq->entries[k].slot_ref = k;
+    }
+}
@@ -8,8 +8,69 @@
 #include <stdlib.h>
 #include "../include/packet.h"
 
+/* Options after the request's mode, or in an OACK */
+static void parse_options(uint8_t *p, uint8_t *end, tftp_options_t *opts)
+{
+    /* Default values */
+    memset(opts, 0, sizeof(*opts));
+    opts->blksize = TFTP_DEF_BLKSIZE;
+    opts->windowsize = 1;
+
+    while (p < end) {
+        char *opt_name = (char *)p;
+        while (p < end && *p != '\0') p++;
+        if (p >= end) break;
+        p++;
+
+        char *opt_val = (char *)p;
+        while (p < end && *p != '\0') p++;
+        if (p >= end) break;
+        p++;
+
+        if (strcasecmp(opt_name, "blksize") == 0) {
+            size_t bs = strtoul(opt_val, NULL, 10);
+            if (bs >= TFTP_MIN_BLKSIZE && bs <= TFTP_MAX_BLKSIZE) {
+                opts->blksize = bs;
+            }
+        } else if (strcasecmp(opt_name, "tsize") == 0) {
+            opts->tsize = strtoull(opt_val, NULL, 10);
+            opts->has_tsize = 1;
+        } else if (strcasecmp(opt_name, "windowsize") == 0) {
+            /* RFC 7440: 1-65535, we answer with at most our own limit */
+            unsigned long ws = strtoul(opt_val, NULL, 10);
+            if (ws >= 1 && ws <= 65535) {
+                opts->windowsize = ws < TFTP_MAX_WINDOWSIZE ? (unsigned)ws : TFTP_MAX_WINDOWSIZE;
+                opts->has_windowsize = 1;
+            }
+        } else if (strcasecmp(opt_name, "timeout") == 0) {
+            /* RFC 2349: 1-255 seconds, anything else is left unacknowledged */
+            unsigned long t = strtoul(opt_val, NULL, 10);
+            if (t >= 1 && t <= 255) {
+                opts->timeout = (unsigned)t;
+                opts->has_timeout = 1;
+            }
+        } else if (strcasecmp(opt_name, "utimeout") == 0) {
+            /* tftp-hpa extension: 10 ms to 255 s, in microseconds */
+            unsigned long ut = strtoul(opt_val, NULL, 10);
+            if (ut >= 10000 && ut <= 255000000) {
+                opts->utimeout = ut;
+                opts->has_utimeout = 1;
+            }
+        } else if (strcasecmp(opt_name, "rollover") == 0) {
+            /* Block numbering past 65535: wraps to 0 or to 1 */
+            if (strcmp(opt_val, "0") == 0 || strcmp(opt_val, "1") == 0) {
+                opts->rollover = opt_val[0] - '0';
+                opts->has_rollover = 1;
+            }
+        } else if (strcasecmp(opt_name, "multicast") == 0) {
+            /* RFC 2090: the client sends it empty, the server fills it in */
+            opts->has_multicast = 1;
+        }
+    }
+}
+
 int packet_parse_request(uint8_t *buf, size_t len, char *filename, size_t fn_len,
-                         char *mode, size_t mode_len, size_t *blksize, size_t *tsize)
+                         char *mode, size_t mode_len, tftp_options_t *opts)
 {
     if (len < 4)
         return -1;
@@ -40,32 +101,15 @@ int packet_parse_request(uint8_t *buf, size_t len, char *filename, size_t fn_len
     mode[mode_size] = '\0';
     p++;
 
-    /* Default values */
-    *blksize = TFTP_DEF_BLKSIZE;
-    *tsize = 0;
-
-    /* Parse options */
-    while (p < end) {
-        char *opt_name = (char *)p;
-        while (p < end && *p != '\0') p++;
-        if (p >= end) break;
-        p++;
-
-        char *opt_val = (char *)p;
-        while (p < end && *p != '\0') p++;
-        if (p >= end) break;
-        p++;
-
-        if (strcasecmp(opt_name, "blksize") == 0) {
-            size_t bs = strtoul(opt_val, NULL, 10);
-            if (bs >= TFTP_MIN_BLKSIZE && bs <= TFTP_MAX_BLKSIZE) {
-                *blksize = bs;
-            }
-        } else if (strcasecmp(opt_name, "tsize") == 0) {
-            *tsize = strtoul(opt_val, NULL, 10);
-        }
-    }
+    parse_options(p, end, opts);
+    return 0;
+}
 
+int packet_parse_oack(uint8_t *buf, size_t len, tftp_options_t *opts)
+{
+    if (len < 2)
+        return -1;
+    parse_options(buf + 2, buf + len, opts);
     return 0;
 }
 
@@ -75,7 +119,7 @@ int packet_build_data(uint8_t *buf, uint16_t block, uint8_t *data, size_t data_l
     buf[1] = TFTP_DATA;
     buf[2] = (block >> 8) & 0xFF;
     buf[3] = block & 0xFF;
-    if (data_len > 0)
+    if (data_len > 0 && data != buf + 4)
         memcpy(buf + 4, data, data_len);
     return 4 + data_len;
 }
@@ -102,21 +146,61 @@ int packet_build_error(uint8_t *buf, tftp_error_t code, const char *msg)
     return 5 + msg_len;
 }
 
-int packet_build_oack(uint8_t *buf, size_t blksize, size_t tsize, int has_tsize)
+/* Options as requested or acknowledged, from offset on */
+static int put_options(uint8_t *buf, int offset, const tftp_options_t *opts)
 {
-    buf[0] = 0;
-    buf[1] = TFTP_OACK;
-    int offset = 2;
-
-    if (blksize != TFTP_DEF_BLKSIZE) {
+    if (opts->blksize != TFTP_DEF_BLKSIZE) {
         offset += sprintf((char *)buf + offset, "blksize") + 1;
-        offset += sprintf((char *)buf + offset, "%zu", blksize) + 1;
+        offset += sprintf((char *)buf + offset, "%zu", opts->blksize) + 1;
     }
 
-    if (has_tsize) {
+    if (opts->has_tsize) {
         offset += sprintf((char *)buf + offset, "tsize") + 1;
-        offset += sprintf((char *)buf + offset, "%zu", tsize) + 1;
+        offset += sprintf((char *)buf + offset, "%llu", (unsigned long long)opts->tsize) + 1;
+    }
+
+    if (opts->has_windowsize) {
+        offset += sprintf((char *)buf + offset, "windowsize") + 1;
+        offset += sprintf((char *)buf + offset, "%u", opts->windowsize) + 1;
+    }
+
+    if (opts->has_timeout) {
+        offset += sprintf((char *)buf + offset, "timeout") + 1;
+        offset += sprintf((char *)buf + offset, "%u", opts->timeout) + 1;
+    }
+
+    if (opts->has_utimeout) {
+        offset += sprintf((char *)buf + offset, "utimeout") + 1;
+        offset += sprintf((char *)buf + offset, "%lu", opts->utimeout) + 1;
+    }
+
+    if (opts->has_rollover) {
+        offset += sprintf((char *)buf + offset, "rollover") + 1;
+        offset += sprintf((char *)buf + offset, "%d", opts->rollover) + 1;
+    }
+
+    if (opts->has_multicast) {
+        offset += sprintf((char *)buf + offset, "multicast") + 1;
+        offset += sprintf((char *)buf + offset, "%s", opts->multicast) + 1;
     }
 
     return offset;
 }
+
+int packet_build_oack(uint8_t *buf, const tftp_options_t *opts)
+{
+    buf[0] = 0;
+    buf[1] = TFTP_OACK;
+    return put_options(buf, 2, opts);
+}
+
+int packet_build_request(uint8_t *buf, uint16_t opcode, const char *filename,
+                         const char *mode, const tftp_options_t *opts)
+{
+    buf[0] = 0;
+    buf[1] = opcode;
+    int offset = 2;
+    offset += sprintf((char *)buf + offset, "%s", filename) + 1;
+    offset += sprintf((char *)buf + offset, "%s", mode) + 1;
+    return put_options(buf, offset, opts);
+}
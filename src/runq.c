@@ -0,0 +1,122 @@
+/*
+ * utftp - Fair scheduling of session work
+ *
+ * Sessions whose sockets have packets waiting sit on a FIFO run queue.
+ * Each loop pass serves every queued session once, deficit round-robin:
+ * it is credited RUNQ_QUANTUM packets times its weight, handles packets
+ * until the credit is spent, and goes to the back of the queue if its
+ * socket may still hold more. A GRO-coalesced datagram costs one credit
+ * per segment, so the overdraft is carried into the next pass.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fnmatch.h>
+#include <arpa/inet.h>
+#include "../include/runq.h"
+
+void runq_ready(tftp_session_t *sess)
+{
+    tftp_server_t *srv = sess->srv;
+
+    if (sess->run_queued)
+        return;
+    sess->run_queued = 1;
+    sess->run_next = NULL;
+    sess->run_prev = srv->run_tail;
+    if (srv->run_tail)
+        srv->run_tail->run_next = sess;
+    else
+        srv->run_head = sess;
+    srv->run_tail = sess;
+    srv->run_count++;
+}
+
+void runq_remove(tftp_session_t *sess)
+{
+    tftp_server_t *srv = sess->srv;
+
+    if (!sess->run_queued)
+        return;
+    if (sess->run_prev)
+        sess->run_prev->run_next = sess->run_next;
+    else
+        srv->run_head = sess->run_next;
+    if (sess->run_next)
+        sess->run_next->run_prev = sess->run_prev;
+    else
+        srv->run_tail = sess->run_prev;
+    sess->run_next = NULL;
+    sess->run_prev = NULL;
+    sess->run_queued = 0;
+    srv->run_count--;
+}
+
+tftp_session_t* runq_next(tftp_server_t *srv)
+{
+    tftp_session_t *sess = srv->run_head;
+    if (sess)
+        runq_remove(sess);
+    return sess;
+}
+
+int runq_busy(const tftp_server_t *srv)
+{
+    return srv->run_head || srv->main_pending || srv->shared_pending || srv->group_pending;
+}
+
+void runq_classify(tftp_session_t *sess, const char *filename)
+{
+    const tftp_config_t *config = &sess->srv->config;
+    uint32_t addr = ntohl(sess->client_addr.sin_addr.s_addr);
+
+    /* First matching rule wins */
+    sess->weight = 1;
+    for (int i = 0; i < config->class_count; i++) {
+        const runq_class_t *cls = &config->classes[i];
+        int match = cls->pattern[0] ? fnmatch(cls->pattern, filename, 0) == 0
+                                    : (addr & cls->mask) == cls->net;
+        if (match) {
+            sess->weight = cls->weight;
+            return;
+        }
+    }
+}
+
+int runq_parse_class(const char *str, runq_class_t *cls)
+{
+    char buf[128];
+    snprintf(buf, sizeof(buf), "%s", str);
+
+    char *eq = strrchr(buf, '=');
+    if (!eq || eq == buf)
+        return -1;
+    *eq = '\0';
+
+    memset(cls, 0, sizeof(*cls));
+    cls->weight = atoi(eq + 1);
+    if (cls->weight < 1 || cls->weight > MAX_RUNQ_WEIGHT)
+        return -1;
+
+    /* An address, with or without a prefix length, is a subnet; anything else a pattern */
+    char *slash = strchr(buf, '/');
+    if (slash)
+        *slash = '\0';
+    struct in_addr net;
+    if (inet_pton(AF_INET, buf, &net) == 1) {
+        int bits = slash ? atoi(slash + 1) : 32;
+        if (bits < 0 || bits > 32)
+            return -1;
+        cls->mask = bits ? 0xFFFFFFFFu << (32 - bits) : 0;
+        cls->net = ntohl(net.s_addr) & cls->mask;
+        return 0;
+    }
+    if (slash)
+        *slash = '/';
+
+    if (strlen(buf) >= sizeof(cls->pattern))
+        return -1;
+    strcpy(cls->pattern, buf);
+    return 0;
+}
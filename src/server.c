@@ -2,19 +2,42 @@
  * utftp - Server core
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/socket.h>
-#include <sys/select.h>
 #include <arpa/inet.h>
 #include "../include/server.h"
 #include "../include/session.h"
+#include "../include/event.h"
+#include "../include/netio.h"
+#include "../include/fileio.h"
+#include "../include/cache.h"
+#include "../include/fcache.h"
+#include "../include/mcast.h"
+#include "../include/runq.h"
+#include "../include/trace.h"
 #include "../include/transfer.h"
 #include "../include/packet.h"
 #include "../include/log.h"
+#include "../include/util.h"
+
+/* The session's own request again: same opcode and filename */
+static int request_repeats(const tftp_session_t *sess, uint16_t opcode,
+                           const uint8_t *buf, size_t len)
+{
+    if (opcode != (sess->state == STATE_RECEIVING ? TFTP_WRQ : TFTP_RRQ))
+        return 0;
+
+    const char *name = (const char *)buf + 2;
+    if (strnlen(name, len - 2) == len - 2)
+        return 0;
+    return strncmp(name, sess->filename, sizeof(sess->filename) - 1) == 0;
+}
 
 static int handle_new_request(tftp_server_t *srv, uint8_t *buf, size_t len,
                               struct sockaddr_in *client_addr)
@@ -22,10 +45,29 @@ static int handle_new_request(tftp_server_t *srv, uint8_t *buf, size_t len,
     if (len < 2)
         return -1;
 
+    uint64_t arrived = srv->config.trace_latency ? trace_ns() : 0;
     uint16_t opcode = (buf[0] << 8) | buf[1];
+    TRACE_PROBE(request, opcode, client_addr->sin_addr.s_addr, ntohs(client_addr->sin_port), len);
+
+    /*
+     * A retransmitted request for the transfer already under way is
+     * ignored; anything else means the client gave up on that one.
+     */
+    tftp_session_t *old = session_find_by_addr(srv, client_addr);
+    if (old) {
+        if (request_repeats(old, opcode, buf, len)) {
+            log_msg(LOG_DEBUG, "Duplicate request from %s:%d ignored",
+                    inet_ntoa(client_addr->sin_addr), ntohs(client_addr->sin_port));
+            return 0;
+        }
+        log_msg(LOG_DEBUG, "New request from %s:%d ends its transfer of %s",
+                inet_ntoa(client_addr->sin_addr), ntohs(client_addr->sin_port), old->filename);
+        session_free(old);
+    }
 
     tftp_session_t *sess = session_alloc(srv);
     if (!sess) {
+        metric_add(&srv->metrics.busy_rejections, 1);
         log_msg(LOG_ERROR, "No free sessions available");
         uint8_t errbuf[64];
         int errlen = packet_build_error(errbuf, TFTP_ERR_UNDEFINED, "Server busy");
@@ -34,14 +76,13 @@ static int handle_new_request(tftp_server_t *srv, uint8_t *buf, size_t len,
         return -1;
     }
 
-    sess->sock = session_create_socket(srv);
-    if (sess->sock < 0) {
+    if (session_create_socket(srv, sess) < 0) {
         session_free(sess);
         return -1;
     }
+    trace_begin(sess, arrived);
 
-    memcpy(&sess->client_addr, client_addr, sizeof(sess->client_addr));
-    gettimeofday(&sess->last_activity, NULL);
+    session_set_client(sess, client_addr);
 
     int result;
     if (opcode == TFTP_RRQ) {
@@ -59,19 +100,22 @@ static int handle_new_request(tftp_server_t *srv, uint8_t *buf, size_t len,
         return -1;
     }
 
+    metric_add(opcode == TFTP_RRQ ? &srv->metrics.requests_rrq : &srv->metrics.requests_wrq, 1);
+    trace_request_done(sess);
     return 0;
 }
 
-int tftp_server_init(tftp_server_t *srv, tftp_config_t *config)
+int tftp_server_init(tftp_server_t *srv, tftp_config_t *config, int worker_id)
 {
     memset(srv, 0, sizeof(*srv));
+    srv->worker_id = worker_id;
     memcpy(&srv->config, config, sizeof(srv->config));
+    mcast_init(srv);
 
-    for (int i = 0; i < MAX_SESSIONS; i++) {
-        srv->sessions[i].state = STATE_FREE;
-        srv->sessions[i].fd = -1;
-        srv->sessions[i].sock = -1;
-    }
+    srv->epoll_fd = -1;
+    srv->root_fd = -1;
+    srv->now = timer_now_ms();
+    timer_wheel_init(&srv->timers, srv->now);
 
     srv->main_sock = socket(AF_INET, SOCK_DGRAM, 0);
     if (srv->main_sock < 0) {
@@ -82,6 +126,14 @@ int tftp_server_init(tftp_server_t *srv, tftp_config_t *config)
     int opt = 1;
     setsockopt(srv->main_sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
 
+    /* Workers share the port through a reuseport group */
+    if (config->workers > 1 &&
+        setsockopt(srv->main_sock, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
+        log_msg(LOG_CRITICAL, "SO_REUSEPORT not supported: %s", strerror(errno));
+        close(srv->main_sock);
+        return -1;
+    }
+
     struct sockaddr_in addr;
     memset(&addr, 0, sizeof(addr));
     addr.sin_family = AF_INET;
@@ -104,8 +156,34 @@ int tftp_server_init(tftp_server_t *srv, tftp_config_t *config)
     int flags = fcntl(srv->main_sock, F_GETFL, 0);
     fcntl(srv->main_sock, F_SETFL, flags | O_NONBLOCK);
 
+    srv->rx = netio_recv_batch_new();
+    srv->tx = netio_send_queue_new(!config->no_gso);
+    if (srv->tx && config->trace_latency) {
+        srv->tx->flushed = trace_flushed;
+        srv->tx->flushed_ctx = srv;
+    }
+
+    if (!srv->rx || !srv->tx || event_init(srv) < 0 ||
+        event_add(srv, srv->main_sock, NULL) < 0 || fileio_init(srv) < 0 ||
+        cache_init(srv) < 0 || fcache_init(srv) < 0 || session_table_init(srv) < 0 ||
+        (srv->root_fd = root_open_dir(config->root_dir)) < 0) {
+        session_table_cleanup(srv);
+        fileio_cleanup(srv);
+        cache_cleanup(srv);
+        fcache_cleanup(srv);
+        netio_recv_batch_free(srv->rx);
+        netio_send_queue_free(srv->tx);
+        event_cleanup(srv);
+        close(srv->main_sock);
+        return -1;
+    }
+
     srv->running = 1;
 
+    /* Only the first worker announces itself */
+    if (worker_id != 0)
+        return 0;
+
     print_banner();
 
     if (g_use_color) {
@@ -115,109 +193,227 @@ int tftp_server_init(tftp_server_t *srv, tftp_config_t *config)
                 config->port, C_RESET);
         log_msg(LOG_INFO, "Serving from %s%s%s",
                 C_BOLD, config->root_dir, C_RESET);
-        log_msg(LOG_INFO, "Ready for connections (max %d concurrent)", MAX_SESSIONS);
     } else {
         log_msg(LOG_INFO, "Listening on %s:%d",
                 config->bind_addr[0] ? config->bind_addr : "0.0.0.0",
                 config->port);
         log_msg(LOG_INFO, "Serving from %s", config->root_dir);
-        log_msg(LOG_INFO, "Ready for connections (max %d concurrent)", MAX_SESSIONS);
+    }
+
+    if (config->workers > 1) {
+        log_msg(LOG_INFO, "Ready for connections (%d workers, max %d concurrent each)",
+                config->workers, config->max_sessions);
+    } else {
+        log_msg(LOG_INFO, "Ready for connections (max %d concurrent)", config->max_sessions);
     }
 
     return 0;
 }
 
-int tftp_server_run(tftp_server_t *srv)
+/*
+ * Edge-triggered sockets are read until they would block, or until their
+ * share of the loop pass is used up. Each returns non-zero when it stopped
+ * on its share, so the caller keeps it pending for the next pass.
+ */
+static int drain_main_socket(tftp_server_t *srv, int budget)
 {
-    uint8_t buf[TFTP_MAX_PACKET];
-    struct timeval timeout;
-
-    while (srv->running) {
-        fd_set readfds;
-        FD_ZERO(&readfds);
-
-        int maxfd = srv->main_sock;
-        FD_SET(srv->main_sock, &readfds);
-
-        for (int i = 0; i < MAX_SESSIONS; i++) {
-            if (srv->sessions[i].state != STATE_FREE && srv->sessions[i].sock >= 0) {
-                FD_SET(srv->sessions[i].sock, &readfds);
-                if (srv->sessions[i].sock > maxfd)
-                    maxfd = srv->sessions[i].sock;
+    recv_batch_t *rb = srv->rx;
+    int n;
+
+    do {
+        n = netio_recv(srv->main_sock, rb, budget);
+        for (int i = 0; i < n; i++) {
+            if (rb->msgs[i].msg_len > 0) {
+                handle_new_request(srv, netio_buf(rb, i), rb->msgs[i].msg_len, &rb->addrs[i]);
             }
         }
+        budget -= n;
+    } while (n == RECV_BATCH && budget > 0);
 
-        timeout.tv_sec = 1;
-        timeout.tv_usec = 0;
+    return budget <= 0;
+}
 
-        int ready = select(maxfd + 1, &readfds, NULL, NULL, &timeout);
+/* Spends the session's deficit; -1 when the session ended */
+static int drain_session_socket(tftp_session_t *sess)
+{
+    recv_batch_t *rb = sess->srv->rx;
+    int n, max;
+
+    do {
+        /* Still paying off a coalesced burst from an earlier pass */
+        if (sess->deficit <= 0)
+            return 1;
+        max = sess->deficit < RECV_BATCH ? sess->deficit : RECV_BATCH;
+        n = netio_recv(sess->sock, rb, max);
+        for (int i = 0; i < n; i++) {
+            struct sockaddr_in *from_addr = &rb->addrs[i];
+            uint8_t *buf = netio_buf(rb, i);
+            size_t len = rb->msgs[i].msg_len;
+
+            if (len == 0)
+                continue;
 
-        if (ready < 0) {
-            if (errno == EINTR)
+            if (from_addr->sin_addr.s_addr != sess->client_addr.sin_addr.s_addr ||
+                from_addr->sin_port != sess->client_addr.sin_port) {
+                uint8_t errbuf[64];
+                int errlen = packet_build_error(errbuf, TFTP_ERR_UNKNOWN_TID, "Unknown TID");
+                sendto(sess->sock, errbuf, errlen, 0,
+                       (struct sockaddr *)from_addr, sizeof(*from_addr));
                 continue;
-            log_msg(LOG_ERROR, "select failed: %s", strerror(errno));
-            break;
+            }
+
+            /* A GRO-coalesced datagram carries several equal-size packets */
+            size_t seg = netio_segment_size(rb, i);
+            for (size_t off = 0; off < len; off += seg) {
+                size_t pkt_len = (len - off < seg) ? len - off : seg;
+                int result = process_session_packet(sess, buf + off, pkt_len);
+                if (result != 0) {
+                    session_free(sess);
+                    return -1;
+                }
+                sess->deficit--;
+            }
         }
+    } while (n == max);
 
-        if (FD_ISSET(srv->main_sock, &readfds)) {
-            struct sockaddr_in client_addr;
-            socklen_t addrlen = sizeof(client_addr);
+    return 0;
+}
 
-            ssize_t n = recvfrom(srv->main_sock, buf, sizeof(buf), 0,
-                                 (struct sockaddr *)&client_addr, &addrlen);
+/* Shared socket: route each datagram to its session by client address */
+static int drain_shared_socket(tftp_server_t *srv, int sock, int budget)
+{
+    recv_batch_t *rb = srv->rx;
+    int n;
 
-            if (n > 0) {
-                handle_new_request(srv, buf, n, &client_addr);
-            }
-        }
+    do {
+        n = netio_recv(sock, rb, budget);
+        for (int i = 0; i < n; i++) {
+            struct sockaddr_in *from_addr = &rb->addrs[i];
+            uint8_t *buf = netio_buf(rb, i);
+            size_t len = rb->msgs[i].msg_len;
 
-        struct timeval now;
-        gettimeofday(&now, NULL);
+            if (len == 0)
+                continue;
 
-        for (int i = 0; i < MAX_SESSIONS; i++) {
-            tftp_session_t *sess = &srv->sessions[i];
-            if (sess->state == STATE_FREE)
+            tftp_session_t *sess = session_find_by_addr(srv, from_addr);
+            if (!sess || sess->sock != sock) {
+                uint8_t errbuf[64];
+                int errlen = packet_build_error(errbuf, TFTP_ERR_UNKNOWN_TID, "Unknown TID");
+                sendto(sock, errbuf, errlen, 0,
+                       (struct sockaddr *)from_addr, sizeof(*from_addr));
                 continue;
+            }
 
-            if (sess->sock >= 0 && FD_ISSET(sess->sock, &readfds)) {
-                struct sockaddr_in from_addr;
-                socklen_t addrlen = sizeof(from_addr);
-
-                ssize_t n = recvfrom(sess->sock, buf, sizeof(buf), 0,
-                                     (struct sockaddr *)&from_addr, &addrlen);
-
-                if (n > 0) {
-                    if (from_addr.sin_addr.s_addr != sess->client_addr.sin_addr.s_addr ||
-                        from_addr.sin_port != sess->client_addr.sin_port) {
-                        uint8_t errbuf[64];
-                        int errlen = packet_build_error(errbuf, TFTP_ERR_UNKNOWN_TID, "Unknown TID");
-                        sendto(sess->sock, errbuf, errlen, 0,
-                               (struct sockaddr *)&from_addr, sizeof(from_addr));
-                        continue;
-                    }
-
-                    int result = process_session_packet(sess, buf, n);
-                    if (result != 0) {
-                        session_free(sess);
-                    }
+            size_t seg = netio_segment_size(rb, i);
+            for (size_t off = 0; off < len; off += seg) {
+                size_t pkt_len = (len - off < seg) ? len - off : seg;
+                if (process_session_packet(sess, buf + off, pkt_len) != 0) {
+                    session_free(sess);
+                    break;
                 }
             }
+        }
+        budget -= n;
+    } while (n == RECV_BATCH && budget > 0);
 
-            if (sess->state != STATE_FREE) {
-                long elapsed = (now.tv_sec - sess->last_activity.tv_sec);
-                if (elapsed >= srv->config.timeout_sec) {
-                    if (sess->retries >= TFTP_MAX_RETRIES) {
-                        log_msg(LOG_WARN, "Session timeout: %s from %s:%d",
-                                sess->filename,
-                                inet_ntoa(sess->client_addr.sin_addr),
-                                ntohs(sess->client_addr.sin_port));
-                        session_free(sess);
-                    } else {
-                        session_retransmit(sess);
-                    }
-                }
+    return budget <= 0;
+}
+
+/*
+ * One pass over the work that is waiting. In-flight transfers go first,
+ * each session once with its quantum, so a burst of new requests cannot
+ * delay them; requests are then admitted up to their own share.
+ */
+static void serve_pending(tftp_server_t *srv)
+{
+    for (int n = srv->run_count; n > 0; n--) {
+        tftp_session_t *sess = runq_next(srv);
+        if (!sess)
+            break;
+
+        sess->deficit += RUNQ_QUANTUM * sess->weight;
+        int more = drain_session_socket(sess);
+        if (more > 0)
+            runq_ready(sess);
+        else if (more == 0)
+            sess->deficit = 0;
+    }
+
+    for (int i = 0; i < srv->shared_count; i++) {
+        if ((srv->shared_pending & (1ULL << i)) &&
+            !drain_shared_socket(srv, srv->shared_socks[i], RUNQ_SHARED))
+            srv->shared_pending &= ~(1ULL << i);
+    }
+
+    /* Group members' ACKs all arrive on the group socket */
+    for (int i = 0; i < MAX_MCAST_GROUPS; i++) {
+        if (!(srv->group_pending & (1u << i)))
+            continue;
+        if (srv->groups[i].sock < 0 ||
+            !drain_shared_socket(srv, srv->groups[i].sock, RUNQ_SHARED))
+            srv->group_pending &= ~(1u << i);
+    }
+
+    if (srv->main_pending)
+        srv->main_pending = drain_main_socket(srv, RUNQ_ADMIT);
+}
+
+int tftp_server_run(tftp_server_t *srv)
+{
+    while (srv->running) {
+        /* Sleep until the next timer is due, but wake periodically to see running */
+        int timeout = runq_busy(srv) ? 0 : timer_wheel_next_ms(&srv->timers, 1000);
+
+        /* Datagrams a full socket left queued are retried soon */
+        if (srv->tx->count > 0 && timeout > SEND_RETRY_MS)
+            timeout = SEND_RETRY_MS;
+        int ready = event_wait(srv, timeout);
+        srv->now = timer_now_ms();
+
+        if (ready < 0) {
+            if (errno == EINTR)
+                continue;
+            log_msg(LOG_ERROR, "epoll_wait failed: %s", strerror(errno));
+            break;
+        }
+
+        /*
+         * Sockets that became ready join the work carried over from earlier
+         * passes. Completions and inotify events can free sessions, so they
+         * wait until no event in the batch is left pointing at one.
+         */
+        int io_ready = 0, fcache_ready = 0;
+        for (int i = 0; i < ready; i++) {
+            void *ptr = srv->events[i].data.ptr;
+            mcast_group_t *group;
+            if (ptr == NULL) {
+                srv->main_pending = 1;
+            } else if (ptr == srv->fileio) {
+                io_ready = 1;
+            } else if (ptr == srv->fcache) {
+                fcache_ready = 1;
+            } else if (session_shared_sock(srv, ptr) >= 0) {
+                srv->shared_pending |= 1ULL << ((int *)ptr - srv->shared_socks);
+            } else if ((group = mcast_group_of(srv, ptr)) != NULL) {
+                srv->group_pending |= 1u << (group - srv->groups);
+            } else {
+                runq_ready((tftp_session_t *)ptr);
             }
         }
+        if (io_ready)
+            fileio_complete(srv);
+        if (fcache_ready)
+            fcache_events(srv);
+        serve_pending(srv);
+
+        /* Fire retransmits and expiries that are due */
+        timer_wheel_advance(&srv->timers, srv->now);
+
+        /* One batched send and one submit for everything this pass produced */
+        netio_flush(srv->tx);
+        metric_set(&srv->metrics.send_dropped, srv->tx->dropped);
+        fileio_submit(srv);
+        session_trim(srv);
     }
 
     return 0;
@@ -230,14 +426,28 @@ void tftp_server_stop(tftp_server_t *srv)
 
 void tftp_server_cleanup(tftp_server_t *srv)
 {
-    for (int i = 0; i < MAX_SESSIONS; i++) {
-        if (srv->sessions[i].state != STATE_FREE) {
-            session_free(&srv->sessions[i]);
-        }
-    }
+    if (srv->tx)
+        netio_flush(srv->tx);
+    session_table_cleanup(srv);
+    mcast_cleanup(srv);
+    fileio_cleanup(srv);
+    cache_cleanup(srv);     /* After the ring: no read can still be filling a block */
+    fcache_cleanup(srv);
 
     if (srv->main_sock >= 0) {
         close(srv->main_sock);
         srv->main_sock = -1;
     }
+
+    if (srv->root_fd >= 0) {
+        close(srv->root_fd);
+        srv->root_fd = -1;
+    }
+
+    event_cleanup(srv);
+
+    netio_recv_batch_free(srv->rx);
+    srv->rx = NULL;
+    netio_send_queue_free(srv->tx);
+    srv->tx = NULL;
 }
@@ -2,7 +2,9 @@
  * utftp - Session management
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 #include <unistd.h>
@@ -11,42 +13,307 @@
 #include <arpa/inet.h>
 #include "../include/session.h"
 #include "../include/packet.h"
+#include "../include/event.h"
+#include "../include/netio.h"
+#include "../include/fileio.h"
+#include "../include/cache.h"
+#include "../include/fcache.h"
+#include "../include/mcast.h"
+#include "../include/shape.h"
+#include "../include/runq.h"
+#include "../include/trace.h"
 #include "../include/log.h"
 
-tftp_session_t* session_alloc(tftp_server_t *srv)
+static int slab_grow(tftp_server_t *srv)
 {
-    for (int i = 0; i < MAX_SESSIONS; i++) {
-        if (srv->sessions[i].state == STATE_FREE) {
-            tftp_session_t *sess = &srv->sessions[i];
-            memset(sess, 0, sizeof(*sess));
-            sess->fd = -1;
-            sess->sock = -1;
-            sess->blksize = TFTP_DEF_BLKSIZE;
-            return sess;
+    session_slab_t *slab = calloc(1, sizeof(*slab));
+    if (!slab) {
+        log_msg(LOG_ERROR, "Out of memory growing session table");
+        return -1;
+    }
+
+    slab->next = srv->slabs;
+    if (srv->slabs)
+        srv->slabs->prev = slab;
+    srv->slabs = slab;
+    srv->empty_slabs++;
+
+    for (int i = 0; i < SESSION_SLAB_SIZE; i++) {
+        tftp_session_t *sess = &slab->sessions[i];
+        sess->state = STATE_FREE;
+        sess->slab = slab;
+        sess->next = srv->free_list;
+        if (srv->free_list)
+            srv->free_list->prev = sess;
+        srv->free_list = sess;
+    }
+    return 0;
+}
+
+static void slab_release(tftp_server_t *srv, session_slab_t *slab)
+{
+    /* Every slot is on the free list; unlink them before freeing the slab */
+    for (int i = 0; i < SESSION_SLAB_SIZE; i++) {
+        tftp_session_t *sess = &slab->sessions[i];
+        if (sess->prev)
+            sess->prev->next = sess->next;
+        else
+            srv->free_list = sess->next;
+        if (sess->next)
+            sess->next->prev = sess->prev;
+    }
+
+    if (slab->prev)
+        slab->prev->next = slab->next;
+    else
+        srv->slabs = slab->next;
+    if (slab->next)
+        slab->next->prev = slab->prev;
+
+    srv->empty_slabs--;
+    free(slab);
+}
+
+static uint32_t client_hash(const struct sockaddr_in *addr)
+{
+    uint32_t h = addr->sin_addr.s_addr * 0x9E3779B1u;
+    h ^= (uint32_t)addr->sin_port * 0x85EBCA6Bu;
+    h ^= h >> 16;
+    return h;
+}
+
+static void hash_remove(tftp_session_t *sess)
+{
+    tftp_server_t *srv = sess->srv;
+    tftp_session_t **pp = &srv->hash[client_hash(&sess->client_addr) & srv->hash_mask];
+
+    while (*pp) {
+        if (*pp == sess) {
+            *pp = sess->hash_next;
+            break;
         }
+        pp = &(*pp)->hash_next;
     }
-    return NULL;
+    sess->hash_next = NULL;
+    sess->hashed = 0;
+}
+
+/* How long the client may stay silent before the session is dropped */
+static uint64_t idle_limit(tftp_session_t *sess)
+{
+    return (uint64_t)sess->rto_max * (TFTP_MAX_RETRIES + 1);
+}
+
+static void session_timeout(tftp_timer_t *timer)
+{
+    tftp_session_t *sess = timer_entry(timer, tftp_session_t, timer);
+
+    /* A member waiting its turn is silent by design: it lives while its master is heard from */
+    int waiting = (sess->state == STATE_WAITING && sess->last_packet_len == 0);
+    if (waiting && sess->group && sess->group->members->last_heard > sess->last_heard)
+        sess->last_heard = sess->group->members->last_heard;
+
+    if (sess->srv->now - sess->last_heard >= idle_limit(sess)) {
+        log_msg(LOG_WARN, "Session timeout: %s from %s:%d",
+                sess->filename,
+                inet_ntoa(sess->client_addr.sin_addr),
+                ntohs(sess->client_addr.sin_port));
+        metric_add(&sess->srv->metrics.timeouts, 1);
+        session_free(sess);
+        return;
+    }
+
+    if (waiting) {
+        session_wait(sess);
+        return;
+    }
+
+    /* Resending from a mapping the file no longer covers would only fault until the client gives up */
+    if (sess->map && !fileio_map_intact(sess)) {
+        session_send_error(sess, TFTP_ERR_UNDEFINED, "Read error");
+        session_free(sess);
+        return;
+    }
+
+    /* Exponential backoff until the next clean sample; a negotiated interval stays put */
+    if (!sess->rto_fixed) {
+        sess->rto = (sess->rto * 2 < sess->rto_max) ? sess->rto * 2 : sess->rto_max;
+    }
+    session_retransmit(sess);
+}
+
+tftp_session_t* session_alloc(tftp_server_t *srv)
+{
+    if (srv->active_count >= srv->config.max_sessions)
+        return NULL;
+
+    if (!srv->free_list && slab_grow(srv) < 0)
+        return NULL;
+
+    /* Pop a free slot */
+    tftp_session_t *sess = srv->free_list;
+    srv->free_list = sess->next;
+    if (srv->free_list)
+        srv->free_list->prev = NULL;
+
+    session_slab_t *slab = sess->slab;
+    if (slab->live++ == 0)
+        srv->empty_slabs--;
+
+    memset(sess, 0, sizeof(*sess));
+    sess->srv = srv;
+    sess->slab = slab;
+    sess->fd = -1;
+    sess->sock = -1;
+    sess->blksize = TFTP_DEF_BLKSIZE;
+    sess->weight = 1;
+    sess->tx_slot = -1;
+    for (int i = 0; i < TFTP_MAX_WINDOWSIZE; i++)
+        sess->win_tx[i] = -1;
+    sess->buf_index = -1;
+    sess->file_index = -1;
+    sess->start_time = srv->now;
+    sess->last_heard = srv->now;
+    sess->timer.fn = session_timeout;
+
+    /* -t caps the adaptive interval */
+    sess->rto_max = (uint32_t)srv->config.timeout_sec * 1000;
+    if (sess->rto_max < TFTP_RTO_MIN_MS)
+        sess->rto_max = TFTP_RTO_MIN_MS;
+    sess->rto = (TFTP_RTO_INIT_MS < sess->rto_max) ? TFTP_RTO_INIT_MS : sess->rto_max;
+    sess->srtt = -1;
+
+    /* Push onto the active list */
+    sess->next = srv->active;
+    if (srv->active)
+        srv->active->prev = sess;
+    srv->active = sess;
+    srv->active_count++;
+    metric_set(&srv->metrics.sessions_active, srv->active_count);
+
+    return sess;
 }
 
 void session_free(tftp_session_t *sess)
 {
+    tftp_server_t *srv = sess->srv;
+    if (!srv)
+        return;     /* Already on the free list */
+
+    timer_cancel(&srv->timers, &sess->timer);
+    timer_cancel(&srv->timers, &sess->shape_timer);
+
+    /* Queued packets still reference this session's socket and buffers */
+    if (srv->tx->count > 0)
+        netio_flush(srv->tx);
+    session_cancel_sends(sess);
+    TRACE_PROBE(session_free, sess, sess->bytes_transferred, sess->state);
+    trace_end(sess);
+
+    /* A group's next member takes over; the last one out closes its socket */
+    mcast_leave(sess);
+    shape_detach(sess);
+    runq_remove(sess);
+
+    /* In-flight file operations may still own the packet buffer */
+    cache_detach(sess);
+    int adopted = fileio_detach(sess);
+    fileio_unmap(sess);
+
+    fcache_release(sess);
     if (sess->fd >= 0) {
         close(sess->fd);
         sess->fd = -1;
     }
-    if (sess->sock >= 0) {
+    if (sess->sock >= 0 && !sess->shared_sock) {
         close(sess->sock);
-        sess->sock = -1;
     }
+    sess->sock = -1;
+    if (sess->hashed)
+        hash_remove(sess);
+    if (!adopted && sess->last_packet)
+        fileio_buf_put(srv, sess->last_packet, sess->buf_index);
+    sess->last_packet = NULL;
+    sess->buf_index = -1;
+    sess->last_packet_cap = 0;
     sess->state = STATE_FREE;
+    sess->srv = NULL;
+
+    /* Move from the active list to the free list */
+    if (sess->prev)
+        sess->prev->next = sess->next;
+    else
+        srv->active = sess->next;
+    if (sess->next)
+        sess->next->prev = sess->prev;
+    srv->active_count--;
+    metric_set(&srv->metrics.sessions_active, srv->active_count);
+
+    sess->prev = NULL;
+    sess->next = srv->free_list;
+    if (srv->free_list)
+        srv->free_list->prev = sess;
+    srv->free_list = sess;
+
+    /* Released by session_trim(): events in the current batch may still point here */
+    if (--sess->slab->live == 0)
+        srv->empty_slabs++;
+}
+
+void session_trim(tftp_server_t *srv)
+{
+    /* Keep one empty slab around to absorb churn, release the rest */
+    session_slab_t *slab = srv->slabs;
+    while (slab && srv->empty_slabs > 1) {
+        session_slab_t *next = slab->next;
+        if (slab->live == 0)
+            slab_release(srv, slab);
+        slab = next;
+    }
+}
+
+void session_table_cleanup(tftp_server_t *srv)
+{
+    while (srv->active)
+        session_free(srv->active);
+
+    while (srv->slabs) {
+        session_slab_t *slab = srv->slabs;
+        srv->slabs = slab->next;
+        free(slab);
+    }
+    srv->free_list = NULL;
+    srv->empty_slabs = 0;
+
+    for (int i = 0; i < srv->shared_count; i++)
+        close(srv->shared_socks[i]);
+    srv->shared_count = 0;
+
+    free(srv->hash);
+    srv->hash = NULL;
+}
+
+void session_set_client(tftp_session_t *sess, const struct sockaddr_in *addr)
+{
+    tftp_server_t *srv = sess->srv;
+
+    if (sess->hashed)
+        hash_remove(sess);
+
+    memcpy(&sess->client_addr, addr, sizeof(sess->client_addr));
+
+    tftp_session_t **head = &srv->hash[client_hash(addr) & srv->hash_mask];
+    sess->hash_next = *head;
+    *head = sess;
+    sess->hashed = 1;
 }
 
 tftp_session_t* session_find_by_addr(tftp_server_t *srv, struct sockaddr_in *addr)
 {
-    for (int i = 0; i < MAX_SESSIONS; i++) {
-        tftp_session_t *sess = &srv->sessions[i];
-        if (sess->state != STATE_FREE &&
-            sess->client_addr.sin_addr.s_addr == addr->sin_addr.s_addr &&
+    tftp_session_t *sess = srv->hash[client_hash(addr) & srv->hash_mask];
+
+    for (; sess; sess = sess->hash_next) {
+        if (sess->client_addr.sin_addr.s_addr == addr->sin_addr.s_addr &&
             sess->client_addr.sin_port == addr->sin_port) {
             return sess;
         }
@@ -54,7 +321,22 @@ tftp_session_t* session_find_by_addr(tftp_server_t *srv, struct sockaddr_in *add
     return NULL;
 }
 
-int session_create_socket(tftp_server_t *srv)
+uint16_t session_wire_block(const tftp_session_t *sess, uint64_t block)
+{
+    /* 0 stays 0: it only ever names the request's ACK or OACK */
+    if (block == 0 || !sess->rollover)
+        return (uint16_t)block;
+    return (uint16_t)((block - 1) % 65535 + 1);
+}
+
+uint32_t session_wire_ahead(const tftp_session_t *sess, uint64_t block, uint16_t wire)
+{
+    uint32_t cycle = WIRE_CYCLE(sess);
+    uint32_t from = session_wire_block(sess, block) % cycle;
+    return ((uint32_t)wire % cycle + cycle - from) % cycle;
+}
+
+int session_open_socket(tftp_server_t *srv)
 {
     int sock = socket(AF_INET, SOCK_DGRAM, 0);
     if (sock < 0) {
@@ -82,46 +364,248 @@ int session_create_socket(tftp_server_t *srv)
     int flags = fcntl(sock, F_GETFL, 0);
     fcntl(sock, F_SETFL, flags | O_NONBLOCK);
 
+    if (srv->config.gro) {
+        netio_enable_gro(sock);
+    }
+
     return sock;
 }
 
+int session_table_init(tftp_server_t *srv)
+{
+    /* Power-of-two bucket count, at least twice the session limit */
+    uint32_t buckets = 64;
+    while (buckets < (uint32_t)srv->config.max_sessions * 2)
+        buckets <<= 1;
+
+    srv->hash = calloc(buckets, sizeof(*srv->hash));
+    if (!srv->hash) {
+        log_msg(LOG_CRITICAL, "Out of memory allocating session hash");
+        return -1;
+    }
+    srv->hash_mask = buckets - 1;
+
+    /* Shared mode: a few sockets carry every transfer, demultiplexed by client */
+    int count = srv->config.shared_sockets;
+    if (count > MAX_SHARED_SOCKS)
+        count = MAX_SHARED_SOCKS;
+
+    for (int i = 0; i < count; i++) {
+        int sock = session_open_socket(srv);
+        if (sock < 0)
+            return -1;
+
+        /* Many clients queue behind one socket */
+        int bufsize = 4 * 1024 * 1024;
+        setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof(bufsize));
+        setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &bufsize, sizeof(bufsize));
+
+        srv->shared_socks[i] = sock;
+        srv->shared_count++;
+
+        if (event_add(srv, sock, &srv->shared_socks[i]) < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+int session_shared_sock(tftp_server_t *srv, void *ptr)
+{
+    int *slot = ptr;
+    if (slot >= srv->shared_socks && slot < srv->shared_socks + srv->shared_count)
+        return *slot;
+    return -1;
+}
+
+int session_create_socket(tftp_server_t *srv, tftp_session_t *sess)
+{
+    if (srv->shared_count > 0) {
+        sess->sock = srv->shared_socks[srv->shared_next++ % srv->shared_count];
+        sess->shared_sock = 1;
+        return sess->sock;
+    }
+
+    int sock = session_open_socket(srv);
+    if (sock < 0)
+        return -1;
+
+    if (event_add(srv, sock, sess) < 0) {
+        close(sock);
+        return -1;
+    }
+
+    sess->sock = sock;
+    return sock;
+}
+
+static uint8_t* packet_buf_reserve(tftp_session_t *sess, size_t len)
+{
+    if (len <= sess->last_packet_cap)
+        return sess->last_packet;
+
+    /* Size once for the largest packet this session can produce; mapped or cached DATA never lands here */
+    size_t cap = (sess->map || sess->cached ? TFTP_DEF_BLKSIZE : sess->blksize) + 4;
+    if (cap < len)
+        cap = len;
+
+    int index;
+    uint8_t *p = fileio_buf_get(sess->srv, cap, &index);
+    if (!p) {
+        log_msg(LOG_ERROR, "Out of memory for session packet buffer");
+        return NULL;
+    }
+
+    if (sess->last_packet)
+        fileio_buf_put(sess->srv, sess->last_packet, sess->buf_index);
+    sess->last_packet = p;
+    sess->last_packet_cap = cap;
+    sess->buf_index = index;
+    return p;
+}
+
+uint8_t* session_packet_buf(tftp_session_t *sess, size_t len)
+{
+    /* The caller is about to overwrite it: send what still references it first */
+    if (sess->tx_slot >= 0)
+        netio_flush(sess->srv->tx);
+    session_cancel_sends(sess);
+
+    return packet_buf_reserve(sess, len);
+}
+
 int session_send_packet(tftp_session_t *sess, uint8_t *buf, size_t len)
 {
-    memcpy(sess->last_packet, buf, len);
+    if (buf != sess->last_packet) {
+        /* A queued copy of the previous packet is simply superseded */
+        if (!packet_buf_reserve(sess, len))
+            return -1;
+        memcpy(sess->last_packet, buf, len);
+    }
     sess->last_packet_len = len;
     sess->retries = 0;
-    gettimeofday(&sess->last_activity, NULL);
+    session_touch(sess);
+    TRACE_PROBE(packet_send, sess, sess->block_num, len);
 
-    ssize_t sent = sendto(sess->sock, buf, len, 0,
-                          (struct sockaddr *)&sess->client_addr,
-                          sizeof(sess->client_addr));
+    /* Sent with the rest of this loop pass's output */
+    struct iovec iov = { sess->last_packet, len };
+    int ret = netio_queue(sess->srv->tx, sess->sock, &sess->client_addr, &iov, 1, &sess->tx_slot);
+    trace_queued(sess);
+    return ret;
+}
 
-    if (sent < 0) {
-        log_msg(LOG_ERROR, "sendto failed: %s", strerror(errno));
-        return -1;
+size_t session_window_stride(tftp_session_t *sess)
+{
+    return (sess->map || sess->cached) ? 4 : sess->blksize + 4;
+}
+
+uint8_t* session_window_slot(tftp_session_t *sess, uint64_t block)
+{
+    return sess->last_packet + (block % sess->ring) * session_window_stride(sess);
+}
+
+int session_send_block(tftp_session_t *sess, uint64_t block)
+{
+    uint8_t *pkt = session_window_slot(sess, block);
+    size_t len = sess->win_len[block % sess->ring];
+    struct iovec iov[SEND_IOV_MAX];
+    int iovcnt = 1;
+
+    if (sess->map || sess->cached) {
+        /* Header from the slot, payload straight from the mapping or the cached block */
+        const uint8_t *payload = sess->cached ?
+            cache_data(sess->win_block[block % sess->ring]) :
+            sess->map + (block - 1) * sess->blksize;
+        iov[0] = (struct iovec){ pkt, 4 };
+        if (len > 0) {
+            iov[1] = (struct iovec){ (void *)payload, len };
+            iovcnt = 2;
+        }
+    } else {
+        iov[0] = (struct iovec){ pkt, 4 + len };
     }
 
-    return 0;
+    /*
+     * Several blocks are queued at once, so each window slot has its own
+     * queue entry: a resend supersedes an unsent copy, and refilling the
+     * slot cancels it (session_cancel_block).
+     */
+    session_rtt_start(sess, block);
+    session_touch(sess);
+    metric_add(&sess->srv->metrics.bytes_sent, len);
+    TRACE_PROBE(packet_send, sess, block, 4 + len);
+
+    /* A multicast master's window goes to the whole group */
+    const struct sockaddr_in *dest = &sess->client_addr;
+    if (sess->group) {
+        dest = &sess->group->addr;
+        if (block > sess->group->high)
+            sess->group->high = block;
+    }
+    int ret = netio_queue(sess->srv->tx, sess->sock, dest, iov, iovcnt,
+                          &sess->win_tx[block % sess->ring]);
+    trace_queued(sess);
+    return ret;
 }
 
 int session_retransmit(tftp_session_t *sess)
 {
+    /* RRQ with nothing outstanding: its next blocks are being read or held by the shaper */
+    if (sess->win_base > 0 && sess->win_next == sess->win_base) {
+        session_touch(sess);
+        return 0;
+    }
+
+    /* RRQ: go back to the last acknowledged block and resend the window */
+    if (sess->win_next > sess->win_base) {
+        sess->retries++;
+        session_rtt_discard(sess, sess->win_next);
+        log_msg(LOG_DEBUG, "Retransmit #%d of blocks %llu-%llu to %s:%d",
+                sess->retries,
+                (unsigned long long)sess->win_base,
+                (unsigned long long)sess->win_next - 1,
+                inet_ntoa(sess->client_addr.sin_addr),
+                ntohs(sess->client_addr.sin_port));
+        metric_add(&sess->srv->metrics.retransmits, sess->win_next - sess->win_base);
+        TRACE_PROBE(retransmit, sess, sess->win_base, sess->win_next - 1, sess->retries);
+        for (uint64_t b = sess->win_base; b < sess->win_next; b++) {
+            shape_charge(sess, 4 + sess->win_len[b % sess->ring]);
+            if (session_send_block(sess, b) < 0)
+                return -1;
+        }
+        return 0;
+    }
+
     if (sess->last_packet_len == 0)
         return -1;
 
     sess->retries++;
-    gettimeofday(&sess->last_activity, NULL);
+    session_rtt_discard(sess, sess->rtt_tag + 1);
+    session_touch(sess);
+    metric_add(&sess->srv->metrics.retransmits, 1);
+    TRACE_PROBE(retransmit, sess, sess->block_num, sess->block_num, sess->retries);
 
     log_msg(LOG_DEBUG, "Retransmit #%d to %s:%d",
             sess->retries,
             inet_ntoa(sess->client_addr.sin_addr),
             ntohs(sess->client_addr.sin_port));
 
-    ssize_t sent = sendto(sess->sock, sess->last_packet, sess->last_packet_len, 0,
-                          (struct sockaddr *)&sess->client_addr,
-                          sizeof(sess->client_addr));
+    struct iovec iov = { sess->last_packet, sess->last_packet_len };
+    int ret = netio_queue(sess->srv->tx, sess->sock, &sess->client_addr, &iov, 1, &sess->tx_slot);
+    trace_queued(sess);
+    return ret;
+}
+
+void session_cancel_block(tftp_session_t *sess, uint64_t block)
+{
+    netio_cancel(sess->srv->tx, &sess->win_tx[block % sess->ring]);
+}
 
-    return (sent < 0) ? -1 : 0;
+void session_cancel_sends(tftp_session_t *sess)
+{
+    netio_cancel(sess->srv->tx, &sess->tx_slot);
+    for (unsigned slot = 0; slot < sess->ring; slot++)
+        netio_cancel(sess->srv->tx, &sess->win_tx[slot]);
 }
 
 void session_send_error(tftp_session_t *sess, tftp_error_t code, const char *msg)
@@ -129,6 +613,10 @@ void session_send_error(tftp_session_t *sess, tftp_error_t code, const char *msg
     uint8_t buf[512];
     int len = packet_build_error(buf, code, msg);
 
+    /* Anything queued for this client goes out before the error */
+    if (sess->srv->tx->count > 0)
+        netio_flush(sess->srv->tx);
+
     sendto(sess->sock, buf, len, 0,
            (struct sockaddr *)&sess->client_addr,
            sizeof(sess->client_addr));
@@ -137,3 +625,76 @@ void session_send_error(tftp_session_t *sess, tftp_error_t code, const char *msg
             inet_ntoa(sess->client_addr.sin_addr),
             ntohs(sess->client_addr.sin_port), msg);
 }
+
+void session_wait(tftp_session_t *sess)
+{
+    sess->last_packet_len = 0;
+    timer_arm(&sess->srv->timers, &sess->timer, sess->last_heard + idle_limit(sess));
+}
+
+void session_touch(tftp_session_t *sess)
+{
+    tftp_server_t *srv = sess->srv;
+    uint64_t expires = srv->now + sess->rto;
+    uint64_t deadline = sess->last_heard + idle_limit(sess);
+
+    timer_arm(&srv->timers, &sess->timer, expires < deadline ? expires : deadline);
+}
+
+void session_set_timeout(tftp_session_t *sess, uint32_t ms)
+{
+    sess->rto = ms;
+    sess->rto_max = ms;
+    sess->rto_fixed = 1;
+}
+
+void session_rtt_start(tftp_session_t *sess, uint64_t tag)
+{
+    if (sess->rtt_pending || tag < sess->rtt_floor)
+        return;
+
+    sess->rtt_pending = 1;
+    sess->rtt_tag = tag;
+    sess->rtt_sent = sess->srv->now;
+}
+
+void session_rtt_ack(tftp_session_t *sess, uint64_t tag)
+{
+    if (!sess->rtt_pending || tag < sess->rtt_tag)
+        return;
+    sess->rtt_pending = 0;
+
+    uint64_t elapsed = sess->srv->now - sess->rtt_sent;
+    metric_observe(&sess->srv->metrics.ack_rtt, metric_rtt_bounds, elapsed);
+    int m = (elapsed < sess->rto_max) ? (int)elapsed : (int)sess->rto_max;
+
+    /* RFC 6298 in fixed point: srtt holds 8 x SRTT, rttvar 4 x RTTVAR */
+    if (sess->srtt < 0) {
+        sess->srtt = m << 3;
+        sess->rttvar = m << 1;
+    } else {
+        int err = m - (sess->srtt >> 3);
+        sess->srtt += err;
+        if (err < 0)
+            err = -err;
+        sess->rttvar += err - (sess->rttvar >> 2);
+    }
+
+    if (sess->rto_fixed)
+        return;
+
+    /* RTO = SRTT + max(G, 4 x RTTVAR) with a 1 ms clock; a clean sample also ends backoff */
+    uint32_t rto = (uint32_t)(sess->srtt >> 3) + (uint32_t)(sess->rttvar > 1 ? sess->rttvar : 1);
+    if (rto < TFTP_RTO_MIN_MS)
+        rto = TFTP_RTO_MIN_MS;
+    if (rto > sess->rto_max)
+        rto = sess->rto_max;
+    sess->rto = rto;
+}
+
+void session_rtt_discard(tftp_session_t *sess, uint64_t next_tag)
+{
+    sess->rtt_pending = 0;
+    if (sess->rtt_floor < next_tag)
+        sess->rtt_floor = next_tag;
+}
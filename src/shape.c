@@ -0,0 +1,200 @@
+/*
+ * utftp - Download bandwidth shaping
+ *
+ * Hierarchical token buckets over DATA sent to clients: a global cap,
+ * one bucket per configured subnet shared by every client in it, and a
+ * bucket per client address. A block goes out only when every bucket
+ * over its session has room; otherwise the session is deferred on a
+ * timer until the fullest one drains, so no loop pass spins on it.
+ *
+ * Buckets are kept as GCRA theoretical arrival times, a single 64-bit
+ * word each, updated with atomics so all workers share the same caps.
+ * Sessions only take the client table lock when they start and end.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include "../include/shape.h"
+
+#define SHAPE_BURST_MS      20      /* Sent at once after an idle spell */
+#define SHAPE_CLIENT_HASH   1024
+
+typedef struct {
+    uint64_t        rate;               /* Bytes per second, 0: unlimited */
+    uint64_t        tat;                /* ns, when the bucket is next empty */
+} shape_bucket_t;
+
+struct shape_client {
+    uint32_t        addr;               /* Network order */
+    int             users;              /* Sessions, across workers */
+    shape_client_t *next;
+    shape_bucket_t  own;
+    int             count;
+    shape_bucket_t *buckets[2 + MAX_SHAPE_SUBNETS];
+};
+
+static struct {
+    int             enabled;
+    shape_bucket_t  global;
+    shape_bucket_t  subnets[MAX_SHAPE_SUBNETS];
+    uint64_t        client_rate;
+    const tftp_config_t *config;
+    pthread_mutex_t lock;
+    shape_client_t *clients[SHAPE_CLIENT_HASH];
+} g_shape = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static uint64_t bucket_cost(const shape_bucket_t *b, size_t len)
+{
+    return (uint64_t)len * 1000000000ull / b->rate;
+}
+
+void shape_init(const tftp_config_t *config)
+{
+    memset(g_shape.clients, 0, sizeof(g_shape.clients));
+    g_shape.config = config;
+    g_shape.global.rate = config->rate;
+    g_shape.global.tat = 0;
+    for (int i = 0; i < config->subnet_count; i++) {
+        g_shape.subnets[i].rate = config->subnets[i].rate;
+        g_shape.subnets[i].tat = 0;
+    }
+    g_shape.client_rate = config->client_rate;
+    g_shape.enabled = config->rate || config->client_rate || config->subnet_count;
+}
+
+void shape_cleanup(void)
+{
+    for (int i = 0; i < SHAPE_CLIENT_HASH; i++) {
+        while (g_shape.clients[i]) {
+            shape_client_t *c = g_shape.clients[i];
+            g_shape.clients[i] = c->next;
+            free(c);
+        }
+    }
+    g_shape.enabled = 0;
+}
+
+uint64_t shape_parse_rate(const char *str)
+{
+    char *end;
+    double value = strtod(str, &end);
+    double unit = 1;
+
+    switch (*end) {
+        case 'k': case 'K': unit = 1024.0; end++; break;
+        case 'm': case 'M': unit = 1024.0 * 1024.0; end++; break;
+        case 'g': case 'G': unit = 1024.0 * 1024.0 * 1024.0; end++; break;
+    }
+    if (end == str || *end != '\0' || value <= 0)
+        return 0;
+    return (uint64_t)(value * unit);
+}
+
+static uint32_t client_slot(uint32_t addr)
+{
+    return (addr * 0x9E3779B1u) >> 22;
+}
+
+void shape_attach(tftp_session_t *sess)
+{
+    if (!g_shape.enabled || sess->shaper)
+        return;
+
+    uint32_t addr = sess->client_addr.sin_addr.s_addr;
+    shape_client_t **head = &g_shape.clients[client_slot(addr)];
+
+    pthread_mutex_lock(&g_shape.lock);
+
+    shape_client_t *c = *head;
+    while (c && c->addr != addr)
+        c = c->next;
+
+    if (!c && (c = calloc(1, sizeof(*c))) != NULL) {
+        c->addr = addr;
+        if (g_shape.global.rate)
+            c->buckets[c->count++] = &g_shape.global;
+        for (int i = 0; i < g_shape.config->subnet_count; i++) {
+            const shape_subnet_t *s = &g_shape.config->subnets[i];
+            if ((ntohl(addr) & s->mask) == s->net)
+                c->buckets[c->count++] = &g_shape.subnets[i];
+        }
+        c->own.rate = g_shape.client_rate;
+        if (c->own.rate)
+            c->buckets[c->count++] = &c->own;
+
+        c->next = *head;
+        *head = c;
+    }
+    if (c)
+        c->users++;
+
+    pthread_mutex_unlock(&g_shape.lock);
+    sess->shaper = c;
+}
+
+void shape_detach(tftp_session_t *sess)
+{
+    shape_client_t *c = sess->shaper;
+    if (!c)
+        return;
+    sess->shaper = NULL;
+
+    pthread_mutex_lock(&g_shape.lock);
+    if (--c->users == 0) {
+        /* The client's bucket goes with its last session */
+        shape_client_t **pp = &g_shape.clients[client_slot(c->addr)];
+        while (*pp != c)
+            pp = &(*pp)->next;
+        *pp = c->next;
+        free(c);
+    }
+    pthread_mutex_unlock(&g_shape.lock);
+}
+
+static void bucket_charge(shape_bucket_t *b, uint64_t now, size_t len)
+{
+    uint64_t tat = __atomic_load_n(&b->tat, __ATOMIC_RELAXED);
+    uint64_t next;
+
+    do {
+        next = (tat > now ? tat : now) + bucket_cost(b, len);
+    } while (!__atomic_compare_exchange_n(&b->tat, &tat, next, 1,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+uint32_t shape_admit(tftp_session_t *sess, size_t len)
+{
+    shape_client_t *c = sess->shaper;
+    if (!c || c->count == 0)
+        return 0;
+
+    uint64_t now = sess->srv->now * 1000000ull;
+    uint64_t burst = SHAPE_BURST_MS * 1000000ull;
+    uint64_t wait = 0;
+
+    /* A bucket has room while it empties within the burst allowance */
+    for (int i = 0; i < c->count; i++) {
+        uint64_t tat = __atomic_load_n(&c->buckets[i]->tat, __ATOMIC_RELAXED);
+        if (tat > now + burst && tat - now - burst > wait)
+            wait = tat - now - burst;
+    }
+    if (wait > 0)
+        return (uint32_t)((wait + 999999) / 1000000);
+
+    for (int i = 0; i < c->count; i++)
+        bucket_charge(c->buckets[i], now, len);
+    return 0;
+}
+
+void shape_charge(tftp_session_t *sess, size_t len)
+{
+    shape_client_t *c = sess->shaper;
+    if (!c)
+        return;
+
+    uint64_t now = sess->srv->now * 1000000ull;
+    for (int i = 0; i < c->count; i++)
+        bucket_charge(c->buckets[i], now, len);
+}
@@ -0,0 +1,145 @@
+/*
+ * utftp - Hierarchical timer wheel
+ *
+ * Level 0 holds timers due within the next 64 ms, one slot per ms. Each
+ * higher level covers 64x the span of the one below and is cascaded down
+ * whenever the lower level wraps, so arming and cancelling stay O(1) and
+ * advancing costs one slot check per elapsed ms.
+ */
+
+#include <string.h>
+#include <time.h>
+#include "../include/timer.h"
+
+uint64_t timer_now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void timer_wheel_init(timer_wheel_t *wheel, uint64_t now)
+{
+    memset(wheel, 0, sizeof(*wheel));
+    wheel->now = now;
+}
+
+static void wheel_insert(timer_wheel_t *wheel, tftp_timer_t *timer)
+{
+    uint64_t expires = timer->expires;
+    int level, shift = 0;
+
+    /* Cascading timers due this tick land in the slot about to run */
+    if (expires < wheel->now)
+        expires = wheel->now;
+
+    /* Lowest level whose slot index is within one revolution of now */
+    for (level = 0; level < TIMER_LEVELS; level++) {
+        shift = TIMER_SLOT_BITS * level;
+        if ((expires >> shift) - (wheel->now >> shift) < TIMER_SLOTS)
+            break;
+    }
+
+    /* Beyond the wheel's span: park in the furthest top-level slot */
+    if (level == TIMER_LEVELS) {
+        level = TIMER_LEVELS - 1;
+        shift = TIMER_SLOT_BITS * level;
+        expires = ((wheel->now >> shift) + TIMER_SLOTS - 1) << shift;
+    }
+
+    int slot = (expires >> shift) & TIMER_SLOT_MASK;
+    tftp_timer_t **head = &wheel->slots[level][slot];
+
+    timer->next = *head;
+    if (*head)
+        (*head)->pprev = &timer->next;
+    *head = timer;
+    timer->pprev = head;
+}
+
+static void wheel_unlink(tftp_timer_t *timer)
+{
+    *timer->pprev = timer->next;
+    if (timer->next)
+        timer->next->pprev = timer->pprev;
+    timer->next = NULL;
+    timer->pprev = NULL;
+}
+
+void timer_arm(timer_wheel_t *wheel, tftp_timer_t *timer, uint64_t expires)
+{
+    if (timer->pprev)
+        wheel_unlink(timer);
+    else
+        wheel->count++;
+
+    /* Anything already due fires on the next tick */
+    if (expires <= wheel->now)
+        expires = wheel->now + 1;
+
+    timer->expires = expires;
+    wheel_insert(wheel, timer);
+}
+
+void timer_cancel(timer_wheel_t *wheel, tftp_timer_t *timer)
+{
+    if (!timer->pprev)
+        return;
+    wheel_unlink(timer);
+    wheel->count--;
+}
+
+static void wheel_cascade(timer_wheel_t *wheel, int level)
+{
+    int slot = (wheel->now >> (TIMER_SLOT_BITS * level)) & TIMER_SLOT_MASK;
+    tftp_timer_t *list = wheel->slots[level][slot];
+    wheel->slots[level][slot] = NULL;
+
+    while (list) {
+        tftp_timer_t *timer = list;
+        list = timer->next;
+        wheel_insert(wheel, timer);
+    }
+}
+
+void timer_wheel_advance(timer_wheel_t *wheel, uint64_t now)
+{
+    while (wheel->now < now) {
+        if (wheel->count == 0) {
+            wheel->now = now;
+            break;
+        }
+
+        wheel->now++;
+
+        /* Pull the next span of each higher level down when a level wraps */
+        for (int level = 1; level < TIMER_LEVELS; level++) {
+            if ((wheel->now >> (TIMER_SLOT_BITS * (level - 1))) & TIMER_SLOT_MASK)
+                break;
+            wheel_cascade(wheel, level);
+        }
+
+        tftp_timer_t **head = &wheel->slots[0][wheel->now & TIMER_SLOT_MASK];
+        while (*head) {
+            tftp_timer_t *timer = *head;
+            wheel_unlink(timer);
+            wheel->count--;
+            timer->fn(timer);
+        }
+    }
+}
+
+int timer_wheel_next_ms(timer_wheel_t *wheel, int max_ms)
+{
+    if (wheel->count == 0)
+        return max_ms;
+
+    /* Nearest armed level-0 slot, or the next cascade point */
+    int limit = TIMER_SLOTS - (int)(wheel->now & TIMER_SLOT_MASK);
+    for (int i = 1; i < limit && i < max_ms; i++) {
+        if (wheel->slots[0][(wheel->now + i) & TIMER_SLOT_MASK])
+            return i;
+    }
+
+    return (limit < max_ms) ? limit : max_ms;
+}
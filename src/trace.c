@@ -0,0 +1,140 @@
+/*
+ * utftp - Per-stage latency of transfers
+ *
+ * With --trace-latency every session carries a trace_lat_t and adds the
+ * time it spends in each stage as it goes; the breakdown is logged when
+ * it ends. Disk time runs from issuing an operation to its completion,
+ * so with io_uring it can overlap waiting on the client; "other" is what
+ * remains of the total, mostly the event loop itself.
+ *
+ * Without the option sessions carry no record and every hook reduces to
+ * a NULL test.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include "../include/trace.h"
+#include "../include/log.h"
+
+static const char *stage_names[LAT_STAGES] = {
+    "parse", "open", "disk", "send", "wait",
+};
+
+uint64_t trace_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void trace_begin(tftp_session_t *sess, uint64_t since)
+{
+    if (!sess->srv->config.trace_latency || sess->lat)
+        return;
+
+    /* Without a record the transfer just goes untraced */
+    sess->lat = calloc(1, sizeof(*sess->lat));
+    if (sess->lat)
+        sess->lat->start = since;
+}
+
+void trace_stage(tftp_session_t *sess, lat_stage_t stage, uint64_t since)
+{
+    trace_lat_t *lat = sess->lat;
+    if (!lat)
+        return;
+    lat->stage[stage] += trace_ns() - since;
+    lat->count[stage]++;
+}
+
+void trace_request_done(tftp_session_t *sess)
+{
+    trace_lat_t *lat = sess->lat;
+    if (!lat)
+        return;
+
+    uint64_t spent = trace_ns() - lat->start;
+    uint64_t other = lat->stage[LAT_OPEN] + lat->stage[LAT_DISK];
+    lat->stage[LAT_PARSE] = spent > other ? spent - other : 0;
+    lat->count[LAT_PARSE] = 1;
+}
+
+void trace_queued(tftp_session_t *sess)
+{
+    trace_lat_t *lat = sess->lat;
+    if (!lat || lat->flush_queued)
+        return;
+
+    lat->flush_queued = 1;
+    lat->flush_next = sess->srv->lat_flush;
+    sess->srv->lat_flush = lat;
+}
+
+void trace_flushed(void *ctx, uint64_t since)
+{
+    tftp_server_t *srv = ctx;
+    if (!srv->lat_flush)
+        return;
+
+    uint64_t now = trace_ns();
+
+    while (srv->lat_flush) {
+        trace_lat_t *lat = srv->lat_flush;
+        srv->lat_flush = lat->flush_next;
+        lat->flush_next = NULL;
+        lat->flush_queued = 0;
+
+        lat->stage[LAT_SEND] += now - since;
+        lat->count[LAT_SEND]++;
+        lat->wait_since = now;
+    }
+}
+
+void trace_heard(tftp_session_t *sess)
+{
+    trace_lat_t *lat = sess->lat;
+    if (!lat || !lat->wait_since)
+        return;
+
+    lat->stage[LAT_WAIT] += trace_ns() - lat->wait_since;
+    lat->count[LAT_WAIT]++;
+    lat->wait_since = 0;
+}
+
+void trace_end(tftp_session_t *sess)
+{
+    trace_lat_t *lat = sess->lat;
+    if (!lat)
+        return;
+    sess->lat = NULL;
+
+    /* Still waiting for a flush that will not account for it */
+    if (lat->flush_queued) {
+        trace_lat_t **pp = &sess->srv->lat_flush;
+        while (*pp != lat)
+            pp = &(*pp)->flush_next;
+        *pp = lat->flush_next;
+    }
+
+    uint64_t total = trace_ns() - lat->start;
+    uint64_t accounted = 0;
+    char line[256];
+    int len = 0;
+
+    for (int i = 0; i < LAT_STAGES; i++) {
+        accounted += lat->stage[i];
+        len += snprintf(line + len, sizeof(line) - len, "%s%s %.3f (%u)",
+                        i ? ", " : "", stage_names[i], lat->stage[i] / 1e6, lat->count[i]);
+    }
+
+    log_msg(LOG_INFO, "Latency %s %s:%d: %.3f ms = %s, other %.3f",
+            sess->filename,
+            inet_ntoa(sess->client_addr.sin_addr),
+            ntohs(sess->client_addr.sin_port),
+            total / 1e6, line,
+            total > accounted ? (total - accounted) / 1e6 : 0.0);
+    free(lat);
+}
@@ -5,6 +5,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <strings.h>
+#include <errno.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/stat.h>
@@ -13,16 +14,431 @@
 #include "../include/session.h"
 #include "../include/packet.h"
 #include "../include/util.h"
+#include "../include/fileio.h"
+#include "../include/cache.h"
+#include "../include/fcache.h"
+#include "../include/mcast.h"
+#include "../include/netascii.h"
+#include "../include/shape.h"
+#include "../include/runq.h"
+#include "../include/trace.h"
 #include "../include/log.h"
 
+static int rrq_pump(tftp_session_t *sess);
+
+/* RFC 2349 timeout, or its sub-second utimeout variant, fixes the retransmit interval */
+static void apply_timeout(tftp_session_t *sess, const tftp_options_t *opts)
+{
+    if (opts->has_utimeout)
+        session_set_timeout(sess, (uint32_t)((opts->utimeout + 999) / 1000));
+    else if (opts->has_timeout)
+        session_set_timeout(sess, opts->timeout * 1000);
+    else
+        return;
+
+    log_msg(LOG_DEBUG, "Negotiated timeout %u ms for %s:%d",
+            sess->rto,
+            inet_ntoa(sess->client_addr.sin_addr),
+            ntohs(sess->client_addr.sin_port));
+}
+
+/* Window slots plus read-ahead: TFTP_READAHEAD blocks, fewer when they are large */
+static unsigned readahead_ring(const tftp_session_t *sess)
+{
+    size_t ahead = TFTP_READAHEAD_BYTES / sess->blksize;
+    if (ahead > TFTP_READAHEAD)
+        ahead = TFTP_READAHEAD;
+    if (ahead < 1)
+        ahead = 1;
+
+    size_t ring = sess->windowsize + ahead;
+    return ring < TFTP_MAX_WINDOWSIZE ? (unsigned)ring : TFTP_MAX_WINDOWSIZE;
+}
+
+/*
+ * Completion of a block read: the payload already sits behind the DATA
+ * header, or in the file mapping, so only the header is written.
+ */
+static int rrq_block_read(tftp_session_t *sess, uint64_t block, ssize_t n)
+{
+    TRACE_PROBE(block_read, sess, block, n);
+    trace_io_done(sess, block % sess->ring);
+    if (n < 0) {
+        session_send_error(sess, TFTP_ERR_UNDEFINED, "Read error");
+        return -1;
+    }
+
+    packet_build_data(session_window_slot(sess, block), session_wire_block(sess, block), NULL, 0);
+
+    unsigned slot = block % sess->ring;
+    sess->win_len[slot] = (uint32_t)n;
+    sess->win_ready |= 1ULL << slot;
+
+    /* The file shrank under us: stop at the first short block */
+    if ((size_t)n < sess->blksize && block < sess->last_block)
+        sess->last_block = block;
+
+    return rrq_pump(sess);
+}
+
+/* Netascii: file bytes are staged after the ring and encoded into the block's slot */
+static uint8_t* rrq_netascii_in(tftp_session_t *sess)
+{
+    return sess->last_packet + sess->ring * session_window_stride(sess);
+}
+
+static int rrq_netascii_read(tftp_session_t *sess, uint64_t block, ssize_t n)
+{
+    sess->na_reading = 0;
+    if (n < 0)
+        return rrq_block_read(sess, block, n);
+
+    /* Whatever does not fit is read again for the next block */
+    size_t consumed;
+    size_t len = netascii_encode(&sess->na, rrq_netascii_in(sess), (size_t)n, &consumed,
+                                 session_window_slot(sess, block) + 4, sess->blksize);
+    sess->na_off += consumed;
+    return rrq_block_read(sess, block, (ssize_t)len);
+}
+
+/* Send the window's blocks whose data is in, in order */
+static void rrq_shaped(tftp_timer_t *timer);
+
+static int rrq_send(tftp_session_t *sess)
+{
+    uint64_t limit = sess->win_base + sess->windowsize;
+
+    while (sess->win_next < sess->win_read && sess->win_next < limit &&
+           sess->win_next <= sess->last_block &&
+           (sess->win_ready & (1ULL << (sess->win_next % sess->ring)))) {
+        /* Over a bandwidth cap: come back once the bucket has drained */
+        uint32_t wait = shape_admit(sess, 4 + sess->win_len[sess->win_next % sess->ring]);
+        if (wait > 0) {
+            sess->shape_timer.fn = rrq_shaped;
+            timer_arm(&sess->srv->timers, &sess->shape_timer, sess->srv->now + wait);
+            break;
+        }
+        if (session_send_block(sess, sess->win_next++) < 0)
+            return -1;
+    }
+
+    if (sess->win_next > sess->last_block)
+        sess->state = STATE_LAST_DATA;
+    return 0;
+}
+
+/*
+ * Keep the ring full: send what is ready, start reads for every free
+ * slot, which covers the window and up to TFTP_READAHEAD blocks past it,
+ * then send whatever those completed. With blocks read ahead, an ACK
+ * goes out as DATA before any file I/O. Synchronous reads complete
+ * inside fileio_read() and re-enter here, which the win_pumping guard
+ * absorbs.
+ */
+static int rrq_pump(tftp_session_t *sess)
+{
+    if (sess->win_pumping)
+        return 0;
+    sess->win_pumping = 1;
+
+    int ret = rrq_send(sess);
+    if (ret < 0)
+        goto out;
+
+    uint64_t limit = sess->win_base + sess->ring;
+    int map_checked = 0;
+
+    while (sess->win_read < limit && sess->win_read <= sess->last_block) {
+        /* Each netascii block starts where the previous one's encoding stopped */
+        if (sess->na_reading)
+            break;
+
+        uint64_t block = sess->win_read++;
+        sess->win_ready &= ~(1ULL << (block % sess->ring));
+        session_cancel_block(sess, block);
+
+        uint64_t off = (block - 1) * sess->blksize;
+        trace_io_start(sess, block % sess->ring);
+
+        if (sess->cached) {
+            ret = cache_read(sess, block, rrq_block_read);
+        } else if (sess->netascii) {
+            sess->na_reading = 1;
+            ret = fileio_read(sess, rrq_netascii_in(sess), sess->blksize, sess->na_off,
+                              block, rrq_netascii_read);
+        } else if (sess->map) {
+            /* Truncated under us, the mapping would hand sendmsg pages past EOF */
+            if (!map_checked && !fileio_map_intact(sess)) {
+                ret = rrq_block_read(sess, block, -1);
+                goto out;
+            }
+            map_checked = 1;
+            size_t left = off < sess->map_len ? sess->map_len - off : 0;
+            ret = rrq_block_read(sess, block, left < sess->blksize ? left : sess->blksize);
+        } else {
+            uint8_t *pkt = session_window_slot(sess, block);
+            ret = fileio_read(sess, pkt + 4, sess->blksize, off, block, rrq_block_read);
+        }
+        if (ret != 0)
+            goto out;
+    }
+
+    /* Keep the kernel's own read-ahead in front of ours */
+    if (sess->win_read <= sess->last_block)
+        fileio_readahead(sess, sess->netascii ? sess->na_off : (sess->win_read - 1) * sess->blksize);
+
+    ret = rrq_send(sess);
+
+out:
+    sess->win_pumping = 0;
+    return ret;
+}
+
+/* The shaper has room again */
+static void rrq_shaped(tftp_timer_t *timer)
+{
+    tftp_session_t *sess = timer_entry(timer, tftp_session_t, shape_timer);
+
+    if (rrq_pump(sess) != 0)
+        session_free(sess);
+}
+
+/* Start the data phase at block from: 1, or where a multicast master's holdings end */
+static int rrq_start(tftp_session_t *sess, uint64_t from)
+{
+    sess->win_base = from;
+    sess->win_next = from;
+    sess->win_read = from;
+    sess->win_ready = 0;
+    sess->retries = 0;
+
+    /* Blocks held for an abandoned window would be taken for the new ones */
+    session_cancel_sends(sess);
+    if (sess->cached) {
+        for (unsigned slot = 0; slot < sess->ring; slot++)
+            cache_release(sess, slot);
+    }
+    return rrq_pump(sess);
+}
+
+/* Every block has been acknowledged */
+static int rrq_finished(tftp_session_t *sess)
+{
+    metric_observe(&sess->srv->metrics.duration_rrq, metric_duration_bounds,
+                   sess->srv->now - sess->start_time);
+
+    double elapsed = (sess->srv->now - sess->start_time) / 1000.0;
+    if (elapsed < 0.001) elapsed = 0.001;
+    double speed = sess->bytes_transferred / elapsed;
+
+    char sizebuf[32], speedbuf[32];
+    if (g_use_color) {
+        log_msg(LOG_INFO, "%sSENT SUCCESS%s %s%s%s %s @ %s to %s%s:%d%s",
+                C_GREEN C_BOLD, C_RESET,
+                C_BOLD, sess->filename, C_RESET,
+                format_size(sess->bytes_transferred, sizebuf, sizeof(sizebuf)),
+                format_speed(speed, speedbuf, sizeof(speedbuf)),
+                C_MAGENTA, inet_ntoa(sess->client_addr.sin_addr),
+                ntohs(sess->client_addr.sin_port), C_RESET);
+    } else {
+        log_msg(LOG_INFO, "SENT SUCCESS %s %s @ %s to %s:%d",
+                sess->filename,
+                format_size(sess->bytes_transferred, sizebuf, sizeof(sizebuf)),
+                format_speed(speed, speedbuf, sizeof(speedbuf)),
+                inet_ntoa(sess->client_addr.sin_addr),
+                ntohs(sess->client_addr.sin_port));
+    }
+    return 1;
+}
+
+/* A multicast master already holds everything up to block: carry on after it */
+static int rrq_skip(tftp_session_t *sess, uint64_t block)
+{
+    if (block >= sess->last_block) {
+        sess->bytes_transferred = sess->tsize;
+        return rrq_finished(sess);
+    }
+    session_rtt_discard(sess, sess->win_next);
+    sess->bytes_transferred = block * sess->blksize;
+    return rrq_start(sess, block + 1);
+}
+
+/*
+ * WRQ write-behind. Received blocks are copied into the buffer being
+ * filled and acknowledged at once; a buffer is written out when it is
+ * full, while the other one takes the next blocks. Only when both are
+ * busy is the ACK held back, which stops the client until a write
+ * completes. The final ACK waits for every write, and for fdatasync
+ * under --sync close, so a failed write is reported instead.
+ */
+#define WRQ_ACK_ROOM    512     /* Front of last_packet: the ACK or OACK */
+
+/* Write-behind buffer i; past the second is the netascii decode area */
+static uint8_t* wrq_buf(tftp_session_t *sess, int i)
+{
+    return sess->last_packet + WRQ_ACK_ROOM + i * sess->wb_cap;
+}
+
+/* Room for another full block without waiting on a write */
+static int wrq_can_accept(tftp_session_t *sess)
+{
+    int cur = sess->wb_cur;
+    if (sess->wb_busy[cur])
+        return 0;
+
+    /* A decoded netascii block can carry the previous block's CR */
+    size_t need = sess->blksize + (sess->netascii ? 1 : 0);
+    return sess->wb_cap - sess->wb_len[cur] >= need || !sess->wb_busy[cur ^ 1];
+}
+
+static int wrq_ack(tftp_session_t *sess)
+{
+    uint8_t pkt[4];
+    int pkt_len = packet_build_ack(pkt, session_wire_block(sess, sess->block_num));
+    session_rtt_start(sess, sess->block_num);
+    return session_send_packet(sess, pkt, pkt_len);
+}
+
+/* Every block is on disk: final ACK */
+static int wrq_finished(tftp_session_t *sess)
+{
+    wrq_ack(sess);
+    metric_observe(&sess->srv->metrics.duration_wrq, metric_duration_bounds,
+                   sess->srv->now - sess->start_time);
+
+    double elapsed = (sess->srv->now - sess->start_time) / 1000.0;
+    if (elapsed < 0.001) elapsed = 0.001;
+    double speed = sess->bytes_transferred / elapsed;
+
+    char sizebuf[32], speedbuf[32];
+    if (g_use_color) {
+        log_msg(LOG_INFO, "%sRECV SUCCESS%s %s%s%s %s @ %s from %s%s:%d%s",
+                C_YELLOW C_BOLD, C_RESET,
+                C_BOLD, sess->filename, C_RESET,
+                format_size(sess->bytes_transferred, sizebuf, sizeof(sizebuf)),
+                format_speed(speed, speedbuf, sizeof(speedbuf)),
+                C_MAGENTA, inet_ntoa(sess->client_addr.sin_addr),
+                ntohs(sess->client_addr.sin_port), C_RESET);
+    } else {
+        log_msg(LOG_INFO, "RECV SUCCESS %s %s @ %s from %s:%d",
+                sess->filename,
+                format_size(sess->bytes_transferred, sizebuf, sizeof(sizebuf)),
+                format_speed(speed, speedbuf, sizeof(speedbuf)),
+                inet_ntoa(sess->client_addr.sin_addr),
+                ntohs(sess->client_addr.sin_port));
+    }
+    return 1;
+}
+
+static int wrq_synced(tftp_session_t *sess, uint64_t tag, ssize_t result);
+
+/* After a write or sync completes: release a held ACK, or finish */
+static int wrq_progress(tftp_session_t *sess)
+{
+    if (sess->wb_done) {
+        if (sess->wb_busy[0] || sess->wb_busy[1] || sess->syncing)
+            return 0;
+        if (sess->srv->config.sync_mode == SYNC_CLOSE && !sess->wb_synced) {
+            sess->syncing = 1;
+            trace_io_start(sess, 2);
+            return fileio_sync(sess, 0, wrq_synced);
+        }
+        return wrq_finished(sess);
+    }
+
+    if (sess->wb_held && wrq_can_accept(sess)) {
+        sess->wb_held = 0;
+        return wrq_ack(sess);
+    }
+    return 0;
+}
+
+static int wrq_synced(tftp_session_t *sess, uint64_t tag, ssize_t result)
+{
+    (void)tag;
+    trace_io_done(sess, 2);
+    if (result < 0) {
+        session_send_error(sess, TFTP_ERR_DISK_FULL, "Write error");
+        return -1;
+    }
+
+    sess->syncing = 0;
+    sess->wb_synced = sess->wb_done;
+    return wrq_progress(sess);
+}
+
+/* Completion of a buffer write */
+static int wrq_written(tftp_session_t *sess, uint64_t i, ssize_t written)
+{
+    trace_io_done(sess, i);
+    if (written < 0 || (size_t)written != sess->wb_len[i]) {
+        session_send_error(sess, TFTP_ERR_DISK_FULL, "Write error");
+        return -1;
+    }
+    sess->wb_len[i] = 0;
+    sess->wb_busy[i] = 0;
+
+    const tftp_config_t *cfg = &sess->srv->config;
+    if (cfg->sync_mode == SYNC_PERIODIC && !sess->syncing &&
+        sess->srv->now - sess->synced_at >= (uint64_t)cfg->sync_interval * 1000) {
+        sess->syncing = 1;
+        sess->synced_at = sess->srv->now;
+        trace_io_start(sess, 2);
+        int ret = fileio_sync(sess, 0, wrq_synced);
+        if (ret != 0)
+            return ret;
+    }
+
+    return wrq_progress(sess);
+}
+
+/* Write out the buffer being filled and start on the other one */
+static int wrq_flush(tftp_session_t *sess)
+{
+    int i = sess->wb_cur;
+    uint64_t off = sess->wb_off;
+
+    sess->wb_busy[i] = 1;
+    sess->wb_off += sess->wb_len[i];
+    sess->wb_cur = i ^ 1;
+    trace_io_start(sess, i);
+    return fileio_write(sess, wrq_buf(sess, i), sess->wb_len[i], off, i, wrq_written);
+}
+
+/* Copy a block in, writing out the buffer it completes */
+static int wrq_store(tftp_session_t *sess, const uint8_t *data, size_t len)
+{
+    int cur = sess->wb_cur;
+    size_t take = sess->wb_cap - sess->wb_len[cur];
+    if (take > len)
+        take = len;
+
+    memcpy(wrq_buf(sess, cur) + sess->wb_len[cur], data, take);
+    sess->wb_len[cur] += take;
+
+    if (sess->wb_len[cur] == sess->wb_cap) {
+        int ret = wrq_flush(sess);
+        if (ret != 0)
+            return ret;
+    }
+
+    /* The rest starts the other buffer, which wrq_can_accept() found idle */
+    if (take < len) {
+        cur = sess->wb_cur;
+        memcpy(wrq_buf(sess, cur), data + take, len - take);
+        sess->wb_len[cur] = len - take;
+    }
+    return 0;
+}
+
 int handle_rrq(tftp_server_t *srv, tftp_session_t *sess, uint8_t *buf, size_t len)
 {
     char filename[MAX_FILENAME_LEN];
     char mode[32];
-    size_t blksize, tsize;
+    tftp_options_t opts;
 
     if (packet_parse_request(buf, len, filename, sizeof(filename),
-                             mode, sizeof(mode), &blksize, &tsize) < 0) {
+                             mode, sizeof(mode), &opts) < 0) {
         session_send_error(sess, TFTP_ERR_ILLEGAL_OP, "Malformed request");
         return -1;
     }
@@ -32,29 +448,71 @@ int handle_rrq(tftp_server_t *srv, tftp_session_t *sess, uint8_t *buf, size_t le
         return -1;
     }
 
-    char fullpath[MAX_PATH_LEN];
-    if (validate_path(srv->config.root_dir, filename, fullpath, sizeof(fullpath)) < 0) {
-        session_send_error(sess, TFTP_ERR_ACCESS_DENIED, "Access denied");
+    /* Descriptor and size come from the file cache when another request opened it */
+    struct stat st;
+    uint64_t opening = trace_mark(sess);
+    int fd = fcache_open(sess, filename, &st);
+    trace_stage(sess, LAT_OPEN, opening);
+    if (fd < 0) {
+        if (fd == -EXDEV)
+            session_send_error(sess, TFTP_ERR_ACCESS_DENIED, "Access denied");
+        else
+            session_send_error(sess, TFTP_ERR_FILE_NOT_FOUND, "File not found");
         return -1;
     }
+    sess->fd = fd;
+    sess->tsize = st.st_size;
+    fileio_attach(sess);
 
-    sess->fd = open(fullpath, O_RDONLY);
-    if (sess->fd < 0) {
-        session_send_error(sess, TFTP_ERR_FILE_NOT_FOUND, "File not found");
-        return -1;
+    strncpy(sess->filename, filename, sizeof(sess->filename) - 1);
+    sess->blksize = opts.blksize;
+    metric_observe(&srv->metrics.blksize, metric_blksize_bounds, sess->blksize);
+    sess->windowsize = opts.windowsize;
+    shape_attach(sess);
+    runq_classify(sess, filename);
+    sess->rollover = opts.has_rollover ? opts.rollover : 0;
+    sess->ring = readahead_ring(sess);
+    apply_timeout(sess, &opts);
+    sess->last_block = sess->tsize / sess->blksize + 1;
+    sess->state = STATE_SENDING;
+    sess->start_time = srv->now;
+
+    /*
+     * Netascii expansion is only known by reading the file: scan it when
+     * tsize is asked for, else bound it and let the short block end it.
+     * The scan blocks the loop, so large files go without tsize instead.
+     */
+    sess->netascii = (strcasecmp(mode, "netascii") == 0);
+    if (sess->netascii) {
+        int64_t encoded = -1;
+        if (opts.has_tsize && sess->tsize <= NETASCII_SCAN_MAX)
+            encoded = fcache_netascii_size(sess, sess->tsize);
+        if (encoded >= 0) {
+            sess->tsize = (uint64_t)encoded;
+            sess->last_block = sess->tsize / sess->blksize + 1;
+        } else {
+            opts.has_tsize = 0;
+            sess->last_block = 2 * sess->tsize / sess->blksize + 1;
+        }
     }
 
-    struct stat st;
-    if (fstat(sess->fd, &st) == 0) {
-        sess->tsize = st.st_size;
+    /*
+     * Regular files are sent from the shared block cache, or else from a
+     * mapping; either way the window then only holds headers. Netascii
+     * blocks are encoded into the window itself.
+     */
+    if (!sess->netascii && !cache_attach(sess, &st) && S_ISREG(st.st_mode))
+        fileio_map(sess, sess->tsize);
+
+    /* One buffer for the whole window, sized before any read targets it */
+    size_t bufsize = sess->ring * session_window_stride(sess);
+    if (sess->netascii)
+        bufsize += sess->blksize;
+    if (!session_packet_buf(sess, bufsize)) {
+        session_send_error(sess, TFTP_ERR_UNDEFINED, "Out of memory");
+        return -1;
     }
 
-    strncpy(sess->filename, filename, sizeof(sess->filename) - 1);
-    sess->blksize = blksize;
-    sess->block_num = 0;
-    sess->state = STATE_SENDING;
-    gettimeofday(&sess->start_time, NULL);
-
     char sizebuf[32];
     if (g_use_color) {
         log_msg(LOG_INFO, "%s<-- GET%s %s%s%s (%s) from %s%s:%d%s",
@@ -71,29 +529,24 @@ int handle_rrq(tftp_server_t *srv, tftp_session_t *sess, uint8_t *buf, size_t le
                 ntohs(sess->client_addr.sin_port));
     }
 
-    uint8_t pkt[TFTP_MAX_PACKET];
-    int pkt_len;
+    /* Multicast members other than the master wait for their turn after the OACK */
+    if (opts.has_multicast) {
+        int role = !sess->netascii ? mcast_join(sess, &st, &opts) : -1;
+        if (role < 0)
+            opts.has_multicast = 0;
+        else if (role == 0)
+            sess->state = STATE_WAITING;
+    }
 
-    if (blksize != TFTP_DEF_BLKSIZE || tsize != 0) {
-        pkt_len = packet_build_oack(pkt, blksize, sess->tsize, 1);
+    if (opts.blksize != TFTP_DEF_BLKSIZE || opts.has_tsize || opts.has_windowsize ||
+        opts.has_timeout || opts.has_utimeout || opts.has_rollover || opts.has_multicast) {
+        uint8_t pkt[512];
+        opts.tsize = sess->tsize;
+        int pkt_len = packet_build_oack(pkt, &opts);
+        session_rtt_start(sess, 0);
         return session_send_packet(sess, pkt, pkt_len);
     } else {
-        sess->block_num = 1;
-        uint8_t data[TFTP_MAX_BLKSIZE];
-        ssize_t n = read(sess->fd, data, sess->blksize);
-        if (n < 0) {
-            session_send_error(sess, TFTP_ERR_UNDEFINED, "Read error");
-            return -1;
-        }
-
-        pkt_len = packet_build_data(pkt, sess->block_num, data, n);
-        sess->bytes_transferred = n;
-
-        if ((size_t)n < sess->blksize) {
-            sess->state = STATE_LAST_DATA;
-        }
-
-        return session_send_packet(sess, pkt, pkt_len);
+        return rrq_start(sess, 1);
     }
 }
 
@@ -101,10 +554,10 @@ int handle_wrq(tftp_server_t *srv, tftp_session_t *sess, uint8_t *buf, size_t le
 {
     char filename[MAX_FILENAME_LEN];
     char mode[32];
-    size_t blksize, tsize;
+    tftp_options_t opts;
 
     if (packet_parse_request(buf, len, filename, sizeof(filename),
-                             mode, sizeof(mode), &blksize, &tsize) < 0) {
+                             mode, sizeof(mode), &opts) < 0) {
         session_send_error(sess, TFTP_ERR_ILLEGAL_OP, "Malformed request");
         return -1;
     }
@@ -114,41 +567,45 @@ int handle_wrq(tftp_server_t *srv, tftp_session_t *sess, uint8_t *buf, size_t le
         return -1;
     }
 
-    char fullpath[MAX_PATH_LEN];
-    if (validate_path(srv->config.root_dir, filename, fullpath, sizeof(fullpath)) < 0) {
-        session_send_error(sess, TFTP_ERR_ACCESS_DENIED, "Access denied");
-        return -1;
-    }
-
-    /* Create parent directories if needed */
-    char *slash = strrchr(fullpath, '/');
-    if (slash) {
-        *slash = '\0';
-        char tmp[MAX_PATH_LEN];
-        strncpy(tmp, fullpath, sizeof(tmp) - 1);
-        for (char *p = tmp + 1; *p; p++) {
-            if (*p == '/') {
-                *p = '\0';
-                mkdir(tmp, 0755);
-                *p = '/';
-            }
-        }
-        mkdir(tmp, 0755);
-        *slash = '/';
-    }
-
-    sess->fd = open(fullpath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-    if (sess->fd < 0) {
-        session_send_error(sess, TFTP_ERR_ACCESS_DENIED, "Cannot create file");
+    /* Missing parent directories are created; cached opens of the old file go stale */
+    fcache_forget(srv, filename);
+    uint64_t opening = trace_mark(sess);
+    int fd = root_open(srv->root_fd, srv->config.root_dir, filename,
+                       O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    trace_stage(sess, LAT_OPEN, opening);
+    if (fd < 0) {
+        session_send_error(sess, TFTP_ERR_ACCESS_DENIED,
+                           fd == -EXDEV ? "Access denied" : "Cannot create file");
         return -1;
     }
+    sess->fd = fd;
+    fileio_attach(sess);
 
     strncpy(sess->filename, filename, sizeof(sess->filename) - 1);
-    sess->blksize = blksize;
-    sess->tsize = tsize;
+    runq_classify(sess, filename);
+    sess->blksize = opts.blksize;
+    metric_observe(&srv->metrics.blksize, metric_blksize_bounds, sess->blksize);
+    sess->tsize = opts.tsize;
     sess->block_num = 0;
+    sess->rollover = opts.has_rollover ? opts.rollover : 0;
+    apply_timeout(sess, &opts);
     sess->state = STATE_RECEIVING;
-    gettimeofday(&sess->start_time, NULL);
+    sess->start_time = srv->now;
+    sess->synced_at = srv->now;
+
+    sess->netascii = (strcasecmp(mode, "netascii") == 0);
+
+    /*
+     * Two write-behind buffers, each a multiple of the page size holding
+     * at least two blocks, then room to decode a netascii block.
+     */
+    sess->wb_cap = TFTP_WRITE_BEHIND;
+    if (sess->wb_cap < 2 * sess->blksize)
+        sess->wb_cap = (2 * sess->blksize + 4095) & ~(size_t)4095;
+    if (!session_packet_buf(sess, WRQ_ACK_ROOM + 2 * sess->wb_cap + sess->blksize + 1)) {
+        session_send_error(sess, TFTP_ERR_UNDEFINED, "Out of memory");
+        return -1;
+    }
 
     if (g_use_color) {
         log_msg(LOG_INFO, "%s--> PUT%s %s%s%s from %s%s:%d%s",
@@ -166,12 +623,17 @@ int handle_wrq(tftp_server_t *srv, tftp_session_t *sess, uint8_t *buf, size_t le
     uint8_t pkt[512];
     int pkt_len;
 
-    if (blksize != TFTP_DEF_BLKSIZE || tsize != 0) {
-        pkt_len = packet_build_oack(pkt, blksize, tsize, tsize != 0);
+    /* Uploads stay lock-step: windowsize is left out of the OACK, so it stays 1 */
+    opts.has_windowsize = 0;
+
+    if (opts.blksize != TFTP_DEF_BLKSIZE || opts.has_tsize ||
+        opts.has_timeout || opts.has_utimeout || opts.has_rollover) {
+        pkt_len = packet_build_oack(pkt, &opts);
     } else {
         pkt_len = packet_build_ack(pkt, 0);
     }
 
+    session_rtt_start(sess, 0);
     return session_send_packet(sess, pkt, pkt_len);
 }
 
@@ -181,70 +643,82 @@ int handle_ack(tftp_session_t *sess, uint8_t *buf, size_t len)
         return -1;
 
     uint16_t ack_block = (buf[2] << 8) | buf[3];
+    TRACE_PROBE(ack_recv, sess, ack_block);
 
     log_msg(LOG_DEBUG, "ACK %d from %s:%d",
             ack_block,
             inet_ntoa(sess->client_addr.sin_addr),
             ntohs(sess->client_addr.sin_port));
 
-    if (ack_block == 0 && sess->block_num == 0) {
-        sess->block_num = 1;
-    }
-    else if (ack_block == sess->block_num) {
-        if (sess->state == STATE_LAST_DATA) {
-            struct timeval now;
-            gettimeofday(&now, NULL);
-            double elapsed = (now.tv_sec - sess->start_time.tv_sec) +
-                           (now.tv_usec - sess->start_time.tv_usec) / 1000000.0;
-            if (elapsed < 0.001) elapsed = 0.001;
-            double speed = sess->bytes_transferred / elapsed;
-
-            char sizebuf[32], speedbuf[32];
-            if (g_use_color) {
-                log_msg(LOG_INFO, "%sSENT SUCCESS%s %s%s%s %s @ %s to %s%s:%d%s",
-                        C_GREEN C_BOLD, C_RESET,
-                        C_BOLD, sess->filename, C_RESET,
-                        format_size(sess->bytes_transferred, sizebuf, sizeof(sizebuf)),
-                        format_speed(speed, speedbuf, sizeof(speedbuf)),
-                        C_MAGENTA, inet_ntoa(sess->client_addr.sin_addr),
-                        ntohs(sess->client_addr.sin_port), C_RESET);
-            } else {
-                log_msg(LOG_INFO, "SENT SUCCESS %s %s @ %s to %s:%d",
-                        sess->filename,
-                        format_size(sess->bytes_transferred, sizebuf, sizeof(sizebuf)),
-                        format_speed(speed, speedbuf, sizeof(speedbuf)),
-                        inet_ntoa(sess->client_addr.sin_addr),
-                        ntohs(sess->client_addr.sin_port));
-            }
-            return 1;
+    /* ACK of the OACK; a promoted multicast master names the last block it holds */
+    if (sess->win_base == 0) {
+        if (ack_block != 0 && !sess->group) {
+            session_send_error(sess, TFTP_ERR_ILLEGAL_OP, "Invalid ACK");
+            return -1;
         }
-        sess->block_num++;
-    }
-    else if (ack_block < sess->block_num) {
-        gettimeofday(&sess->last_activity, NULL);
-        return 0;
-    }
-    else {
-        session_send_error(sess, TFTP_ERR_ILLEGAL_OP, "Invalid ACK");
-        return -1;
+        session_rtt_ack(sess, 0);
+        if (sess->group)
+            return rrq_skip(sess, mcast_ack_block(sess, ack_block));
+        return rrq_start(sess, 1);
     }
 
-    uint8_t data[TFTP_MAX_BLKSIZE];
-    ssize_t n = read(sess->fd, data, sess->blksize);
-    if (n < 0) {
-        session_send_error(sess, TFTP_ERR_UNDEFINED, "Read error");
-        return -1;
-    }
+    /*
+     * Map the 16-bit ACK onto the 64-bit counters by serial-number
+     * arithmetic. It can only name a block from the last acknowledged
+     * one up to the last one sent, a span far shorter than the wire's
+     * wraparound period.
+     */
+    uint64_t acked = sess->win_base - 1;
+    uint64_t ahead = session_wire_ahead(sess, acked, ack_block);
+
+    if (ahead > sess->win_next - 1 - acked) {
+        /* Behind the window: a late duplicate */
+        if (ahead >= WIRE_CYCLE(sess) / 2) {
+            session_touch(sess);
+            return 0;
+        }
+        /* A multicast master may already hold blocks it got while a member */
+        if (!sess->group || acked + ahead > sess->group->high) {
+            session_send_error(sess, TFTP_ERR_ILLEGAL_OP, "Invalid ACK");
+            return -1;
+        }
+        if (sess->io_pending == 0)
+            return rrq_skip(sess, acked + ahead);
 
-    uint8_t pkt[TFTP_MAX_PACKET];
-    int pkt_len = packet_build_data(pkt, sess->block_num, data, n);
-    sess->bytes_transferred += n;
+        /* Reads in flight target this window: until they land, it acknowledges what was sent */
+        ahead = sess->win_next - 1 - acked;
+    }
+    uint64_t block = acked + ahead;
+    session_rtt_ack(sess, block);
+
+    /* Cumulative: everything up to block has arrived */
+    for (uint64_t b = sess->win_base; b <= block; b++)
+        sess->bytes_transferred += sess->win_len[b % sess->ring];
+
+    if (block >= sess->last_block)
+        return rrq_finished(sess);
+
+    if (block >= sess->win_base) {
+        sess->win_base = block + 1;
+        sess->retries = 0;
+    } else if (sess->windowsize == 1) {
+        /* Lock-step duplicate: resending would start Sorcerer's Apprentice */
+        session_touch(sess);
+        return 0;
+    }
 
-    if ((size_t)n < sess->blksize) {
-        sess->state = STATE_LAST_DATA;
+    /* An ACK short of the last block sent reports a gap: go back to it */
+    if (block + 1 < sess->win_next) {
+        log_msg(LOG_DEBUG, "Window rewind to block %llu for %s:%d",
+                (unsigned long long)block + 1,
+                inet_ntoa(sess->client_addr.sin_addr),
+                ntohs(sess->client_addr.sin_port));
+        session_rtt_discard(sess, sess->win_next);
+        sess->win_next = block + 1;
+        sess->state = STATE_SENDING;
     }
 
-    return session_send_packet(sess, pkt, pkt_len);
+    return rrq_pump(sess);
 }
 
 int handle_data(tftp_session_t *sess, uint8_t *buf, size_t len)
@@ -254,62 +728,70 @@ int handle_data(tftp_session_t *sess, uint8_t *buf, size_t len)
 
     uint16_t block = (buf[2] << 8) | buf[3];
     size_t data_len = len - 4;
+    uint32_t back;
 
     log_msg(LOG_DEBUG, "DATA %d (%zu bytes) from %s:%d",
             block, data_len,
             inet_ntoa(sess->client_addr.sin_addr),
             ntohs(sess->client_addr.sin_port));
 
-    if (block == sess->block_num + 1) {
-        if (data_len > 0) {
-            ssize_t written = write(sess->fd, buf + 4, data_len);
-            if (written < 0 || (size_t)written != data_len) {
-                session_send_error(sess, TFTP_ERR_DISK_FULL, "Write error");
-                return -1;
-            }
+    if (block == session_wire_block(sess, sess->block_num + 1)) {
+        /* Blocks are at most what was negotiated: the decode area and the write-behind accounting rely on it */
+        if (data_len > sess->blksize) {
+            session_send_error(sess, TFTP_ERR_ILLEGAL_OP, "Block larger than blksize");
+            return -1;
         }
 
-        sess->block_num = block;
-        sess->bytes_transferred += data_len;
+        /* Only a client that saw our ACK sends the next block, and then there is room */
+        if (sess->wb_held || sess->wb_done || !wrq_can_accept(sess))
+            return 0;
 
-        uint8_t pkt[4];
-        int pkt_len = packet_build_ack(pkt, block);
-        session_send_packet(sess, pkt, pkt_len);
+        session_rtt_ack(sess, sess->block_num);
+        sess->block_num++;
+        sess->bytes_transferred += data_len;
+        metric_add(&sess->srv->metrics.bytes_received, data_len);
+
+        int ret;
+        if (sess->netascii) {
+            uint8_t *text = wrq_buf(sess, 2);
+            size_t text_len = netascii_decode(&sess->na, buf + 4, data_len, text);
+            if (data_len < sess->blksize)
+                text_len += netascii_decode_end(&sess->na, text + text_len);
+            ret = wrq_store(sess, text, text_len);
+        } else {
+            ret = wrq_store(sess, buf + 4, data_len);
+        }
+        if (ret != 0)
+            return ret;
 
         if (data_len < sess->blksize) {
-            struct timeval now;
-            gettimeofday(&now, NULL);
-            double elapsed = (now.tv_sec - sess->start_time.tv_sec) +
-                           (now.tv_usec - sess->start_time.tv_usec) / 1000000.0;
-            if (elapsed < 0.001) elapsed = 0.001;
-            double speed = sess->bytes_transferred / elapsed;
-
-            char sizebuf[32], speedbuf[32];
-            if (g_use_color) {
-                log_msg(LOG_INFO, "%sRECV SUCCESS%s %s%s%s %s @ %s from %s%s:%d%s",
-                        C_YELLOW C_BOLD, C_RESET,
-                        C_BOLD, sess->filename, C_RESET,
-                        format_size(sess->bytes_transferred, sizebuf, sizeof(sizebuf)),
-                        format_speed(speed, speedbuf, sizeof(speedbuf)),
-                        C_MAGENTA, inet_ntoa(sess->client_addr.sin_addr),
-                        ntohs(sess->client_addr.sin_port), C_RESET);
-            } else {
-                log_msg(LOG_INFO, "RECV SUCCESS %s %s @ %s from %s:%d",
-                        sess->filename,
-                        format_size(sess->bytes_transferred, sizebuf, sizeof(sizebuf)),
-                        format_speed(speed, speedbuf, sizeof(speedbuf)),
-                        inet_ntoa(sess->client_addr.sin_addr),
-                        ntohs(sess->client_addr.sin_port));
-            }
-            return 1;
+            sess->wb_done = 1;
+            if (sess->wb_len[sess->wb_cur] > 0 && (ret = wrq_flush(sess)) != 0)
+                return ret;
+            return wrq_progress(sess);
+        }
+
+        if (!wrq_can_accept(sess)) {
+            sess->wb_held = 1;
+            return 0;
         }
+        return wrq_ack(sess);
     }
-    else if (block <= sess->block_num) {
-        uint8_t pkt[4];
-        int pkt_len = packet_build_ack(pkt, block);
-        sendto(sess->sock, pkt, pkt_len, 0,
-               (struct sockaddr *)&sess->client_addr,
-               sizeof(sess->client_addr));
+    /* Up to half the wire's cycle behind: a block already written */
+    else if ((back = (WIRE_CYCLE(sess) - session_wire_ahead(sess, sess->block_num, block)) %
+                     WIRE_CYCLE(sess)) < WIRE_CYCLE(sess) / 2) {
+        /* An ACK still held back or waiting on the final write is sent in its own time */
+        if (back == 0 && (sess->wb_held || sess->wb_done))
+            return 0;
+
+        /*
+         * Our ACK went missing, or this is a stray copy of an older block:
+         * repeat the latest ACK, which covers it, through the send queue
+         * so it supersedes any copy still queued. The next DATA answers
+         * this resend, not the original.
+         */
+        session_rtt_discard(sess, sess->block_num + 1);
+        return session_send_packet(sess, sess->last_packet, sess->last_packet_len);
     }
     else {
         session_send_error(sess, TFTP_ERR_ILLEGAL_OP, "Invalid block number");
@@ -325,6 +807,8 @@ int process_session_packet(tftp_session_t *sess, uint8_t *buf, size_t len)
         return -1;
 
     uint16_t opcode = (buf[0] << 8) | buf[1];
+    sess->last_heard = sess->srv->now;
+    trace_heard(sess);
 
     switch (sess->state) {
         case STATE_SENDING:
@@ -337,6 +821,25 @@ int process_session_packet(tftp_session_t *sess, uint8_t *buf, size_t len)
             }
             break;
 
+        case STATE_WAITING:
+            /*
+             * A member reports on its own only to acknowledge the OACK, or
+             * to say it already holds the whole file.
+             */
+            if (opcode == TFTP_ACK && len >= 4) {
+                session_wait(sess);
+                uint16_t ack_block = (buf[2] << 8) | buf[3];
+                if (mcast_ack_block(sess, ack_block) >= sess->last_block) {
+                    sess->bytes_transferred = sess->tsize;
+                    return rrq_finished(sess);
+                }
+                return 0;
+            } else if (opcode == TFTP_ERROR) {
+                log_msg(LOG_WARN, "Client error: %s", buf + 4);
+                return -1;
+            }
+            break;
+
         case STATE_RECEIVING:
             if (opcode == TFTP_DATA) {
                 return handle_data(sess, buf, len);
@@ -2,58 +2,157 @@
  * utftp - Utility functions
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include "../include/util.h"
+#include "../include/trace.h"
 #include "../include/log.h"
 
-int validate_path(const char *root, const char *filename, char *fullpath, size_t pathlen)
+#if defined(__has_include)
+#if __has_include(<linux/openat2.h>)
+#define HAVE_OPENAT2 1
+#endif
+#endif
+
+#ifdef HAVE_OPENAT2
+#include <sys/syscall.h>
+#include <linux/openat2.h>
+#endif
+
+/*
+ * The root is opened once; every request is then resolved beneath that
+ * fd by a single openat2() with RESOLVE_BENEATH, so neither "..", an
+ * absolute symlink nor a rename racing the lookup can leave it. Kernels
+ * before 5.6 fall back to checking realpath() against the root path.
+ */
+static int g_openat2 = 1;      /* Cleared once the kernel reports ENOSYS */
+
+static int open_beneath(int root_fd, const char *path, int flags, mode_t mode)
+{
+#ifdef HAVE_OPENAT2
+    if (__atomic_load_n(&g_openat2, __ATOMIC_RELAXED)) {
+        struct open_how how;
+        memset(&how, 0, sizeof(how));
+        how.flags = flags;
+        how.mode = (flags & O_CREAT) ? mode : 0;
+        how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+
+        int fd = (int)syscall(__NR_openat2, root_fd, path, &how, sizeof(how));
+        if (fd >= 0)
+            return fd;
+        if (errno != ENOSYS)
+            return (errno == ELOOP) ? -EXDEV : -errno;
+        __atomic_store_n(&g_openat2, 0, __ATOMIC_RELAXED);
+    }
+#else
+    (void)root_fd; (void)path; (void)flags; (void)mode;
+#endif
+    return -ENOSYS;
+}
+
+/* Pre-openat2 kernels: the lookup is checked, then repeated by open() */
+static int open_checked(int root_fd, const char *root, const char *path, int flags, mode_t mode)
 {
-    char resolved_root[PATH_MAX];
     char resolved_path[PATH_MAX];
     char temp_path[PATH_MAX];
 
-    /* Resolve root directory */
-    if (!realpath(root, resolved_root)) {
-        log_msg(LOG_ERROR, "Cannot resolve root path: %s", root);
-        return -1;
+    snprintf(temp_path, sizeof(temp_path), "%s/%s", root, path);
+
+    /* Path exists - verify it's under root */
+    if (realpath(temp_path, resolved_path)) {
+        size_t root_len = strlen(root);
+        if (strncmp(resolved_path, root, root_len) != 0 ||
+            (resolved_path[root_len] != '/' && resolved_path[root_len] != '\0'))
+            return -EXDEV;
+        int fd = open(resolved_path, flags, mode);
+        return fd >= 0 ? fd : -errno;
     }
 
-    /* Build full path */
-    snprintf(temp_path, sizeof(temp_path), "%s/%s", resolved_root, filename);
+    /* Path doesn't exist - could be for writing */
+    if (strstr(path, "..") != NULL)
+        return -EXDEV;
 
-    /* For reading: resolve the full path */
-    if (realpath(temp_path, resolved_path)) {
-        /* Path exists - verify it's under root */
-        size_t root_len = strlen(resolved_root);
-        if (strncmp(resolved_path, resolved_root, root_len) != 0 ||
-            (resolved_path[root_len] != '/' && resolved_path[root_len] != '\0')) {
-            log_msg(LOG_WARN, "Path traversal attempt blocked: %s", filename);
-            return -1;
+    int fd = openat(root_fd, path, flags, mode);
+    return fd >= 0 ? fd : -errno;
+}
+
+static int open_under(int root_fd, const char *root, const char *path, int flags, mode_t mode)
+{
+    int fd = open_beneath(root_fd, path, flags, mode);
+    if (fd == -ENOSYS)
+        fd = open_checked(root_fd, root, path, flags, mode);
+    return fd;
+}
+
+/* Create the directories leading up to path, each beneath the root */
+static void make_parents(int root_fd, const char *root, const char *path)
+{
+    char dir[PATH_MAX];
+    snprintf(dir, sizeof(dir), "%s", path);
+
+    for (char *p = strchr(dir, '/'); p; p = strchr(p + 1, '/')) {
+        *p = '\0';
+
+        /* mkdirat() never follows its last component; open its parent safely */
+        char *name = strrchr(dir, '/');
+        int parent = root_fd;
+        if (name) {
+            *name = '\0';
+            parent = open_under(root_fd, root, dir, O_PATH | O_DIRECTORY, 0);
+            *name++ = '/';
+        } else {
+            name = dir;
+        }
+
+        if (parent >= 0) {
+            mkdirat(parent, name, 0755);
+            if (parent != root_fd)
+                close(parent);
         }
-        strncpy(fullpath, resolved_path, pathlen - 1);
-        fullpath[pathlen - 1] = '\0';
-        return 0;
+        *p = '/';
     }
+}
 
-    /* Path doesn't exist - could be for writing. Verify parent. */
-    if (strstr(filename, "..") != NULL) {
-        log_msg(LOG_WARN, "Path traversal attempt blocked: %s", filename);
-        return -1;
+int root_open_dir(const char *root)
+{
+    int fd = open(root, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+        log_msg(LOG_CRITICAL, "Cannot open root directory %s: %s", root, strerror(errno));
+    return fd;
+}
+
+int root_open(int root_fd, const char *root, const char *filename, int flags, mode_t mode)
+{
+    /* Clients name files from the root as often as relative to it */
+    const char *path = filename;
+    while (*path == '/')
+        path++;
+    if (!*path)
+        path = ".";
+
+    int fd = open_under(root_fd, root, path, flags, mode);
+    if (fd == -ENOENT && (flags & O_CREAT) && strchr(path, '/')) {
+        make_parents(root_fd, root, path);
+        fd = open_under(root_fd, root, path, flags, mode);
     }
 
-    /* Use the concatenated path for new files */
-    strncpy(fullpath, temp_path, pathlen - 1);
-    fullpath[pathlen - 1] = '\0';
-    return 0;
+    TRACE_PROBE(path_resolve, filename, fd);
+    if (fd == -EXDEV)
+        log_msg(LOG_WARN, "Path traversal attempt blocked: %s", filename);
+    return fd;
 }
 
-const char* format_size(size_t bytes, char *buf, size_t buflen)
+const char* format_size(uint64_t bytes, char *buf, size_t buflen)
 {
     if (bytes < 1024)
-        snprintf(buf, buflen, "%zu B", bytes);
+        snprintf(buf, buflen, "%llu B", (unsigned long long)bytes);
     else if (bytes < 1024 * 1024)
         snprintf(buf, buflen, "%.1f KB", bytes / 1024.0);
     else if (bytes < 1024 * 1024 * 1024)
@@ -0,0 +1,179 @@
+/*
+ * utftp - Multi-core workers
+ *
+ * Every worker owns a full tftp_server_t: its own SO_REUSEPORT listening
+ * socket, session table and event loop. A classic BPF program attached to
+ * the reuseport group hashes the client address/port so every packet of a
+ * flow (including retransmitted requests) lands on the same worker.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <linux/filter.h>
+#include "../include/worker.h"
+#include "../include/server.h"
+#include "../include/log.h"
+
+static int attach_steering(int sock, int count)
+{
+    /*
+     * A = (saddr ^ sport) * golden ratio >> 16, return A % count.
+     * Offsets are relative to the IP header (no IP options assumed; packets
+     * with options still land on a consistent, if different, worker).
+     */
+    struct sock_filter code[] = {
+        { BPF_LD  | BPF_W | BPF_ABS, 0, 0, SKF_NET_OFF + 12 },
+        { BPF_MISC | BPF_TAX,        0, 0, 0 },
+        { BPF_LD  | BPF_H | BPF_ABS, 0, 0, SKF_NET_OFF + 20 },
+        { BPF_ALU | BPF_XOR | BPF_X, 0, 0, 0 },
+        { BPF_ALU | BPF_MUL | BPF_K, 0, 0, 0x9E3779B1 },
+        { BPF_ALU | BPF_RSH | BPF_K, 0, 0, 16 },
+        { BPF_ALU | BPF_MOD | BPF_K, 0, 0, (uint32_t)count },
+        { BPF_RET | BPF_A,           0, 0, 0 },
+    };
+    struct sock_fprog prog = {
+        .len = sizeof(code) / sizeof(code[0]),
+        .filter = code,
+    };
+
+    if (setsockopt(sock, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) < 0) {
+        log_msg(LOG_WARN, "Flow steering unavailable, using kernel hash: %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static void pin_to_cpu(pthread_t thread, int index)
+{
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0)
+        return;
+
+    int ncpu = CPU_COUNT(&allowed);
+    if (ncpu <= 0)
+        return;
+
+    /* Pick the (index % ncpu)-th CPU we are allowed to run on */
+    int target = index % ncpu;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (!CPU_ISSET(cpu, &allowed))
+            continue;
+        if (target-- == 0) {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(cpu, &set);
+            pthread_setaffinity_np(thread, sizeof(set), &set);
+            return;
+        }
+    }
+}
+
+static void *worker_main(void *arg)
+{
+    tftp_server_run((tftp_server_t *)arg);
+    return NULL;
+}
+
+int workers_init(tftp_workers_t *w, tftp_config_t *config)
+{
+    memset(w, 0, sizeof(*w));
+
+    if (config->workers <= 0) {
+        long n = sysconf(_SC_NPROCESSORS_ONLN);
+        config->workers = (n > 0) ? (int)n : 1;
+    }
+    if (config->workers > MAX_WORKERS)
+        config->workers = MAX_WORKERS;
+
+    /* Every group of every worker has a port of its own from the base up */
+    if (config->mcast_addr[0] &&
+        config->mcast_port + config->workers * MAX_MCAST_GROUPS - 1 > 65535) {
+        log_msg(LOG_CRITICAL, "Multicast ports %u-%d for %d workers run past 65535",
+                config->mcast_port, config->mcast_port + config->workers * MAX_MCAST_GROUPS - 1,
+                config->workers);
+        return -1;
+    }
+
+    w->servers = calloc(config->workers, sizeof(*w->servers));
+    w->threads = calloc(config->workers, sizeof(*w->threads));
+    if (!w->servers || !w->threads) {
+        log_msg(LOG_CRITICAL, "Out of memory allocating workers");
+        workers_cleanup(w);
+        return -1;
+    }
+
+    /* Bind in order: reuseport group index i belongs to worker i */
+    for (int i = 0; i < config->workers; i++) {
+        w->servers[i] = malloc(sizeof(tftp_server_t));
+        if (!w->servers[i]) {
+            log_msg(LOG_CRITICAL, "Out of memory allocating worker %d", i);
+            workers_cleanup(w);
+            return -1;
+        }
+        if (tftp_server_init(w->servers[i], config, i) < 0) {
+            free(w->servers[i]);
+            w->servers[i] = NULL;
+            workers_cleanup(w);
+            return -1;
+        }
+        w->count++;
+    }
+
+    if (w->count > 1) {
+        attach_steering(w->servers[0]->main_sock, w->count);
+    }
+
+    return 0;
+}
+
+int workers_run(tftp_workers_t *w)
+{
+    int started = 1;
+
+    for (int i = 1; i < w->count; i++) {
+        if (pthread_create(&w->threads[i], NULL, worker_main, w->servers[i]) != 0) {
+            log_msg(LOG_ERROR, "Failed to start worker %d", i);
+            break;
+        }
+        pin_to_cpu(w->threads[i], i);
+        started++;
+    }
+
+    /* Worker 0 runs on the calling thread */
+    if (w->count > 1) {
+        pin_to_cpu(pthread_self(), 0);
+    }
+    tftp_server_run(w->servers[0]);
+
+    /* Whichever worker exits first takes the rest down with it */
+    workers_stop(w);
+    for (int i = 1; i < started; i++) {
+        pthread_join(w->threads[i], NULL);
+    }
+
+    return 0;
+}
+
+void workers_stop(tftp_workers_t *w)
+{
+    for (int i = 0; i < w->count; i++) {
+        tftp_server_stop(w->servers[i]);
+    }
+}
+
+void workers_cleanup(tftp_workers_t *w)
+{
+    for (int i = 0; i < w->count; i++) {
+        tftp_server_cleanup(w->servers[i]);
+        free(w->servers[i]);
+    }
+    free(w->servers);
+    free(w->threads);
+    memset(w, 0, sizeof(*w));
+}